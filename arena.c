@@ -0,0 +1,124 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // MAP_NORESERVE, MAP_HUGETLB, MADV_HUGEPAGE
+#include "arena.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static const size_t CACHE_LINE = 64;
+/// transparent huge pages on x86_64 and most arm64 kernels
+static const size_t HUGE_PAGE = 2 << 20;
+
+static size_t round_up(size_t n, size_t multiple) {
+    return (n + multiple - 1) / multiple * multiple;
+}
+
+size_t arena_needed(size_t bytes) {
+    return round_up(bytes, CACHE_LINE);
+}
+
+size_t arena_needed_for_buffer(size_t bytes) {
+    // the colour is less than a page
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return round_up(bytes, page) + page;
+}
+
+struct arena arena_create(size_t capacity) {
+    struct arena arena = {.memory = NULL, .capacity = 0, .used = 0, .buffers = 0};
+    capacity = round_up(capacity, HUGE_PAGE);
+    if (capacity == 0) {
+        return arena;
+    }
+#ifdef ARENA_HUGETLB
+    void *huge = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_HUGETLB, -1, 0);
+    if (huge != MAP_FAILED) {
+        arena.memory = huge;
+        arena.capacity = capacity;
+        return arena;
+    }
+#endif
+    // over-allocate so that the start can be aligned, and give back the rest
+    if (capacity > SIZE_MAX - HUGE_PAGE) {
+        return arena;
+    }
+    size_t reserved = capacity + HUGE_PAGE;
+    char *mapping = mmap(NULL, reserved, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return arena;
+    }
+    char *aligned = (char*)round_up((uintptr_t)mapping, HUGE_PAGE);
+    if (aligned != mapping) {
+        munmap(mapping, aligned - mapping);
+    }
+    if (aligned + capacity != mapping + reserved) {
+        munmap(aligned + capacity, mapping + reserved - (aligned + capacity));
+    }
+    // not important
+    madvise(aligned, capacity, MADV_HUGEPAGE);
+    arena.memory = aligned;
+    arena.capacity = capacity;
+    return arena;
+}
+
+void arena_destroy(struct arena *arena) {
+    if (arena->memory != NULL) {
+        munmap(arena->memory, arena->capacity);
+        arena->memory = NULL;
+    }
+    arena->capacity = arena->used = 0;
+}
+
+/// returns NULL if it doesn't fit.
+static void* bump(struct arena *arena, size_t alignment, size_t offset, size_t bytes) {
+    if (arena->memory == NULL) {
+        return NULL;
+    }
+    size_t start = round_up(arena->used, alignment) + offset;
+    if (start > arena->capacity || arena->capacity - start < bytes) {
+        return NULL;
+    }
+    arena->used = start + bytes;
+    return &arena->memory[start];
+}
+
+void* arena_allocate(struct arena *arena, size_t bytes) {
+    void *allocation = bump(arena, CACHE_LINE, 0, bytes);
+    return allocation != NULL ? allocation : malloc(bytes);
+}
+
+void* arena_allocate_buffer(struct arena *arena, size_t bytes) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t colour = arena->buffers % (page / CACHE_LINE) * CACHE_LINE;
+    void *allocation = bump(arena, page, colour, bytes);
+    if (allocation == NULL) {
+        return malloc(bytes);
+    }
+    arena->buffers++;
+    return allocation;
+}
+
+void arena_free(const struct arena *arena, void *allocation) {
+    if (arena != NULL && arena->memory != NULL && (char*)allocation >= arena->memory
+            && (char*)allocation < arena->memory + arena->capacity) {
+        return;
+    }
+    free(allocation);
+}
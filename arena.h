@@ -0,0 +1,54 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! A bump allocator for what is allocated once at startup, in one anonymous mapping
+//! that is aligned to huge pages so that the kernel can back it with them.
+//! Allocations aren't freed individually; arena_free() only frees what didn't fit.
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+#include <stddef.h>
+#include <stdbool.h>
+
+struct arena {
+    char *memory; //< owned mapping, NULL if it couldn't be created
+    size_t capacity;
+    size_t used;
+    unsigned int buffers; //< how many buffers have been allocated, for choosing their cache colour
+};
+
+/// reserves capacity bytes of address space, of which only what is used gets memory.
+/// If compiled with ARENA_HUGETLB, tries explicitly reserved huge pages first.
+/// Never fails: if the mapping can't be created, every allocation falls back to malloc().
+struct arena arena_create(size_t capacity);
+/// unmaps everything allocated from the arena.
+void arena_destroy(struct arena *arena);
+
+/// returns memory aligned to a cache line, from malloc() if the arena is full,
+/// or NULL if that fails too.
+void* arena_allocate(struct arena *arena, size_t bytes);
+/// like arena_allocate(), but page-aligned plus a multiple of the cache line size that differs between
+/// consecutive buffers, so that the starts of many equally sized buffers don't map to the same cache sets.
+void* arena_allocate_buffer(struct arena *arena, size_t bytes);
+/// free() allocation if it didn't come from the arena. arena can be NULL.
+void arena_free(const struct arena *arena, void *allocation);
+
+/// how much to reserve for an allocation of bytes, including alignment.
+size_t arena_needed(size_t bytes);
+/// like arena_needed(), for arena_allocate_buffer().
+size_t arena_needed_for_buffer(size_t bytes);
+
+#endif // !defined(_ARENA_H_)
@@ -0,0 +1,45 @@
+#!/usr/bin/env bash
+set -e
+
+# This script is ran by `make bench`, which builds the programs it needs first.
+# Set BENCH_LINES to change the size of the workloads, and BENCH_DIR for where to write them.
+# `make release` sets BENCH_TRAIN to an instrumented build, which is then only run on each workload
+# to collect a profile, instead of measuring anything.
+
+lines=${BENCH_LINES:-1000000}
+dir=${BENCH_DIR:-${TMPDIR:-/tmp}/tailmerge-bench}
+logmerge=target/release/logmerge
+
+# file count, line lengths, run lengths, how unevenly lines are spread and how much of keys is shared
+workloads=(
+    '--files=64'
+    '--files=2'
+    '--files=1000'
+    '--files=64 --run-length=1000'
+    '--files=64 --prefix-bytes=32'
+    '--files=64 --line-length=400 --length-distribution=exponential --skew=1'
+)
+# merging 1000 files needs as many file descriptors
+ulimit -n 4096 2> /dev/null || true
+
+header=--header
+for workload in "${workloads[@]}"; do
+    rm -rf "$dir"
+    # shellcheck disable=SC2086
+    ./bench_gen --lines="$lines" $workload "$dir"
+    if [ -n "$BENCH_TRAIN" ]; then
+        "$BENCH_TRAIN" "$dir"/*.log > /dev/null
+        "$BENCH_TRAIN" -j 4 "$dir"/*.log > /dev/null
+        continue
+    fi
+    echo
+    echo "$workload"
+    ./bench_run $header --name=tailmerge --count-with=./tailmerge_counting ./tailmerge "$dir"/*.log
+    header=
+    ./bench_run --name='tailmerge -j 4' --count-with=./tailmerge_counting ./tailmerge -j 4 "$dir"/*.log
+    if [ -x "$logmerge" ]; then
+        # the Rust version isn't as robust
+        ./bench_run --name=logmerge "$logmerge" "$dir"/*.log 2> /dev/null || printf '%-24s failed\n' logmerge
+    fi
+done
+rm -rf "$dir"
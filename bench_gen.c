@@ -0,0 +1,304 @@
+/* tailmerge - A program to sort together files like tail -f
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Generates sorted files whose lines, merged, form one sorted sequence,
+//! with configurable shape so that benchmarks can cover the cases that matter for merging:
+//! how many files there are, how long lines are, how long runs of lines from the same file are,
+//! how unevenly lines are distributed between files, and how many leading bytes all keys share.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <getopt.h>
+#include <sysexits.h>
+#include <sys/stat.h>
+
+const char *HELP_MESSAGE = "\
+Usage: bench_gen [options] directory\n\
+\n\
+Writes files named 0000.log, 0001.log and so on into directory, which is created if necessary.\n\
+Every line starts with a key that is greater than that of the line before it in any file.\n\
+\n\
+Options:\n\
+  --files=N           how many files to write, 64 by default.\n\
+  --lines=N           how many lines to write in total, 1000000 by default.\n\
+  --line-length=N     mean length of lines including the newline, 100 by default.\n\
+                      Can't be shorter than the key.\n\
+  --length-distribution=WHAT  fixed (the default), uniform (between the key and twice the mean)\n\
+                      or exponential.\n\
+  --run-length=N      mean number of consecutive lines from the same file, 1 by default.\n\
+                      The run lengths are geometrically distributed.\n\
+  --skew=S            files get lines in proportion to 1/(index+1)^S, so 0 (the default) is even\n\
+                      and 1 gives the first file about as many lines as the next few put together.\n\
+  --prefix-bytes=N    how many bytes at the start of every key are the same, 0 by default,\n\
+                      which makes comparisons that look at only the first bytes of lines tie.\n\
+  --seed=N            for the random number generator, 1 by default.\n\
+  -h, --help          print this message and exit\n\
+";
+
+enum length_distribution {
+    LENGTH_FIXED,
+    LENGTH_UNIFORM,
+    LENGTH_EXPONENTIAL
+};
+
+struct workload {
+    unsigned int files;
+    unsigned long long lines;
+    unsigned int line_length;
+    enum length_distribution length_distribution;
+    double run_length;
+    double skew;
+    unsigned int prefix_bytes;
+    uint64_t seed;
+};
+
+/// the part of keys after the shared prefix: a zero-padded sequence number and a space
+#define SEQUENCE_DIGITS 12
+/// longest line that is generated, which bounds the exponential distribution
+#define MAX_LINE_LENGTH (1 << 16)
+
+/// xorshift64*, which is plenty for this and gives the same files on every platform
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/// uniform in [0, 1)
+static double random_fraction(uint64_t *state) {
+    return (double)(next_random(state) >> 11) / (double)(1ULL << 53);
+}
+
+static unsigned long long parse_number(const char *arg, const char *option, unsigned long long min,
+                                       unsigned long long max) {
+    char *end;
+    errno = 0;
+    unsigned long long parsed = strtoull(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || *arg == '-' || parsed < min || parsed > max) {
+        fprintf(stderr, "Invalid %s %s\n", option, arg);
+        exit(EX_USAGE);
+    }
+    return parsed;
+}
+
+static double parse_decimal(const char *arg, const char *option, double min) {
+    char *end;
+    errno = 0;
+    double parsed = strtod(arg, &end);
+    if (errno != 0 || end == arg || *end != '\0' || !(parsed >= min) || isinf(parsed)) {
+        fprintf(stderr, "Invalid %s %s\n", option, arg);
+        exit(EX_USAGE);
+    }
+    return parsed;
+}
+
+static size_t line_length(const struct workload *workload, size_t key_length, uint64_t *random) {
+    double length = workload->line_length;
+    if (workload->length_distribution == LENGTH_UNIFORM) {
+        length = key_length + random_fraction(random) * 2 * (workload->line_length - key_length);
+    } else if (workload->length_distribution == LENGTH_EXPONENTIAL) {
+        length = key_length - log(1 - random_fraction(random)) * (workload->line_length - key_length);
+    }
+    if (length < key_length + 1) {
+        return key_length + 1;
+    }
+    return length > MAX_LINE_LENGTH ? MAX_LINE_LENGTH : (size_t)length;
+}
+
+/// pick a file by its weight, with the cumulative weights normalized to end at 1.
+static unsigned int pick_file(const double *cumulative, unsigned int files, uint64_t *random) {
+    double target = random_fraction(random);
+    unsigned int low = 0, high = files - 1;
+    while (low < high) {
+        unsigned int middle = low + (high - low) / 2;
+        if (cumulative[middle] <= target) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static void generate(const struct workload *workload, const char *directory) {
+    if (mkdir(directory, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create %s: %s\n", directory, strerror(errno));
+        exit(EX_CANTCREAT);
+    }
+    FILE **files = malloc(workload->files * sizeof(FILE*));
+    double *cumulative = malloc(workload->files * sizeof(double));
+    char *line = malloc(MAX_LINE_LENGTH);
+    size_t path_capacity = strlen(directory) + 32;
+    char *path = malloc(path_capacity);
+    if (files == NULL || cumulative == NULL || line == NULL || path == NULL) {
+        fputs("Not enough memory.\n", stderr);
+        exit(EX_UNAVAILABLE);
+    }
+    double total_weight = 0;
+    for (unsigned int i=0; i<workload->files; i++) {
+        total_weight += pow(i + 1, -workload->skew);
+        cumulative[i] = total_weight;
+        snprintf(path, path_capacity, "%s/%04u.log", directory, i);
+        files[i] = fopen(path, "w");
+        if (files[i] == NULL) {
+            fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+            exit(EX_CANTCREAT);
+        }
+    }
+    for (unsigned int i=0; i<workload->files; i++) {
+        cumulative[i] /= total_weight;
+    }
+
+    uint64_t random = workload->seed * 0x9E3779B97F4A7C15ULL + 1;
+    // the shared prefix looks like the start of a timestamp
+    static const char PREFIX_PATTERN[] = "2022-06-01T10:00:00.000000+00:00 host ";
+    size_t key_length = workload->prefix_bytes + SEQUENCE_DIGITS + 1;
+    for (size_t i=0; i<workload->prefix_bytes; i++) {
+        line[i] = PREFIX_PATTERN[i % (sizeof(PREFIX_PATTERN) - 1)];
+    }
+    unsigned long long written = 0;
+    // a run ends after each line with probability 1/run_length
+    double run_end = 1 / workload->run_length;
+    unsigned int file = pick_file(cumulative, workload->files, &random);
+    while (written < workload->lines) {
+        unsigned long long sequence = written;
+        for (size_t i=key_length-1; i>workload->prefix_bytes; i--) {
+            line[i-1] = '0' + sequence % 10;
+            sequence /= 10;
+        }
+        line[key_length-1] = ' ';
+        size_t length = line_length(workload, key_length, &random);
+        for (size_t i=key_length; i<length-1; i++) {
+            line[i] = 'a' + next_random(&random) % 26;
+        }
+        line[length-1] = '\n';
+        if (fwrite(line, length, 1, files[file]) != 1) {
+            fprintf(stderr, "Failed to write to file %u: %s\n", file, strerror(errno));
+            exit(EX_IOERR);
+        }
+        written++;
+        if (random_fraction(&random) < run_end) {
+            file = pick_file(cumulative, workload->files, &random);
+        }
+    }
+
+    for (unsigned int i=0; i<workload->files; i++) {
+        if (fclose(files[i]) != 0) {
+            fprintf(stderr, "Failed to write to file %u: %s\n", i, strerror(errno));
+            exit(EX_IOERR);
+        }
+    }
+    free(files);
+    free(cumulative);
+    free(line);
+    free(path);
+}
+
+int main(int argc, char **argv) {
+    enum {
+        OPTION_FILES = 256,
+        OPTION_LINES,
+        OPTION_LINE_LENGTH,
+        OPTION_LENGTH_DISTRIBUTION,
+        OPTION_RUN_LENGTH,
+        OPTION_SKEW,
+        OPTION_PREFIX_BYTES,
+        OPTION_SEED
+    };
+    static const struct option LONG_OPTIONS[] = {
+        {"files", required_argument, NULL, OPTION_FILES},
+        {"lines", required_argument, NULL, OPTION_LINES},
+        {"line-length", required_argument, NULL, OPTION_LINE_LENGTH},
+        {"length-distribution", required_argument, NULL, OPTION_LENGTH_DISTRIBUTION},
+        {"run-length", required_argument, NULL, OPTION_RUN_LENGTH},
+        {"skew", required_argument, NULL, OPTION_SKEW},
+        {"prefix-bytes", required_argument, NULL, OPTION_PREFIX_BYTES},
+        {"seed", required_argument, NULL, OPTION_SEED},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct workload workload = {
+        .files = 64,
+        .lines = 1000000,
+        .line_length = 100,
+        .length_distribution = LENGTH_FIXED,
+        .run_length = 1,
+        .skew = 0,
+        .prefix_bytes = 0,
+        .seed = 1
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "h", LONG_OPTIONS, NULL)) != -1) {
+        switch (option) {
+            case OPTION_FILES:
+                workload.files = parse_number(optarg, "number of files", 1, 100000);
+                break;
+            case OPTION_LINES:
+                workload.lines = parse_number(optarg, "number of lines", 0, 999999999999ULL);
+                break;
+            case OPTION_LINE_LENGTH:
+                workload.line_length = parse_number(optarg, "line length", 1, MAX_LINE_LENGTH);
+                break;
+            case OPTION_LENGTH_DISTRIBUTION:
+                if (strcmp(optarg, "fixed") == 0) {
+                    workload.length_distribution = LENGTH_FIXED;
+                } else if (strcmp(optarg, "uniform") == 0) {
+                    workload.length_distribution = LENGTH_UNIFORM;
+                } else if (strcmp(optarg, "exponential") == 0) {
+                    workload.length_distribution = LENGTH_EXPONENTIAL;
+                } else {
+                    fprintf(stderr, "Unknown length distribution %s\n", optarg);
+                    exit(EX_USAGE);
+                }
+                break;
+            case OPTION_RUN_LENGTH:
+                workload.run_length = parse_decimal(optarg, "run length", 1);
+                break;
+            case OPTION_SKEW:
+                workload.skew = parse_decimal(optarg, "skew", 0);
+                break;
+            case OPTION_PREFIX_BYTES:
+                workload.prefix_bytes = parse_number(optarg, "number of prefix bytes", 0, 4096);
+                break;
+            case OPTION_SEED:
+                workload.seed = parse_number(optarg, "seed", 0, UINT64_MAX);
+                break;
+            case 'h':
+                fputs(HELP_MESSAGE, stdout);
+                exit(EX_OK);
+            default:
+                // getopt_long() has printed the error
+                exit(EX_USAGE);
+        }
+    }
+    if (optind != argc - 1) {
+        fputs(HELP_MESSAGE, stderr);
+        exit(EX_USAGE);
+    }
+    if (workload.line_length < workload.prefix_bytes + SEQUENCE_DIGITS + 2) {
+        fprintf(stderr, "Lines must be at least %u bytes to fit the key\n", workload.prefix_bytes + SEQUENCE_DIGITS + 2);
+        exit(EX_USAGE);
+    }
+    generate(&workload, argv[optind]);
+    return EX_OK;
+}
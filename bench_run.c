@@ -0,0 +1,323 @@
+/* tailmerge - A program to sort together files like tail -f
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Runs a merging program on files and reports its throughput and resource usage:
+//! MB/s and lines/s of input, comparisons per line if the program reports them,
+//! syscalls (counted in a separate run with ptrace, as tracing slows it down) and peak RSS.
+
+#define _GNU_SOURCE // __WALL
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/ptrace.h>
+
+const char *HELP_MESSAGE = "\
+Usage: bench_run [options] [--] program [arguments]...\n\
+\n\
+Runs program with its output discarded, and prints a line with its name and\n\
+MB/s and lines/s of input (arguments that are regular files), comparisons per line (if the program\n\
+prints `comparisons: N` to stderr, which tailmerge does when compiled with -DHEAP_COUNT_COMPARISONS),\n\
+syscalls and peak RSS in KiB.\n\
+\n\
+Options:\n\
+  --repeat=N          run the program N times and report the fastest, 3 by default.\n\
+  --name=NAME         what to call the program in the report, instead of its path.\n\
+  --no-syscalls       don't do an extra traced run to count syscalls.\n\
+  --count-with=PATH   get comparisons from an extra run of another build of the program,\n\
+                      so that counting them doesn't affect the measured speed.\n\
+  --header            print the column names before the report.\n\
+  -h, --help          print this message and exit\n\
+";
+
+/// what a run measured
+struct measurement {
+    double seconds;
+    long peak_rss_kib;
+    long long comparisons; //< -1 if not reported
+};
+
+// print error messages and exit if `ret` is negative,
+// otherwise pass it through to caller.
+static int checkerr(int ret, int status, const char *desc) {
+    if (ret >= 0) {
+        return ret;
+    }
+    fprintf(stderr, "Failed to %s: %s\n", desc, strerror(errno));
+    exit(status);
+}
+
+static double monotonic_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/// sum the sizes and count the lines of the arguments that are regular files
+static void count_input(char **args, long long *bytes, long long *lines) {
+    static char buffer[1 << 16];
+    *bytes = 0;
+    *lines = 0;
+    for (; *args != NULL; args++) {
+        struct stat info;
+        if (stat(*args, &info) != 0 || !S_ISREG(info.st_mode)) {
+            continue;
+        }
+        int fd = open(*args, O_RDONLY);
+        checkerr(fd, EX_NOINPUT, "open input");
+        ssize_t read_bytes;
+        while ((read_bytes = read(fd, buffer, sizeof(buffer))) > 0) {
+            *bytes += read_bytes;
+            for (char *newline = buffer; (newline = memchr(newline, '\n', buffer + read_bytes - newline)) != NULL; ) {
+                (*lines)++;
+                newline++;
+            }
+        }
+        checkerr((int)read_bytes, EX_IOERR, "read input");
+        close(fd);
+    }
+}
+
+/// run the program, discarding stdout and passing stderr through except for the comparisons line.
+static struct measurement run(char **program) {
+    int out[2], err[2];
+    checkerr(pipe(out), EX_OSERR, "create pipe");
+    checkerr(pipe(err), EX_OSERR, "create pipe");
+    double start = monotonic_seconds();
+    pid_t child = checkerr(fork(), EX_OSERR, "fork");
+    if (child == 0) {
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        close(out[0]);
+        close(out[1]);
+        close(err[0]);
+        close(err[1]);
+        execvp(program[0], program);
+        fprintf(stderr, "Failed to run %s: %s\n", program[0], strerror(errno));
+        _exit(EX_UNAVAILABLE);
+    }
+    close(out[1]);
+    close(err[1]);
+
+    struct measurement measured = {.comparisons = -1};
+    // drain stdout as the program would write to a fast destination, and collect stderr
+    static char discard[1 << 16];
+    char *errors = NULL;
+    size_t errors_length = 0;
+    struct pollfd fds[2] = {{.fd = out[0], .events = POLLIN}, {.fd = err[0], .events = POLLIN}};
+    while (fds[0].fd >= 0 || fds[1].fd >= 0) {
+        checkerr(poll(fds, 2, -1), EX_OSERR, "wait for output");
+        for (int i=0; i<2; i++) {
+            if (fds[i].fd < 0 || fds[i].revents == 0) {
+                continue;
+            }
+            ssize_t read_bytes = read(fds[i].fd, discard, sizeof(discard));
+            checkerr((int)read_bytes, EX_IOERR, "read output");
+            if (read_bytes == 0) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+            } else if (i == 1) {
+                char *grown = realloc(errors, errors_length + read_bytes + 1);
+                if (grown == NULL) {
+                    fputs("Not enough memory.\n", stderr);
+                    exit(EX_UNAVAILABLE);
+                }
+                errors = grown;
+                memcpy(&errors[errors_length], discard, read_bytes);
+                errors_length += read_bytes;
+                errors[errors_length] = '\0';
+            }
+        }
+    }
+    int status;
+    struct rusage usage;
+    checkerr(wait4(child, &status, 0, &usage), EX_OSERR, "wait for the program");
+    measured.seconds = monotonic_seconds() - start;
+    measured.peak_rss_kib = usage.ru_maxrss;
+
+    for (char *line = errors; line != NULL && *line != '\0'; ) {
+        char *end = strchr(line, '\n');
+        size_t length = end != NULL ? (size_t)(end - line + 1) : strlen(line);
+        if (sscanf(line, "comparisons: %lld", &measured.comparisons) != 1) {
+            fwrite(line, length, 1, stderr);
+        }
+        line += length;
+    }
+    free(errors);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed\n", program[0]);
+        exit(EX_SOFTWARE);
+    }
+    return measured;
+}
+
+/// run the program under ptrace with output discarded, and count syscalls made by all its threads.
+/// returns -1 if it can't be traced.
+static long long count_syscalls(char **program) {
+    pid_t child = checkerr(fork(), EX_OSERR, "fork");
+    if (child == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0) {
+            _exit(EX_UNAVAILABLE);
+        }
+        raise(SIGSTOP);
+        execvp(program[0], program);
+        _exit(EX_UNAVAILABLE);
+    }
+    int status;
+    checkerr(waitpid(child, &status, 0), EX_OSERR, "wait for the program");
+    if (!WIFSTOPPED(status)) {
+        return -1;
+    }
+    long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK
+                 | PTRACE_O_EXITKILL;
+    if (ptrace(PTRACE_SETOPTIONS, child, NULL, (void*)options) != 0
+            || ptrace(PTRACE_SYSCALL, child, NULL, NULL) != 0) {
+        kill(child, SIGKILL);
+        waitpid(child, &status, 0);
+        return -1;
+    }
+    // every syscall stops the thread once on entry and once on exit
+    long long stops = 0;
+    pid_t stopped;
+    while ((stopped = waitpid(-1, &status, __WALL)) > 0) {
+        if (!WIFSTOPPED(status)) {
+            continue;
+        }
+        int signal = WSTOPSIG(status);
+        if (signal == (SIGTRAP | 0x80)) {
+            stops++;
+            signal = 0;
+        } else if (signal == SIGTRAP || signal == SIGSTOP) {
+            // exec, clone, or a new thread starting
+            signal = 0;
+        }
+        ptrace(PTRACE_SYSCALL, stopped, NULL, (void*)(long)signal);
+    }
+    return (stops + 1) / 2;
+}
+
+int main(int argc, char **argv) {
+    enum {
+        OPTION_REPEAT = 256,
+        OPTION_NAME,
+        OPTION_NO_SYSCALLS,
+        OPTION_COUNT_WITH,
+        OPTION_HEADER
+    };
+    static const struct option LONG_OPTIONS[] = {
+        {"repeat", required_argument, NULL, OPTION_REPEAT},
+        {"name", required_argument, NULL, OPTION_NAME},
+        {"no-syscalls", no_argument, NULL, OPTION_NO_SYSCALLS},
+        {"count-with", required_argument, NULL, OPTION_COUNT_WITH},
+        {"header", no_argument, NULL, OPTION_HEADER},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int repeat = 3;
+    const char *name = NULL, *count_with = NULL;
+    bool syscalls = true, header = false;
+    int option;
+    // + stops at the program, so that its options aren't parsed
+    while ((option = getopt_long(argc, argv, "+h", LONG_OPTIONS, NULL)) != -1) {
+        switch (option) {
+            case OPTION_REPEAT: {
+                char *end;
+                errno = 0;
+                long parsed = strtol(optarg, &end, 10);
+                if (errno != 0 || end == optarg || *end != '\0' || parsed < 1 || parsed > 1000) {
+                    fprintf(stderr, "Invalid number of runs %s\n", optarg);
+                    exit(EX_USAGE);
+                }
+                repeat = (int)parsed;
+                break;
+            }
+            case OPTION_NAME:
+                name = optarg;
+                break;
+            case OPTION_NO_SYSCALLS:
+                syscalls = false;
+                break;
+            case OPTION_COUNT_WITH:
+                count_with = optarg;
+                break;
+            case OPTION_HEADER:
+                header = true;
+                break;
+            case 'h':
+                fputs(HELP_MESSAGE, stdout);
+                exit(EX_OK);
+            default:
+                // getopt_long() has printed the error
+                exit(EX_USAGE);
+        }
+    }
+    if (optind == argc) {
+        fputs(HELP_MESSAGE, stderr);
+        exit(EX_USAGE);
+    }
+    char **program = &argv[optind];
+    if (name == NULL) {
+        name = program[0];
+    }
+
+    long long input_bytes, input_lines;
+    count_input(&program[1], &input_bytes, &input_lines);
+    struct measurement best = {.seconds = -1};
+    for (int i=0; i<repeat; i++) {
+        struct measurement measured = run(program);
+        if (best.seconds < 0 || measured.seconds < best.seconds) {
+            best = measured;
+        }
+    }
+    long long syscall_count = syscalls ? count_syscalls(program) : -1;
+    if (count_with != NULL) {
+        const char *measured = program[0];
+        program[0] = (char*)count_with;
+        best.comparisons = run(program).comparisons;
+        program[0] = (char*)measured;
+    }
+
+    if (header) {
+        printf("%-24s %10s %12s %12s %10s %10s\n", "program", "MB/s", "lines/s", "cmp/line", "syscalls", "RSS KiB");
+    }
+    printf("%-24s %10.1f %12.0f ", name, input_bytes / best.seconds / 1e6, input_lines / best.seconds);
+    if (best.comparisons >= 0 && input_lines > 0) {
+        printf("%12.2f ", (double)best.comparisons / input_lines);
+    } else {
+        printf("%12s ", "-");
+    }
+    if (syscall_count >= 0) {
+        printf("%10lld ", syscall_count);
+    } else {
+        printf("%10s ", "-");
+    }
+    printf("%10ld\n", best.peak_rss_kib);
+    return EX_OK;
+}
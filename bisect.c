@@ -0,0 +1,190 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // pread() when compiling as c11
+#include "bisect.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+/// how much to read at a time when looking for the end of a line
+static const size_t READ_SIZE = 4096;
+
+struct bisect bisect_create(int fd, off_t size, const struct key_spec *key,
+                            enum heap_type order, enum timestamp_format format) {
+    struct bisect bisect = {
+        .fd = fd,
+        .size = size,
+        .order = order,
+        .format = format,
+        .key = key,
+        .buffer = NULL,
+        .capacity = 0
+    };
+    return bisect;
+}
+
+void bisect_destroy(struct bisect *bisect) {
+    free(bisect->buffer);
+    bisect->buffer = NULL;
+    bisect->capacity = 0;
+}
+
+int bisect_compare(enum heap_type order, const struct bisect_key *a, const struct bisect_key *b) {
+    if (order == NUMBER_MIN) {
+        // NaN is less than everything, like in the heap
+        if (a->number != a->number || b->number != b->number) {
+            return (b->number != b->number) - (a->number != a->number);
+        }
+        return a->number < b->number ? -1 : a->number > b->number;
+    } else if (order == TIME_MIN) {
+        if (a->timestamp.tv_sec != b->timestamp.tv_sec) {
+            return a->timestamp.tv_sec < b->timestamp.tv_sec ? -1 : 1;
+        }
+        return a->timestamp.tv_usec < b->timestamp.tv_usec ? -1 : a->timestamp.tv_usec > b->timestamp.tv_usec;
+    }
+    size_t a_length = a->line.iov_len, b_length = b->line.iov_len;
+    if (a->is_prefix && b_length > a_length) {
+        b_length = a_length;
+    } else if (b->is_prefix && a_length > b_length) {
+        a_length = b_length;
+    }
+    if (order == VERSION_MIN) {
+        struct iovec a_key = {.iov_base = a->line.iov_base, .iov_len = a_length};
+        struct iovec b_key = {.iov_base = b->line.iov_base, .iov_len = b_length};
+        return heap_compare_versions(a_key, b_key);
+    }
+    size_t min_length = a_length < b_length ? a_length : b_length;
+    int cmp = min_length == 0 ? 0 : memcmp(a->line.iov_base, b->line.iov_base, min_length);
+    if (cmp == 0) {
+        cmp = a_length < b_length ? -1 : a_length > b_length;
+    }
+    return cmp;
+}
+
+/// read from offset into buffer at `at`, growing it if necessary.
+/// returns the number of bytes read, which is 0 at size.
+static ssize_t read_more(struct bisect *bisect, size_t at, off_t offset) {
+    if (offset >= bisect->size) {
+        return 0;
+    }
+    if (bisect->capacity - at < READ_SIZE) {
+        size_t capacity = bisect->capacity == 0 ? READ_SIZE : bisect->capacity * 2;
+        char *grown = realloc(bisect->buffer, capacity);
+        if (grown == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        bisect->buffer = grown;
+        bisect->capacity = capacity;
+    }
+    size_t length = bisect->capacity - at;
+    if ((off_t)length > bisect->size - offset) {
+        length = bisect->size - offset;
+    }
+    while (true) {
+        ssize_t read_bytes = pread(bisect->fd, &bisect->buffer[at], length, offset);
+        if (read_bytes >= 0 || errno != EINTR) {
+            return read_bytes;
+        }
+    }
+}
+
+/// find the start of the first line at or after offset.
+static off_t line_start(struct bisect *bisect, off_t offset) {
+    if (offset == 0) {
+        return 0;
+    }
+    // the byte before says whether offset is already at the start of a line
+    offset--;
+    while (true) {
+        ssize_t read_bytes = read_more(bisect, 0, offset);
+        if (read_bytes <= 0) {
+            return read_bytes < 0 ? -1 : bisect->size;
+        }
+        char *newline = memchr(bisect->buffer, '\n', read_bytes);
+        if (newline != NULL) {
+            return offset + (newline - bisect->buffer) + 1;
+        }
+        offset += read_bytes;
+    }
+}
+
+bool bisect_key_of_line(const struct bisect *bisect, struct iovec line, struct bisect_key *key) {
+    key->line = key_extract(bisect->key, line);
+    key->is_prefix = false;
+    if (bisect->order == NUMBER_MIN) {
+        key->number = key_number(bisect->key, key->line);
+    }
+    return bisect->order != TIME_MIN
+        || timestamp_parse(bisect->format, key->line.iov_base, key->line.iov_len, &key->timestamp);
+}
+
+off_t bisect_line_at(struct bisect *bisect, off_t offset, struct bisect_key *key) {
+    off_t start = line_start(bisect, offset);
+    while (start >= 0 && start < bisect->size) {
+        // read the whole line into the buffer
+        size_t length = 0;
+        char *newline = NULL;
+        while (newline == NULL) {
+            ssize_t read_bytes = read_more(bisect, length, start + length);
+            if (read_bytes < 0) {
+                return -1;
+            } else if (read_bytes == 0) {
+                // the file doesn't end with a newline
+                break;
+            }
+            newline = memchr(&bisect->buffer[length], '\n', read_bytes);
+            length += read_bytes;
+        }
+        if (newline != NULL) {
+            length = newline - bisect->buffer + 1;
+        }
+        struct iovec line = { .iov_base = bisect->buffer, .iov_len = length };
+        if (bisect_key_of_line(bisect, line, key)) {
+            return start;
+        }
+        start += length;
+    }
+    return start;
+}
+
+off_t bisect_find(struct bisect *bisect, const struct bisect_key *key, bool include_equal) {
+    return bisect_find_between(bisect, key, include_equal, 0, bisect->size);
+}
+
+off_t bisect_find_between(struct bisect *bisect, const struct bisect_key *key, bool include_equal,
+                          off_t low, off_t high) {
+    // the line found at an offset never moves backwards when the offset increases,
+    // so whether it's after the key can be binary searched for
+    while (low < high) {
+        off_t middle = low + (high - low) / 2;
+        struct bisect_key found;
+        off_t start = bisect_line_at(bisect, middle, &found);
+        if (start < 0) {
+            return -1;
+        }
+        int cmp = start == bisect->size ? 1 : bisect_compare(bisect->order, &found, key);
+        if (cmp > 0 || (cmp == 0 && include_equal)) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    struct bisect_key found;
+    return bisect_line_at(bisect, low, &found);
+}
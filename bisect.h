@@ -0,0 +1,78 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Finding lines in sorted regular files without reading all of them,
+//! by reading the line at a byte offset with pread() and binary searching.
+
+#ifndef _BISECT_H_
+#define _BISECT_H_
+#include "timestamp.h"
+#include "key.h"
+#include "heap.h" // enum heap_type
+#include <sys/types.h> // off_t
+#include <sys/uio.h> // struct iovec
+#include <sys/time.h> // struct timeval
+#include <stdbool.h>
+
+/// what lines are sorted by: the key part of the line, the timestamp at the start of it, or its number.
+struct bisect_key {
+    struct iovec line; //< the key part of the line
+    struct timeval timestamp; //< only set when searching by timestamp
+    double number; //< only set when searching by number
+    /// lines are compared with only as many bytes as this key has, so that lines starting with it equal it
+    bool is_prefix;
+};
+
+struct bisect {
+    int fd; //< borrowed
+    off_t size; //< only lines starting before this are searched
+    enum heap_type order; //< TIME_MIN searches by timestamp and NUMBER_MIN by key_number()
+    enum timestamp_format format;
+    const struct key_spec *key; //< borrowed, which part of lines to compare
+    char *buffer; //< owned, holds the last line read
+    size_t capacity; //< of buffer, which grows to fit the longest line read
+};
+
+/// Doesn't allocate until a line is read.
+struct bisect bisect_create(int fd, off_t size, const struct key_spec *key,
+                            enum heap_type order, enum timestamp_format format);
+void bisect_destroy(struct bisect *bisect);
+
+/// Orders keys the same way as a heap of the given type:
+/// by memcmp() and then by length, as versions, by timestamp or by number.
+int bisect_compare(enum heap_type order, const struct bisect_key *a, const struct bisect_key *b);
+
+/// Sets key to the compared part of line, and its timestamp or number if searching by them.
+/// Returns false if searching by timestamp and the line doesn't have one.
+/// key.line points into line.
+bool bisect_key_of_line(const struct bisect *bisect, struct iovec line, struct bisect_key *key);
+
+/// Finds the first line that starts at or after offset, skipping lines without a timestamp
+/// when searching by them, as they belong to the line before.
+/// Returns the offset of the line, or size if there is none, in which case key isn't set.
+/// key.line points into the buffer and is only valid until the next call.
+/// Returns -1 with errno set if reading failed.
+off_t bisect_line_at(struct bisect *bisect, off_t offset, struct bisect_key *key);
+
+/// Finds the offset of the first line with a key greater than key, or of the first that is greater or equal
+/// if `include_equal` is true. Returns size if there is none, or -1 with errno set if reading failed.
+off_t bisect_find(struct bisect *bisect, const struct bisect_key *key, bool include_equal);
+/// Like bisect_find(), for when the line is known to start after low-1 and at or before high,
+/// such as from an index.
+off_t bisect_find_between(struct bisect *bisect, const struct bisect_key *key, bool include_equal,
+                          off_t low, off_t high);
+
+#endif // !defined(_BISECT_H_)
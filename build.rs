@@ -0,0 +1,8 @@
+// libtailmerge.so is built by make in the same directory
+fn main() {
+    if std::env::var_os("CARGO_FEATURE_LIBTAILMERGE").is_some() {
+        let directory = std::env::var("CARGO_MANIFEST_DIR").unwrap();
+        println!("cargo:rustc-link-search=native={}", directory);
+        println!("cargo:rerun-if-changed={}/libtailmerge.so", directory);
+    }
+}
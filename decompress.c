@@ -0,0 +1,332 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // pread() when compiling as c11
+#include "decompress.h"
+#include "stats.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h> // UINT_MAX
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dlfcn.h>
+#include <pthread.h> // pthread_once()
+#include <zlib.h>
+
+/// how much compressed data to read at a time
+#define INPUT_SIZE (64 << 10)
+
+// the parts of the zstd and lz4 APIs that are used, which are stable but aren't necessarily installed
+struct zstd_in {
+    const void *src;
+    size_t size;
+    size_t pos;
+};
+struct zstd_out {
+    void *dst;
+    size_t size;
+    size_t pos;
+};
+static struct {
+    bool loaded;
+    void* (*create_stream)(void);
+    size_t (*free_stream)(void *stream);
+    size_t (*init_stream)(void *stream);
+    size_t (*decompress_stream)(void *stream, struct zstd_out *output, struct zstd_in *input);
+    unsigned (*is_error)(size_t code);
+} zstd;
+static const unsigned LZ4F_VERSION = 100;
+static struct {
+    bool loaded;
+    size_t (*create_context)(void **context, unsigned version);
+    size_t (*free_context)(void *context);
+    size_t (*decompress)(void *context, void *output, size_t *output_size,
+                         const void *input, size_t *input_size, const void *options);
+    unsigned (*is_error)(size_t code);
+} lz4;
+
+/// stores the address of a function in the library into the function pointer at `function`.
+static bool load_function(void *library, const char *name, void *function) {
+    void *address = dlsym(library, name);
+    // function pointers can't be assigned from void* in ISO C, so copy the bits as POSIX suggests
+    memcpy(function, &address, sizeof(address));
+    return address != NULL;
+}
+
+/// the libraries are loaded by the first thread that needs them, as libtailmerge can merge on several at once
+static pthread_once_t zstd_loading = PTHREAD_ONCE_INIT;
+static pthread_once_t lz4_loading = PTHREAD_ONCE_INIT;
+
+static void try_loading_zstd(void) {
+    void *library = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+    zstd.loaded = library != NULL
+        && load_function(library, "ZSTD_createDStream", &zstd.create_stream)
+        && load_function(library, "ZSTD_freeDStream", &zstd.free_stream)
+        && load_function(library, "ZSTD_initDStream", &zstd.init_stream)
+        && load_function(library, "ZSTD_decompressStream", &zstd.decompress_stream)
+        && load_function(library, "ZSTD_isError", &zstd.is_error);
+    // the library is never unloaded
+}
+
+static bool load_zstd(void) {
+    pthread_once(&zstd_loading, try_loading_zstd);
+    return zstd.loaded;
+}
+
+static void try_loading_lz4(void) {
+    void *library = dlopen("liblz4.so.1", RTLD_NOW | RTLD_LOCAL);
+    lz4.loaded = library != NULL
+        && load_function(library, "LZ4F_createDecompressionContext", &lz4.create_context)
+        && load_function(library, "LZ4F_freeDecompressionContext", &lz4.free_context)
+        && load_function(library, "LZ4F_decompress", &lz4.decompress)
+        && load_function(library, "LZ4F_isError", &lz4.is_error);
+}
+
+static bool load_lz4(void) {
+    pthread_once(&lz4_loading, try_loading_lz4);
+    return lz4.loaded;
+}
+
+enum compression compression_detect(int fd) {
+    struct stat info;
+    unsigned char magic[4];
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || pread(fd, magic, 4, 0) != 4) {
+        return COMPRESSION_NONE;
+    } else if (magic[0] == 0x1f && magic[1] == 0x8b) {
+        return COMPRESSION_GZIP;
+    } else if (memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0) {
+        return COMPRESSION_ZSTD;
+    } else if (memcmp(magic, "\x04\x22\x4d\x18", 4) == 0) {
+        return COMPRESSION_LZ4;
+    }
+    return COMPRESSION_NONE;
+}
+
+const char* compression_name(enum compression compression) {
+    switch (compression) {
+        case COMPRESSION_GZIP: return "gzip";
+        case COMPRESSION_ZSTD: return "zstd";
+        case COMPRESSION_LZ4: return "lz4";
+        default: return "uncompressed";
+    }
+}
+
+struct decompressor {
+    enum compression compression;
+    int fd; //< borrowed
+    unsigned char *input; //< owned buffer of INPUT_SIZE bytes
+    size_t input_start; //< offset of the first byte in input that hasn't been decompressed
+    size_t input_length; //< how many bytes of input are read
+    bool input_ended; //< the file has been read to the end
+    bool frame_ended; //< the last data decompressed completed a gzip member or a zstd or lz4 frame
+    off_t input_offset; //< position in the file of input[0]
+    off_t frame_offset; //< position in the file where the member or frame being decompressed starts
+    union {
+        z_stream gzip;
+        void *zstd;
+        void *lz4;
+    } state;
+};
+
+struct decompressor* decompressor_create(enum compression compression, int fd) {
+    if ((compression == COMPRESSION_ZSTD && !load_zstd()) || (compression == COMPRESSION_LZ4 && !load_lz4())
+            || compression == COMPRESSION_NONE) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+    struct decompressor *decompressor = malloc(sizeof(struct decompressor));
+    unsigned char *input = malloc(INPUT_SIZE);
+    if (decompressor == NULL || input == NULL) {
+        free(decompressor);
+        free(input);
+        errno = ENOMEM;
+        return NULL;
+    }
+    decompressor->compression = compression;
+    decompressor->fd = fd;
+    decompressor->input = input;
+    decompressor->input_start = decompressor->input_length = 0;
+    decompressor->input_ended = false;
+    decompressor->frame_ended = false;
+    off_t position = lseek(fd, 0, SEEK_CUR);
+    decompressor->input_offset = decompressor->frame_offset = position < 0 ? 0 : position;
+    bool initialized = false;
+    if (compression == COMPRESSION_GZIP) {
+        memset(&decompressor->state.gzip, 0, sizeof(z_stream));
+        // 15 is the maximum window size, and 16 is added to only accept gzip headers
+        initialized = inflateInit2(&decompressor->state.gzip, 15 + 16) == Z_OK;
+    } else if (compression == COMPRESSION_ZSTD) {
+        decompressor->state.zstd = zstd.create_stream();
+        initialized = decompressor->state.zstd != NULL
+            && !zstd.is_error(zstd.init_stream(decompressor->state.zstd));
+    } else {
+        initialized = !lz4.is_error(lz4.create_context(&decompressor->state.lz4, LZ4F_VERSION));
+    }
+    if (!initialized) {
+        decompressor_destroy(decompressor);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return decompressor;
+}
+
+void decompressor_destroy(struct decompressor *decompressor) {
+    if (decompressor->compression == COMPRESSION_GZIP) {
+        inflateEnd(&decompressor->state.gzip);
+    } else if (decompressor->compression == COMPRESSION_ZSTD && decompressor->state.zstd != NULL) {
+        zstd.free_stream(decompressor->state.zstd);
+    } else if (decompressor->compression == COMPRESSION_LZ4 && decompressor->state.lz4 != NULL) {
+        lz4.free_context(decompressor->state.lz4);
+    }
+    free(decompressor->input);
+    free(decompressor);
+}
+
+/// decompress some of the input into output.
+/// returns the number of bytes produced and adds to *consumed, or returns -1 if the data is corrupt.
+static ssize_t decompress_some(struct decompressor *d, void *output, size_t length, size_t *consumed) {
+    const unsigned char *input = &d->input[d->input_start];
+    size_t available = d->input_length - d->input_start;
+    if (d->compression == COMPRESSION_GZIP) {
+        z_stream *stream = &d->state.gzip;
+        if (d->frame_ended && available != 0) {
+            // files can contain several concatenated members
+            inflateReset(stream);
+            d->frame_ended = false;
+        }
+        stream->next_in = (unsigned char*)input;
+        stream->avail_in = available > UINT_MAX ? UINT_MAX : available;
+        stream->next_out = output;
+        stream->avail_out = length > UINT_MAX ? UINT_MAX : length;
+        unsigned int in_before = stream->avail_in, out_before = stream->avail_out;
+        int result = inflate(stream, Z_NO_FLUSH);
+        if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+            return -1;
+        }
+        d->frame_ended = result == Z_STREAM_END;
+        *consumed = in_before - stream->avail_in;
+        return out_before - stream->avail_out;
+    } else if (d->compression == COMPRESSION_ZSTD) {
+        struct zstd_in in = {.src = input, .size = available, .pos = 0};
+        struct zstd_out out = {.dst = output, .size = length, .pos = 0};
+        size_t result = zstd.decompress_stream(d->state.zstd, &out, &in);
+        if (zstd.is_error(result)) {
+            return -1;
+        }
+        // 0 means that a frame is completely decoded and flushed
+        d->frame_ended = result == 0;
+        *consumed = in.pos;
+        return out.pos;
+    } else {
+        size_t in_size = available, out_size = length;
+        size_t result = lz4.decompress(d->state.lz4, output, &out_size, input, &in_size, NULL);
+        if (lz4.is_error(result)) {
+            return -1;
+        }
+        d->frame_ended = result == 0;
+        *consumed = in_size;
+        return out_size;
+    }
+}
+
+ssize_t decompressor_read(void *opaque, void *buffer, size_t length) {
+    struct decompressor *d = opaque;
+    while (true) {
+        if (d->input_start == d->input_length && !d->input_ended) {
+            ssize_t read_bytes = read(d->fd, d->input, INPUT_SIZE);
+            if (read_bytes < 0 && errno == EINTR) {
+                continue;
+            } else if (read_bytes < 0) {
+                return -1;
+            }
+            STAT_ADD(STAT_READS, 1);
+            STAT_ADD(STAT_READ_BYTES, read_bytes);
+            d->input_ended = read_bytes == 0;
+            d->input_offset += d->input_length;
+            d->input_start = 0;
+            d->input_length = read_bytes;
+        }
+        if (d->input_ended && d->input_start == d->input_length && d->frame_ended) {
+            // calling the decoder again would start a new, empty frame
+            return 0;
+        }
+        if (d->frame_ended) {
+            // the decoders stop at the end of a frame, so what they produce next is from the one after it
+            d->frame_offset = d->input_offset + d->input_start;
+        }
+        size_t consumed = 0;
+        ssize_t produced = decompress_some(d, buffer, length, &consumed);
+        if (produced < 0) {
+            errno = EIO;
+            return -1;
+        }
+        d->input_start += consumed;
+        if (produced > 0) {
+            return produced;
+        } else if (d->input_ended && d->input_start == d->input_length) {
+            if (!d->frame_ended) {
+                // truncated
+                errno = EIO;
+                return -1;
+            }
+            return 0;
+        } else if (consumed == 0 && d->input_start != d->input_length) {
+            // can't make progress, which shouldn't happen with valid data
+            errno = EIO;
+            return -1;
+        }
+    }
+}
+
+off_t decompressor_frame_offset(const struct decompressor *decompressor) {
+    return decompressor->frame_offset;
+}
+
+int decompressor_seek_frame(struct decompressor *d, off_t frame_offset, off_t skip) {
+    if (lseek(d->fd, frame_offset, SEEK_SET) < 0) {
+        return -1;
+    }
+    d->input_start = d->input_length = 0;
+    d->input_ended = false;
+    d->input_offset = d->frame_offset = frame_offset;
+    // as if the previous frame just ended, which also makes gzip start a new member
+    d->frame_ended = true;
+    if (d->compression == COMPRESSION_ZSTD && zstd.is_error(zstd.init_stream(d->state.zstd))) {
+        errno = ENOMEM;
+        return -1;
+    } else if (d->compression == COMPRESSION_LZ4) {
+        // resetting requires a newer liblz4
+        lz4.free_context(d->state.lz4);
+        d->state.lz4 = NULL;
+        if (lz4.is_error(lz4.create_context(&d->state.lz4, LZ4F_VERSION))) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    unsigned char discarded[4096];
+    while (skip > 0) {
+        size_t length = skip < (off_t)sizeof(discarded) ? (size_t)skip : sizeof(discarded);
+        ssize_t read_bytes = decompressor_read(d, discarded, length);
+        if (read_bytes <= 0) {
+            errno = read_bytes == 0 ? EIO : errno;
+            return -1;
+        }
+        skip -= read_bytes;
+    }
+    return 0;
+}
@@ -0,0 +1,57 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+//! Reading gzip, zstd and lz4 compressed files as if they weren't.
+//! gzip uses zlib, while zstd and lz4 are only supported if their libraries can be loaded at runtime.
+
+#ifndef _DECOMPRESS_H_
+#define _DECOMPRESS_H_
+#include <stddef.h> // size_t
+#include <sys/types.h> // ssize_t, off_t
+
+enum compression {
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_ZSTD,
+    COMPRESSION_LZ4
+};
+
+/// Checks the magic bytes at the start of a regular file without changing its position.
+/// Returns COMPRESSION_NONE for other files and if it can't be read.
+enum compression compression_detect(int fd);
+const char* compression_name(enum compression compression);
+
+struct decompressor;
+
+/// The decompressor reads from fd but doesn't own it.
+/// Returns NULL and sets errno if the format isn't supported (ENOTSUP) or memory couldn't be allocated.
+struct decompressor* decompressor_create(enum compression compression, int fd);
+void decompressor_destroy(struct decompressor *decompressor);
+/// Works like read(), and has the same signature as readahead_reader
+/// so that decompression can happen in the background.
+/// Corrupt data is reported as EIO.
+ssize_t decompressor_read(void *decompressor, void *buffer, size_t length);
+
+/// Where in the file the gzip member or zstd or lz4 frame that the bytes last returned by decompressor_read()
+/// are from starts. The decoders stop at the end of each, so the bytes returned by a read are never from two.
+off_t decompressor_frame_offset(const struct decompressor *decompressor);
+/// Continues decompressing from a member or frame that starts at frame_offset in the file,
+/// and discards the first skip bytes of what it decompresses to.
+/// Returns -1 and sets errno if that fails.
+int decompressor_seek_frame(struct decompressor *decompressor, off_t frame_offset, off_t skip);
+
+#endif // !defined(_DECOMPRESS_H_)
@@ -0,0 +1,44 @@
+/* logmerge - A program to merge files like tail -f
+ * Copyright (C) 2021 Torbjørn Birch Moltu
+ *
+ * licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Merges with libtailmerge and writes the output like tailmerge does, for testing the bindings:
+//! `make libtailmerge.so && LD_LIBRARY_PATH=. cargo run --features libtailmerge --example embedded -- FILE...`
+
+use std::env::args_os;
+use std::io::{stdout, Write};
+use std::process::exit;
+
+fn main() {
+    let args = args_os().skip(1).collect::<Vec<_>>();
+    let stdout = stdout();
+    let mut stdout = stdout.lock();
+    let result = logmerge::merge(&args, |slices| {
+        for slice in slices {
+            if let Err(e) = stdout.write_all(slice) {
+                eprintln!("Error writing to stdout: {}", e);
+                exit(4);
+            }
+        }
+    });
+    let _ = stdout.flush();
+    match result {
+        Ok(code) => exit(code),
+        Err(e) => {
+            eprintln!("{}", e);
+            exit(e.code);
+        }
+    }
+}
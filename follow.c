@@ -0,0 +1,249 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // strdup() when compiling as c11
+#include "follow.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#endif
+
+struct followed {
+    int file_watch; //< inotify watch of a regular file, or -1
+    int directory_watch; //< inotify watch of the directory containing it, or -1
+    char *name; //< owned copy of the last component of the path
+    int fd; //< followed with epoll instead, or -1
+};
+
+struct follow {
+    int epoll_fd;
+    int inotify_fd;
+    unsigned int files_length;
+    struct followed files[];
+};
+
+#ifdef __linux__
+/// the epoll data for the inotify fd, which is otherwise the id of a followed fd
+static const uint64_t INOTIFY_DATA = (uint64_t)-1;
+
+struct follow* follow_create(unsigned int files) {
+    struct follow *follow = malloc(sizeof(struct follow) + files * sizeof(struct followed));
+    if (follow == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    follow->files_length = files;
+    for (unsigned int i=0; i<files; i++) {
+        follow->files[i].file_watch = follow->files[i].directory_watch = follow->files[i].fd = -1;
+        follow->files[i].name = NULL;
+    }
+    follow->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    follow->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN, .data = {.u64 = INOTIFY_DATA}};
+    if (follow->epoll_fd == -1 || follow->inotify_fd == -1
+            || epoll_ctl(follow->epoll_fd, EPOLL_CTL_ADD, follow->inotify_fd, &event) != 0) {
+        int error = errno;
+        if (follow->epoll_fd != -1) close(follow->epoll_fd);
+        if (follow->inotify_fd != -1) close(follow->inotify_fd);
+        free(follow);
+        errno = error;
+        return NULL;
+    }
+    return follow;
+}
+
+void follow_destroy(struct follow *follow) {
+    for (unsigned int i=0; i<follow->files_length; i++) {
+        free(follow->files[i].name);
+    }
+    // closing the inotify fd removes all its watches
+    close(follow->inotify_fd);
+    close(follow->epoll_fd);
+    free(follow);
+}
+
+bool follow_file(struct follow *follow, unsigned int id, const char *path) {
+    struct followed *file = &follow->files[id];
+    const char *slash = strrchr(path, '/');
+    const char *name = slash == NULL ? path : slash + 1;
+    if (file->name == NULL) {
+        // the directory is watched for files being created or moved to the same name
+        char *directory = slash == NULL ? strdup(".") : strndup(path, slash == path ? 1 : slash - path);
+        file->name = strdup(name);
+        if (directory == NULL || file->name == NULL) {
+            free(directory);
+            errno = ENOMEM;
+            return false;
+        }
+        file->directory_watch = inotify_add_watch(
+            follow->inotify_fd,
+            directory,
+            IN_CREATE | IN_MOVED_TO | IN_MASK_ADD
+        );
+        free(directory);
+        if (file->directory_watch == -1) {
+            return false;
+        }
+    }
+    if (file->file_watch != -1) {
+        // the old file might still exist somewhere else, and then the watch would remain.
+        // several files can share a watch if they are the same, so only remove it if no other uses it
+        bool shared = false;
+        for (unsigned int i=0; i<follow->files_length; i++) {
+            shared |= i != id && follow->files[i].file_watch == file->file_watch;
+        }
+        if (!shared) {
+            inotify_rm_watch(follow->inotify_fd, file->file_watch);
+        }
+    }
+    // IN_ATTRIB is generated when the link count changes, such as when deleted while open
+    file->file_watch = inotify_add_watch(
+        follow->inotify_fd,
+        path,
+        IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF
+    );
+    return file->file_watch != -1;
+}
+
+bool follow_fd(struct follow *follow, unsigned int id, int fd) {
+    struct epoll_event event = {.events = EPOLLIN, .data = {.u64 = id}};
+    if (epoll_ctl(follow->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        return false;
+    }
+    follow->files[id].fd = fd;
+    return true;
+}
+
+void follow_forget(struct follow *follow, unsigned int id) {
+    struct followed *file = &follow->files[id];
+    if (file->fd != -1) {
+        epoll_ctl(follow->epoll_fd, EPOLL_CTL_DEL, file->fd, NULL);
+        file->fd = -1;
+    }
+    // inotify watches are only removed when the same file isn't followed twice,
+    // and directory watches are kept as others in the same directory probably use them.
+    if (file->file_watch != -1) {
+        bool shared = false;
+        for (unsigned int i=0; i<follow->files_length; i++) {
+            shared |= i != id && follow->files[i].file_watch == file->file_watch;
+        }
+        if (!shared) {
+            inotify_rm_watch(follow->inotify_fd, file->file_watch);
+        }
+        file->file_watch = -1;
+    }
+    file->directory_watch = -1;
+}
+
+/// mark the files that an inotify event is about.
+/// returns the number of files that didn't have any events before.
+static int handle_inotify_event(struct follow *follow, const struct inotify_event *event, unsigned int *events) {
+    int new_files = 0;
+    for (unsigned int id=0; id<follow->files_length; id++) {
+        struct followed *file = &follow->files[id];
+        unsigned int happened = 0;
+        if (event->wd == file->file_watch) {
+            if (event->mask & IN_MODIFY) {
+                happened |= FOLLOW_READABLE;
+            }
+            if (event->mask & (IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)) {
+                happened |= FOLLOW_REPLACED;
+            }
+            if (event->mask & IN_IGNORED) {
+                // the file was deleted and the watch removed
+                file->file_watch = -1;
+                happened |= FOLLOW_REPLACED;
+            }
+        } else if (event->wd == file->directory_watch && event->len != 0
+                   && strcmp(event->name, file->name) == 0) {
+            happened |= FOLLOW_REPLACED;
+        }
+        if (happened != 0) {
+            new_files += events[id] == 0;
+            events[id] |= happened;
+        }
+    }
+    return new_files;
+}
+
+int follow_wait(struct follow *follow, int timeout_ms, unsigned int *events) {
+    memset(events, 0, follow->files_length * sizeof(unsigned int));
+    struct epoll_event ready[64];
+    int ready_length;
+    do {
+        ready_length = epoll_wait(follow->epoll_fd, ready, sizeof(ready)/sizeof(*ready), timeout_ms);
+    } while (ready_length < 0 && errno == EINTR);
+    if (ready_length < 0) {
+        return -1;
+    }
+    int files = 0;
+    for (int i=0; i<ready_length; i++) {
+        if (ready[i].data.u64 != INOTIFY_DATA) {
+            unsigned int id = (unsigned int)ready[i].data.u64;
+            files += events[id] == 0;
+            events[id] |= FOLLOW_READABLE;
+            continue;
+        }
+        // read all queued events
+        char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t length;
+        while ((length = read(follow->inotify_fd, buffer, sizeof(buffer))) > 0) {
+            for (char *pos = buffer; pos < buffer + length; ) {
+                const struct inotify_event *event = (const struct inotify_event*)pos;
+                files += handle_inotify_event(follow, event, events);
+                pos += sizeof(struct inotify_event) + event->len;
+            }
+        }
+        if (length < 0 && errno != EAGAIN && errno != EINTR) {
+            return -1;
+        }
+    }
+    return files;
+}
+
+#else // !defined(__linux__)
+struct follow* follow_create(unsigned int files) {
+    (void)files;
+    errno = ENOSYS;
+    return NULL;
+}
+void follow_destroy(struct follow *follow) {
+    free(follow);
+}
+bool follow_file(struct follow *follow, unsigned int id, const char *path) {
+    (void)follow, (void)id, (void)path;
+    errno = ENOSYS;
+    return false;
+}
+bool follow_fd(struct follow *follow, unsigned int id, int fd) {
+    (void)follow, (void)id, (void)fd;
+    errno = ENOSYS;
+    return false;
+}
+void follow_forget(struct follow *follow, unsigned int id) {
+    (void)follow, (void)id;
+}
+int follow_wait(struct follow *follow, int timeout_ms, unsigned int *events) {
+    (void)follow, (void)timeout_ms, (void)events;
+    errno = ENOSYS;
+    return -1;
+}
+#endif
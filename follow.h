@@ -0,0 +1,53 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+//! Waits for followed files to grow or be replaced, without polling them.
+//! Uses inotify for regular files and epoll for pipes and other files that can be waited on directly.
+
+#ifndef _FOLLOW_H_
+#define _FOLLOW_H_
+#include <stdbool.h>
+
+/// bits in the events reported by follow_wait()
+enum follow_event {
+    FOLLOW_READABLE = 1, //< the file has been written to, or a pipe has data or has been closed
+    FOLLOW_REPLACED = 2 //< the file has been moved or deleted, or another file has been created at its path
+};
+
+struct follow;
+
+/// Files are identified by a number below `files`.
+/// Returns NULL and sets errno if inotify or epoll isn't available.
+struct follow* follow_create(unsigned int files);
+void follow_destroy(struct follow *follow);
+
+/// Watches a regular file for being written to, and its directory for the path getting a new file.
+/// Can be called again after the file has been replaced, to watch the new one.
+/// Returns false and sets errno on failure.
+bool follow_file(struct follow *follow, unsigned int id, const char *path);
+/// Watches a pipe, socket or terminal for becoming readable.
+/// Returns false and sets errno on failure.
+bool follow_fd(struct follow *follow, unsigned int id, int fd);
+/// Stops watching the file or fd, which must be done before closing the fd.
+void follow_forget(struct follow *follow, unsigned int id);
+
+/// Waits up to timeout_ms milliseconds (forever if -1, or only checks if 0) for something to happen,
+/// and sets events[id] to the follow_event bits for each file, which must have room for all.
+/// Returns the number of files with events, or -1 with errno set.
+int follow_wait(struct follow *follow, int timeout_ms, unsigned int *events);
+
+#endif // !defined(_FOLLOW_H_)
@@ -16,22 +16,60 @@
 
 #include "heap.h"
 #include <string.h>
+#include <limits.h>
 #include <stdio.h>
+#ifdef HEAP_COUNT_COMPARISONS
+#include <stdatomic.h>
+
+// shared by all threads, which makes counting slow but keeps the other builds unaffected
+static atomic_ullong comparisons = 0;
+static atomic_ullong sifts = 0, sift_levels = 0;
+#define COUNT_COMPARISON() atomic_fetch_add_explicit(&comparisons, 1, memory_order_relaxed)
+#define COUNT_SIFT(levels) (atomic_fetch_add_explicit(&sifts, 1, memory_order_relaxed), \
+                            atomic_fetch_add_explicit(&sift_levels, (levels), memory_order_relaxed))
+#else
+#define COUNT_COMPARISON()
+#define COUNT_SIFT(levels) ((void)(levels))
+#endif
 
 struct heap heap_create(enum heap_type type, unsigned int size) {
     struct heap heap = {
         .entries = NULL,
+        .tree = NULL,
+        .free_leaves = NULL,
         .type = type,
+        .layout = BINARY_HEAP,
         .length = 0,
-        .capacity = size
+        .capacity = size,
+        .needs_rebuild = false
     };
     return heap;
 }
+struct heap heap_create_loser_tree(enum heap_type type, unsigned int size) {
+    struct heap heap = heap_create(type, size);
+    heap.layout = LOSER_TREE;
+    return heap;
+}
 size_t heap_get_needed_memory(const struct heap *heap) {
-    return heap->capacity * sizeof(struct heap_entry);
+    size_t needed = heap->capacity * sizeof(struct heap_entry);
+    if (heap->layout == LOSER_TREE) {
+        needed += 2 * heap->capacity * sizeof(unsigned int);
+    }
+    return needed;
 }
 void heap_set_memory(struct heap *heap, void* alloc) {
     heap->entries = (struct heap_entry*)alloc;
+    if (heap->layout == LOSER_TREE) {
+        heap->tree = (unsigned int*)&heap->entries[heap->capacity];
+        heap->free_leaves = &heap->tree[heap->capacity];
+        for (unsigned int i=0; i<heap->capacity; i++) {
+            heap->entries[i].value = -1;
+            // so that leaves are used from the start
+            heap->free_leaves[i] = heap->capacity - 1 - i;
+        }
+        heap->length = 0;
+        heap->needs_rebuild = true;
+    }
 }
 void* heap_get_memory(struct heap *heap) {
     return heap->entries;
@@ -40,57 +78,343 @@ void* heap_get_memory(struct heap *heap) {
 bool heap_is_empty(const struct heap *heap) {
     return heap->length == 0;
 }
+unsigned int heap_length(const struct heap *heap) {
+    return heap->length;
+}
+
+static uint64_t slice_prefix(struct iovec key) {
+    unsigned char bytes[8] = {0};
+    if (key.iov_len != 0) {
+        memcpy(bytes, key.iov_base, key.iov_len < 8 ? key.iov_len : 8);
+    }
+    uint64_t prefix;
+    memcpy(&prefix, bytes, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    prefix = __builtin_bswap64(prefix);
+#endif
+    return prefix;
+}
+
+static void set_slice(struct heap_entry *entry, struct iovec key, int value) {
+    entry->slice_key = key;
+    entry->key_prefix = slice_prefix(key);
+    entry->value = value;
+}
+
+unsigned long long heap_comparisons(void) {
+#ifdef HEAP_COUNT_COMPARISONS
+    return atomic_load(&comparisons);
+#else
+    return 0;
+#endif
+}
+
+unsigned long long heap_sifts(unsigned long long *levels) {
+#ifdef HEAP_COUNT_COMPARISONS
+    *levels = atomic_load(&sift_levels);
+    return atomic_load(&sifts);
+#else
+    *levels = 0;
+    return 0;
+#endif
+}
 
 static int slice_cmp(const struct heap_entry *a, const struct heap_entry *b) {
+    COUNT_COMPARISON();
+    if (a->key_prefix != b->key_prefix) {
+        return a->key_prefix < b->key_prefix ? -1 : 1;
+    }
     size_t a_length = a->slice_key.iov_len;
     size_t b_length = b->slice_key.iov_len;
     size_t min_length = a_length < b_length ? a_length : b_length;
 
-    int cmp = memcmp(a->slice_key.iov_base, b->slice_key.iov_base, min_length);
+    // equal prefixes means the bytes they cover are equal
+    size_t skip = min_length < 8 ? min_length : 8;
+    int cmp = memcmp(
+        (const char*)a->slice_key.iov_base + skip,
+        (const char*)b->slice_key.iov_base + skip,
+        min_length - skip
+    );
     if (cmp == 0) {
         cmp = a_length - b_length;
     }
     return cmp;
 }
 
-bool heap_push_slice(struct heap *heap, struct iovec key, int value) {
-    if (heap->length == heap->capacity) {
-        return false;
+static void set_timestamp(struct heap_entry *entry, struct timeval key, int value) {
+    entry->time_key = key;
+    // microseconds with the sign bit flipped, so that earlier times are smaller integers
+    int64_t micros = (int64_t)key.tv_sec * 1000000 + key.tv_usec;
+    entry->key_prefix = (uint64_t)micros ^ ((uint64_t)1 << 63);
+    entry->value = value;
+}
+
+static void set_number(struct heap_entry *entry, double key, int value) {
+    entry->number_key = key;
+    uint64_t bits;
+    if (key != key) {
+        // NaN is less than everything
+        bits = 0;
+    } else {
+        // so that -0.0 equals 0.0
+        key += 0.0;
+        memcpy(&bits, &key, sizeof(bits));
+        // flip all bits of negative numbers and the sign bit of positive ones,
+        // which makes the integers order the same as the numbers
+        bits = (bits >> 63) != 0 ? ~bits : bits | ((uint64_t)1 << 63);
     }
+    entry->key_prefix = bits;
+    entry->value = value;
+}
 
-    heap->entries[heap->length].slice_key = key;
-    heap->entries[heap->length].value = value;
-    heap->length++;
+/// for TIME_MIN and NUMBER_MIN, where the whole key is in the prefix
+static inline int prefix_cmp(const struct heap_entry *a, const struct heap_entry *b) {
+    COUNT_COMPARISON();
+    return a->key_prefix < b->key_prefix ? -1 : a->key_prefix > b->key_prefix;
+}
+
+static bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static bool is_letter(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
 
-    // the algorithm is simplest if array starts at 1, so just subtract when indexing
-    unsigned int inserted = heap->length;
+/// How a byte orders outside runs of digits in sort -V:
+/// ~ before the end, then letters, and then everything else.
+static int version_order(const char *bytes, size_t position, size_t length) {
+    if (position == length) {
+        return -1;
+    }
+    unsigned char c = bytes[position];
+    if (is_digit(c)) {
+        return 0;
+    } else if (is_letter(c)) {
+        return c;
+    } else if (c == '~') {
+        return -2;
+    }
+    return c + UCHAR_MAX + 1;
+}
 
-    while (inserted > 1) {
-        unsigned int half = inserted/2;
-        struct heap_entry *inserted_entry = &heap->entries[inserted-1];
-        struct heap_entry *half_entry = &heap->entries[half-1];
+/// Debian's version comparison, which gnulib's filevercmp() uses on what's left after removing file suffixes.
+static int compare_version_parts(const char *a, size_t a_length, const char *b, size_t b_length) {
+    size_t ai = 0, bi = 0;
+    while (ai < a_length || bi < b_length) {
+        while ((ai < a_length && !is_digit(a[ai])) || (bi < b_length && !is_digit(b[bi]))) {
+            int a_order = version_order(a, ai, a_length);
+            int b_order = version_order(b, bi, b_length);
+            if (a_order != b_order) {
+                return a_order - b_order;
+            }
+            ai++;
+            bi++;
+        }
+        // compare runs of digits by value: first skip leading zeroes, then the longer run is greater,
+        // and runs of the same length compare like strings.
+        while (ai < a_length && a[ai] == '0') {
+            ai++;
+        }
+        while (bi < b_length && b[bi] == '0') {
+            bi++;
+        }
+        int first_difference = 0;
+        while (ai < a_length && bi < b_length && is_digit(a[ai]) && is_digit(b[bi])) {
+            if (first_difference == 0) {
+                first_difference = a[ai] - b[bi];
+            }
+            ai++;
+            bi++;
+        }
+        if (ai < a_length && is_digit(a[ai])) {
+            return 1;
+        } else if (bi < b_length && is_digit(b[bi])) {
+            return -1;
+        } else if (first_difference != 0) {
+            return first_difference;
+        }
+    }
+    return 0;
+}
 
-        // stop if half is less than inserted
-        // if equal up to the shortest, stop if lengths are equal
-        // (meaning all bytes were compared and entries are completely equal)
-        // or if half is shorter than inserted (get shortest first)
-        if (slice_cmp(inserted_entry, half_entry) > 0) {
-            break;
+/// The length without file suffixes like .tar.gz, which are a dot, a letter or ~ and then letters, digits or ~.
+static size_t without_file_suffixes(const char *bytes, size_t length) {
+    size_t prefix = 0;
+    for (size_t i = 0; i < length;) {
+        if (i + 1 < length && bytes[i] == '.' && (is_letter(bytes[i+1]) || bytes[i+1] == '~')) {
+            for (i += 2; i < length && (is_letter(bytes[i]) || is_digit(bytes[i]) || bytes[i] == '~'); i++) {}
+        } else {
+            i++;
+            prefix = i;
         }
+    }
+    return prefix;
+}
 
-        struct heap_entry tmp = *half_entry;
-        *half_entry = *inserted_entry;
-        *inserted_entry = tmp;
-        inserted /= 2;
+int heap_compare_versions(struct iovec a, struct iovec b) {
+    const char *a_bytes = a.iov_base, *b_bytes = b.iov_base;
+    size_t a_length = a.iov_len, b_length = b.iov_len;
+    if (a_length == 0 || b_length == 0) {
+        return (a_length != 0) - (b_length != 0);
+    }
+    // . is first, then .., then other keys starting with a dot, and then the rest
+    if (a_bytes[0] == '.' || b_bytes[0] == '.') {
+        if (a_bytes[0] != b_bytes[0]) {
+            return a_bytes[0] == '.' ? -1 : 1;
+        }
+        if (a_length == 1 || b_length == 1) {
+            return (a_length != 1) - (b_length != 1);
+        }
+        bool a_parent = a_length == 2 && a_bytes[1] == '.';
+        bool b_parent = b_length == 2 && b_bytes[1] == '.';
+        if (a_parent || b_parent) {
+            return b_parent - a_parent;
+        }
+    }
+    size_t a_prefix = without_file_suffixes(a_bytes, a_length);
+    size_t b_prefix = without_file_suffixes(b_bytes, b_length);
+    int cmp = compare_version_parts(a_bytes, a_prefix, b_bytes, b_prefix);
+    if (cmp != 0 || (a_prefix == a_length && b_prefix == b_length)) {
+        return cmp;
     }
-    
+    return compare_version_parts(a_bytes, a_length, b_bytes, b_length);
+}
+
+static inline int version_cmp(const struct heap_entry *a, const struct heap_entry *b) {
+    COUNT_COMPARISON();
+    return heap_compare_versions(a->slice_key, b->slice_key);
+}
+
+static bool tree_push(struct heap *heap, const struct heap_entry *entry) {
+    unsigned int leaf = heap->free_leaves[heap->capacity - heap->length - 1];
+    heap->entries[leaf] = *entry;
+    heap->length++;
+    heap->needs_rebuild = true;
     return true;
 }
+
+#define LOOP(name) name##_slice
+#define CMP slice_cmp
+#include "heap_loops.h"
+#undef LOOP
+#undef CMP
+#define LOOP(name) name##_prefix
+#define CMP prefix_cmp
+#include "heap_loops.h"
+#undef LOOP
+#undef CMP
+#define LOOP(name) name##_version
+#define CMP version_cmp
+#include "heap_loops.h"
+#undef LOOP
+#undef CMP
+
+// choose the specialized version once per operation
+
+static unsigned int tree_winner(const struct heap *heap) {
+    switch (heap->type) {
+        case SLICE_MIN: return tree_winner_slice(heap);
+        case VERSION_MIN: return tree_winner_version(heap);
+        default: return tree_winner_prefix(heap);
+    }
+}
+
+static bool push_entry(struct heap *heap, const struct heap_entry *entry) {
+    switch (heap->type) {
+        case SLICE_MIN: return push_entry_slice(heap, entry);
+        case VERSION_MIN: return push_entry_version(heap, entry);
+        default: return push_entry_prefix(heap, entry);
+    }
+}
+
+/// the heap must not be empty
+static int pop_entry(struct heap *heap, struct heap_entry *popped) {
+    switch (heap->type) {
+        case SLICE_MIN: return pop_entry_slice(heap, popped);
+        case VERSION_MIN: return pop_entry_version(heap, popped);
+        default: return pop_entry_prefix(heap, popped);
+    }
+}
+
+/// returns -1 and pushes if the heap is empty
+static int replace_top_entry(struct heap *heap, struct heap_entry *popped, const struct heap_entry *entry) {
+    switch (heap->type) {
+        case SLICE_MIN: return replace_top_entry_slice(heap, popped, entry);
+        case VERSION_MIN: return replace_top_entry_version(heap, popped, entry);
+        default: return replace_top_entry_prefix(heap, popped, entry);
+    }
+}
+
+int heap_find_runner_up(struct heap *heap) {
+    switch (heap->type) {
+        case SLICE_MIN: return find_runner_up_slice(heap);
+        case VERSION_MIN: return find_runner_up_version(heap);
+        default: return find_runner_up_prefix(heap);
+    }
+}
+
+static bool top_stays(const struct heap *heap, int runner_up, const struct heap_entry *entry) {
+    switch (heap->type) {
+        case SLICE_MIN: return top_stays_slice(heap, runner_up, entry);
+        case VERSION_MIN: return top_stays_version(heap, runner_up, entry);
+        default: return top_stays_prefix(heap, runner_up, entry);
+    }
+}
+
+bool heap_push_slice(struct heap *heap, struct iovec key, int value) {
+    struct heap_entry entry;
+    set_slice(&entry, key, value);
+    return push_entry(heap, &entry);
+}
+bool heap_push_timestamp(struct heap *heap, struct timeval key, int value) {
+    struct heap_entry entry;
+    set_timestamp(&entry, key, value);
+    return push_entry(heap, &entry);
+}
+bool heap_push_number(struct heap *heap, double key, int value) {
+    struct heap_entry entry;
+    set_number(&entry, key, value);
+    return push_entry(heap, &entry);
+}
 bool heap_push_bytes(struct heap *heap, const char* key, int key_length, int value) {
     struct iovec slice = {.iov_base = (void*)key, .iov_len = key_length};
     return heap_push_slice(heap, slice, value);
 }
 
+/// returns NULL if the heap is empty
+static const struct heap_entry* peek_entry(const struct heap *heap) {
+    if (heap->length == 0) {
+        return NULL;
+    } else if (heap->layout == LOSER_TREE) {
+        return &heap->entries[tree_winner(heap)];
+    } else {
+        return &heap->entries[0];
+    }
+}
+
+struct iovec heap_peek_key_slice(const struct heap *heap) {
+    struct iovec key = {.iov_base = NULL, .iov_len = 0};
+    const struct heap_entry *top = peek_entry(heap);
+    return top != NULL ? top->slice_key : key;
+}
+
+struct timeval heap_peek_key_timestamp(const struct heap *heap) {
+    struct timeval key = {.tv_sec = 0, .tv_usec = 0};
+    const struct heap_entry *top = peek_entry(heap);
+    return top != NULL ? top->time_key : key;
+}
+
+double heap_peek_key_number(const struct heap *heap) {
+    const struct heap_entry *top = peek_entry(heap);
+    return top != NULL ? top->number_key : 0.0;
+}
+
+int heap_peek_value(const struct heap *heap) {
+    const struct heap_entry *top = peek_entry(heap);
+    return top != NULL ? top->value : -1;
+}
+
 int heap_pop_slice_value(struct heap *heap, struct iovec *popped_key) {
     if (heap->length == 0) {
         if (popped_key != NULL) {
@@ -99,56 +423,120 @@ int heap_pop_slice_value(struct heap *heap, struct iovec *popped_key) {
         }
         return -1;
     }
-
-    // get the min
-    int top_value = heap->entries[0].value;
+    struct heap_entry popped;
+    pop_entry(heap, &popped);
     if (popped_key != NULL) {
-        *popped_key = heap->entries[0].slice_key;
-    }
-
-    // put the last item in front, which likely is greater than its now children
-    heap->length--;
-    heap->entries[0] = heap->entries[heap->length];
-
-    // and then fix the heap
-    unsigned int new_parent = 1; // use one-based indexing when calculating, to simplify the logic
-    while (new_parent*2 <= heap->length) {// has left child
-        unsigned int left_child = new_parent*2;
-        unsigned int right_child = left_child+1;
-
-        struct heap_entry *parent_entry = &heap->entries[new_parent - 1];
-        struct heap_entry *left_child_entry = &heap->entries[left_child - 1];
-        struct heap_entry *right_child_entry = &heap->entries[right_child - 1];
-
-        // if right child is less than left child and less than parent
-        if (right_child <= heap->length
-            && slice_cmp(right_child_entry, left_child_entry) < 0
-            && slice_cmp(right_child_entry, parent_entry) < 0) {
-            // swap right child with parent
-            struct heap_entry tmp = *parent_entry;
-            *parent_entry = *right_child_entry;
-            *right_child_entry = tmp;
-            new_parent = right_child;
+        *popped_key = popped.slice_key;
+    }
+    return popped.value;
+}
+
+int heap_pop_timestamp_value(struct heap *heap, struct timeval *popped_key) {
+    if (heap->length == 0) {
+        if (popped_key != NULL) {
+            popped_key->tv_sec = 0;
+            popped_key->tv_usec = 0;
         }
-        // if left child is less than parent
-        else if (slice_cmp(parent_entry, left_child_entry) > 0) {
-            // swap right child with parent
-            struct heap_entry tmp = *parent_entry;
-            *parent_entry = *left_child_entry;
-            *left_child_entry = tmp;
-            new_parent = left_child;
-        } else {
-            break;
+        return -1;
+    }
+    struct heap_entry popped;
+    pop_entry(heap, &popped);
+    if (popped_key != NULL) {
+        *popped_key = popped.time_key;
+    }
+    return popped.value;
+}
+
+int heap_pop_number_value(struct heap *heap, double *popped_key) {
+    if (heap->length == 0) {
+        if (popped_key != NULL) {
+            *popped_key = 0.0;
         }
+        return -1;
+    }
+    struct heap_entry popped;
+    pop_entry(heap, &popped);
+    if (popped_key != NULL) {
+        *popped_key = popped.number_key;
+    }
+    return popped.value;
+}
+
+int heap_replace_top_slice(struct heap *heap, struct iovec *popped_key, struct iovec key, int value) {
+    // zero-initialize the key in case the heap is empty
+    struct heap_entry entry, popped = {.value = -1};
+    set_slice(&entry, key, value);
+    int popped_value = replace_top_entry(heap, &popped, &entry);
+    if (popped_key != NULL) {
+        *popped_key = popped.slice_key;
+    }
+    return popped_value;
+}
+
+int heap_replace_top_timestamp(struct heap *heap, struct timeval *popped_key, struct timeval key, int value) {
+    struct heap_entry entry, popped = {.value = -1};
+    set_timestamp(&entry, key, value);
+    int popped_value = replace_top_entry(heap, &popped, &entry);
+    if (popped_key != NULL) {
+        *popped_key = popped.time_key;
+    }
+    return popped_value;
+}
+
+int heap_replace_top_number(struct heap *heap, double *popped_key, double key, int value) {
+    struct heap_entry entry, popped = {.value = -1};
+    set_number(&entry, key, value);
+    int popped_value = replace_top_entry(heap, &popped, &entry);
+    if (popped_key != NULL) {
+        *popped_key = popped.number_key;
     }
+    return popped_value;
+}
+
+bool heap_top_stays_slice(const struct heap *heap, int runner_up, struct iovec key) {
+    struct heap_entry entry;
+    set_slice(&entry, key, heap_peek_value(heap));
+    return top_stays(heap, runner_up, &entry);
+}
+
+bool heap_top_stays_timestamp(const struct heap *heap, int runner_up, struct timeval key) {
+    struct heap_entry entry;
+    set_timestamp(&entry, key, heap_peek_value(heap));
+    return top_stays(heap, runner_up, &entry);
+}
+
+bool heap_top_stays_number(const struct heap *heap, int runner_up, double key) {
+    struct heap_entry entry;
+    set_number(&entry, key, heap_peek_value(heap));
+    return top_stays(heap, runner_up, &entry);
+}
 
-    return top_value;
+static void print_entry(const struct heap *heap, const struct heap_entry *entry) {
+    printf("%u:", entry->value);
+    if (heap->type == TIME_MIN) {
+        printf("%lld.%06ld", (long long)entry->time_key.tv_sec, (long)entry->time_key.tv_usec);
+    } else if (heap->type == NUMBER_MIN) {
+        printf("%g", entry->number_key);
+    } else {
+        fwrite(entry->slice_key.iov_base, entry->slice_key.iov_len, 1, stdout);
+    }
 }
 
 void heap_debug_print(const struct heap *heap) {
+    if (heap->layout == LOSER_TREE) {
+        // print the leaves in position order, which says nothing about the tree itself
+        unsigned int printed = 0;
+        for (unsigned int i=0; i<heap->capacity; i++) {
+            if (heap->entries[i].value != -1) {
+                printed++;
+                print_entry(heap, &heap->entries[i]);
+                putchar(printed == heap->length ? '\n' : ' ');
+            }
+        }
+        return;
+    }
     for (unsigned int i=0; i<heap->length; i++) {
-        printf("%u:", heap->entries[i].value);
-        fwrite(heap->entries[i].slice_key.iov_base, heap->entries[i].slice_key.iov_len, 1, stdout);
+        print_entry(heap, &heap->entries[i]);
         putchar(i+1 == heap->length ? '\n' : ' ');
     }
 }
@@ -15,49 +15,109 @@
  */
 
 //! A bounded min-heap where items have both a key and a value.
+//! It can also be laid out as a loser tree (tournament tree),
+//! which needs fewer comparisons when the minimum is replaced.
+//! The loops are compiled once for each way of comparing keys, see heap_loops.h.
 
 #ifndef _HEAP_H_
 #define _HEAP_H_
 #include <sys/uio.h> // struct iovec
 #include <sys/time.h> // struct timeval
 #include <stdbool.h>
+#include <stdint.h>
 
 struct heap_entry {
     union {
         struct iovec slice_key;
         struct timeval time_key;
+        double number_key;
     };
+    /// the first 8 bytes of slice_key as a big-endian integer padded with zeroes,
+    /// which orders the same as memcmp() and decides most comparisons without reading the key.
+    /// For time_key and number_key it's the whole key as an integer that orders the same way.
+    uint64_t key_prefix;
     int value;
 };
 
 enum heap_type {
     SLICE_MIN,
-    //TIME_MIN
+    TIME_MIN,
+    NUMBER_MIN, //< NaN is less than all other numbers
+    VERSION_MIN //< slices where runs of digits are compared by value, see heap_compare_versions()
+};
+
+enum heap_layout {
+    BINARY_HEAP,
+    LOSER_TREE
 };
 
 struct heap {
-    struct heap_entry* entries;
+    struct heap_entry* entries; //< for loser trees these are the leaves, and empty ones have value -1
+    unsigned int* tree; //< loser tree: the losing leaf of each match, and the overall winner at [0]
+    unsigned int* free_leaves; //< loser tree: stack of empty leaves
     enum heap_type type;
+    enum heap_layout layout;
     unsigned int length;
     unsigned int capacity;
+    bool needs_rebuild; //< loser tree: leaves have been pushed since the tree was last valid
 };
 
 /// Initializes the struct but does not allocate
 struct heap heap_create(enum heap_type type, unsigned int size);
+/// Like heap_create(), but replacing the minimum always costs exactly log2(size) comparisons.
+/// Pushing is cheap, but the tree is then rebuilt with size-1 comparisons before the next pop,
+/// so it's best suited for filling once and then only replacing or popping.
+struct heap heap_create_loser_tree(enum heap_type type, unsigned int size);
 size_t heap_get_needed_memory(const struct heap *heap);
 void heap_set_memory(struct heap *heap, void* alloc);
 void* heap_get_memory(struct heap *heap);
 
 bool heap_is_empty(const struct heap *heap);
+unsigned int heap_length(const struct heap *heap);
 
 bool heap_push_slice(struct heap *heap, struct iovec key, int value);
 bool heap_push_bytes(struct heap *heap, const char* key, int key_length, int value);
-//bool heap_push_timestamp(struct heap *heap, struct timeval key, int value);
+bool heap_push_timestamp(struct heap *heap, struct timeval key, int value);
+bool heap_push_number(struct heap *heap, double key, int value);
 
 struct iovec heap_peek_key_slice(const struct heap *heap);
-//struct timeval heap_peek_key_timestamp(const struct heap *heap);
+struct timeval heap_peek_key_timestamp(const struct heap *heap);
+double heap_peek_key_number(const struct heap *heap);
+/// returns -1 if the heap is empty
+int heap_peek_value(const struct heap *heap);
 
 int heap_pop_slice_value(struct heap *heap, struct iovec *key);
+int heap_pop_timestamp_value(struct heap *heap, struct timeval *key);
+int heap_pop_number_value(struct heap *heap, double *key);
+/// Pops the minimum and pushes a new entry in one step.
+/// Returns the popped value, or -1 if the heap was empty (the new entry is pushed anyway).
+int heap_replace_top_slice(struct heap *heap, struct iovec *popped_key, struct iovec key, int value);
+int heap_replace_top_timestamp(struct heap *heap, struct timeval *popped_key, struct timeval key, int value);
+int heap_replace_top_number(struct heap *heap, double *popped_key, double key, int value);
+
+/// Finds the entry that would become the minimum if the current one was popped,
+/// and returns its position for heap_top_stays_*(), or -1 if the heap has fewer than two entries.
+/// The position is only valid until the heap is modified. Loser trees are rebuilt if necessary.
+int heap_find_runner_up(struct heap *heap);
+/// Returns true if replacing the minimum with key would keep it the minimum,
+/// which needs only one comparison against the runner-up.
+/// The minimum can therefore be replaced repeatedly, doing only the last replacement.
+bool heap_top_stays_slice(const struct heap *heap, int runner_up, struct iovec key);
+bool heap_top_stays_timestamp(const struct heap *heap, int runner_up, struct timeval key);
+bool heap_top_stays_number(const struct heap *heap, int runner_up, double key);
+
+/// Orders like sort -V (gnulib's filevercmp()): runs of digits are compared by their value, ignoring leading zeroes,
+/// so that 1.9 is before 1.10, letters are before other bytes, ~ is before everything including the end,
+/// and file suffixes like .tar.gz only matter when the rest is equal.
+/// SLICE_MIN and VERSION_MIN heaps are pushed to with the same functions.
+int heap_compare_versions(struct iovec a, struct iovec b);
+
+/// Returns how many times keys have been compared by all heaps,
+/// which is only counted when compiled with -DHEAP_COUNT_COMPARISONS, and otherwise always 0.
+unsigned long long heap_comparisons(void);
+/// Returns how many times an entry has been moved up or down a heap or replayed up a loser tree,
+/// and sets levels to how many levels they moved in total. Counted like heap_comparisons().
+unsigned long long heap_sifts(unsigned long long *levels);
 
 void heap_debug_print(const struct heap *heap);
 
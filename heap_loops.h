@@ -0,0 +1,268 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! The parts of heap.c that compare entries, included once for each way of comparing them, so that the
+//! comparison is inlined into the loops instead of being chosen by the heap type for every comparison.
+//! Before including, LOOP(name) must be defined to give each function a distinct name,
+//! and CMP(a, b) to compare two entries.
+//! Not a normal header: it has no include guard and must only be included by heap.c.
+
+/// Returns true if leaf a should be popped before leaf b.
+/// Empty leaves lose against everything,
+/// and ties are broken by position to make the order independent of the tree shape.
+static inline bool LOOP(leaf_wins)(const struct heap *heap, unsigned int a, unsigned int b) {
+    const struct heap_entry *a_entry = &heap->entries[a];
+    const struct heap_entry *b_entry = &heap->entries[b];
+    if (b_entry->value == -1) {
+        return a_entry->value != -1 || a < b;
+    } else if (a_entry->value == -1) {
+        return false;
+    }
+    int cmp = CMP(a_entry, b_entry);
+    return cmp < 0 || (cmp == 0 && a < b);
+}
+
+/// Replays the matches from a leaf to the root after the leaf has changed.
+/// This is only valid if the leaf was the previous winner.
+static void LOOP(tree_replay)(struct heap *heap, unsigned int leaf) {
+    unsigned int winner = leaf;
+    unsigned int levels = 0;
+    // leaves are at capacity..2*capacity-1 and internal nodes at 1..capacity-1, like in a binary heap
+    for (unsigned int node = (heap->capacity + leaf) / 2; node > 0; node /= 2) {
+        levels++;
+        if (LOOP(leaf_wins)(heap, heap->tree[node], winner)) {
+            unsigned int loser = winner;
+            winner = heap->tree[node];
+            heap->tree[node] = loser;
+        }
+    }
+    heap->tree[0] = winner;
+    COUNT_SIFT(levels);
+}
+
+/// Plays all matches from scratch, which is needed after pushing.
+static void LOOP(tree_rebuild)(struct heap *heap) {
+    // an internal node is unset until the winner of one of its subtrees arrives,
+    // and the winner of the other subtree then plays against it.
+    const unsigned int unset = heap->capacity;
+    for (unsigned int node = 0; node < heap->capacity; node++) {
+        heap->tree[node] = unset;
+    }
+    for (unsigned int leaf = 0; leaf < heap->capacity; leaf++) {
+        unsigned int winner = leaf;
+        unsigned int node = (heap->capacity + leaf) / 2;
+        for (; node > 0; node /= 2) {
+            if (heap->tree[node] == unset) {
+                heap->tree[node] = winner;
+                break;
+            } else if (LOOP(leaf_wins)(heap, heap->tree[node], winner)) {
+                unsigned int loser = winner;
+                winner = heap->tree[node];
+                heap->tree[node] = loser;
+            }
+        }
+        if (node == 0) {
+            heap->tree[0] = winner;
+        }
+    }
+    heap->needs_rebuild = false;
+}
+
+/// Finds the winner without modifying the tree.
+static unsigned int LOOP(tree_winner)(const struct heap *heap) {
+    if (!heap->needs_rebuild) {
+        return heap->tree[0];
+    }
+    unsigned int winner = 0;
+    for (unsigned int leaf = 1; leaf < heap->capacity; leaf++) {
+        if (LOOP(leaf_wins)(heap, leaf, winner)) {
+            winner = leaf;
+        }
+    }
+    return winner;
+}
+
+static int LOOP(tree_pop)(struct heap *heap, struct heap_entry *popped) {
+    if (heap->needs_rebuild) {
+        LOOP(tree_rebuild)(heap);
+    }
+    unsigned int leaf = heap->tree[0];
+    *popped = heap->entries[leaf];
+    int value = popped->value;
+    heap->entries[leaf].value = -1;
+    heap->free_leaves[heap->capacity - heap->length] = leaf;
+    heap->length--;
+    LOOP(tree_replay)(heap, leaf);
+    return value;
+}
+
+static int LOOP(tree_replace_top)(struct heap *heap, struct heap_entry *popped, const struct heap_entry *entry) {
+    if (heap->needs_rebuild) {
+        LOOP(tree_rebuild)(heap);
+    }
+    unsigned int leaf = heap->tree[0];
+    *popped = heap->entries[leaf];
+    heap->entries[leaf] = *entry;
+    LOOP(tree_replay)(heap, leaf);
+    return popped->value;
+}
+
+static bool LOOP(push_entry)(struct heap *heap, const struct heap_entry *entry) {
+    if (heap->length == heap->capacity) {
+        return false;
+    }
+    if (heap->layout == LOSER_TREE) {
+        return tree_push(heap, entry);
+    }
+
+    heap->entries[heap->length] = *entry;
+    heap->length++;
+
+    // the algorithm is simplest if array starts at 1, so just subtract when indexing
+    unsigned int inserted = heap->length;
+    unsigned int levels = 0;
+
+    while (inserted > 1) {
+        unsigned int half = inserted/2;
+        struct heap_entry *inserted_entry = &heap->entries[inserted-1];
+        struct heap_entry *half_entry = &heap->entries[half-1];
+
+        // stop if half is less than inserted
+        // if equal up to the shortest, stop if lengths are equal
+        // (meaning all bytes were compared and entries are completely equal)
+        // or if half is shorter than inserted (get shortest first)
+        if (CMP(inserted_entry, half_entry) > 0) {
+            break;
+        }
+
+        struct heap_entry tmp = *half_entry;
+        *half_entry = *inserted_entry;
+        *inserted_entry = tmp;
+        inserted /= 2;
+        levels++;
+    }
+    COUNT_SIFT(levels);
+
+    return true;
+}
+
+/// move the root down until it's not greater than any of its children
+static void LOOP(sift_down)(struct heap *heap) {
+    unsigned int new_parent = 1; // use one-based indexing when calculating, to simplify the logic
+    unsigned int levels = 0;
+    while (new_parent*2 <= heap->length) {// has left child
+        unsigned int left_child = new_parent*2;
+        unsigned int right_child = left_child+1;
+
+        struct heap_entry *parent_entry = &heap->entries[new_parent - 1];
+        struct heap_entry *left_child_entry = &heap->entries[left_child - 1];
+        struct heap_entry *right_child_entry = &heap->entries[right_child - 1];
+
+        // if right child is less than left child and less than parent
+        if (right_child <= heap->length
+            && CMP(right_child_entry, left_child_entry) < 0
+            && CMP(right_child_entry, parent_entry) < 0) {
+            // swap right child with parent
+            struct heap_entry tmp = *parent_entry;
+            *parent_entry = *right_child_entry;
+            *right_child_entry = tmp;
+            new_parent = right_child;
+        }
+        // if left child is less than parent
+        else if (CMP(parent_entry, left_child_entry) > 0) {
+            // swap right child with parent
+            struct heap_entry tmp = *parent_entry;
+            *parent_entry = *left_child_entry;
+            *left_child_entry = tmp;
+            new_parent = left_child;
+        } else {
+            break;
+        }
+        levels++;
+    }
+    COUNT_SIFT(levels);
+}
+
+/// the heap must not be empty
+static int LOOP(pop_entry)(struct heap *heap, struct heap_entry *popped) {
+    if (heap->layout == LOSER_TREE) {
+        return LOOP(tree_pop)(heap, popped);
+    }
+
+    // get the min
+    *popped = heap->entries[0];
+
+    // put the last item in front, which likely is greater than its now children
+    heap->length--;
+    heap->entries[0] = heap->entries[heap->length];
+
+    // and then fix the heap
+    LOOP(sift_down)(heap);
+
+    return popped->value;
+}
+
+/// returns -1 and pushes if the heap is empty
+static int LOOP(replace_top_entry)(struct heap *heap, struct heap_entry *popped, const struct heap_entry *entry) {
+    if (heap->length == 0) {
+        LOOP(push_entry)(heap, entry);
+        return -1;
+    } else if (heap->layout == LOSER_TREE) {
+        return LOOP(tree_replace_top)(heap, popped, entry);
+    }
+
+    *popped = heap->entries[0];
+    // the new entry is likely greater than the children of the root too,
+    // but it's only moved down once instead of first down and then up again
+    heap->entries[0] = *entry;
+    LOOP(sift_down)(heap);
+    return popped->value;
+}
+
+static int LOOP(find_runner_up)(struct heap *heap) {
+    if (heap->length < 2) {
+        return -1;
+    } else if (heap->layout == BINARY_HEAP) {
+        if (heap->length == 2 || CMP(&heap->entries[1], &heap->entries[2]) <= 0) {
+            return 1;
+        }
+        return 2;
+    }
+    if (heap->needs_rebuild) {
+        LOOP(tree_rebuild)(heap);
+    }
+    unsigned int winner = heap->tree[0];
+    // the winner has beaten everything else, so the runner-up is one it met on the way up
+    unsigned int node = (heap->capacity + winner) / 2;
+    unsigned int runner_up = heap->tree[node];
+    for (node /= 2; node > 0; node /= 2) {
+        if (LOOP(leaf_wins)(heap, heap->tree[node], runner_up)) {
+            runner_up = heap->tree[node];
+        }
+    }
+    return runner_up;
+}
+
+/// the runner-up must be from heap_find_runner_up() and the heap not modified since
+static bool LOOP(top_stays)(const struct heap *heap, int runner_up, const struct heap_entry *entry) {
+    int cmp = CMP(entry, &heap->entries[runner_up]);
+    if (heap->layout == LOSER_TREE) {
+        // ties are broken by position like in leaf_wins()
+        return cmp < 0 || (cmp == 0 && heap->tree[0] < (unsigned int)runner_up);
+    }
+    // sift_down() only moves the root if a child is less than it
+    return cmp <= 0;
+}
@@ -0,0 +1,372 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // fileno() and fsync() when compiling as c11
+#include "index.h"
+#include "decompress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+static const char MAGIC[8] = "tmindex1";
+static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+/// lines are only stored up to this long, and longer ones can't be used for comparing
+static const size_t MAX_LINE = 1024;
+/// how much to read or decompress at a time
+static const size_t CHUNK_SIZE = 1 << 20;
+
+/// what has been indexed so far
+struct builder {
+    struct index_entry *entries;
+    size_t length, capacity;
+    char *lines;
+    size_t lines_length, lines_capacity;
+    unsigned long every;
+    unsigned long lines_since_entry; //< how many lines have started since the last entry
+    bool at_line_start;
+    bool is_storing; //< the line of the last entry hasn't ended
+    uint64_t stored_length; //< of the line being stored, including what didn't fit
+    bool is_compressed;
+    off_t frame_offset; //< compressed: where the current member or frame starts in the file
+    off_t frame_position; //< compressed: how much was decompressed before it
+    bool frame_has_entry;
+};
+
+static bool builder_add_entry(struct builder *b, off_t position) {
+    if (b->length == b->capacity) {
+        size_t capacity = b->capacity == 0 ? 256 : b->capacity * 2;
+        struct index_entry *grown = realloc(b->entries, capacity * sizeof(struct index_entry));
+        if (grown == NULL) {
+            return false;
+        }
+        b->entries = grown;
+        b->capacity = capacity;
+    }
+    struct index_entry entry = {
+        .offset = b->is_compressed ? (uint64_t)b->frame_offset : (uint64_t)position,
+        .skip = b->is_compressed ? (uint64_t)(position - b->frame_position) : 0,
+        .line_start = b->lines_length,
+        .line_length = 0,
+        .is_complete = 0
+    };
+    b->entries[b->length++] = entry;
+    b->lines_since_entry = 0;
+    b->is_storing = true;
+    b->stored_length = 0;
+    b->frame_has_entry = true;
+    return true;
+}
+
+static bool builder_store(struct builder *b, const char *bytes, size_t length) {
+    struct index_entry *entry = &b->entries[b->length-1];
+    b->stored_length += length;
+    if (length > MAX_LINE - entry->line_length) {
+        length = MAX_LINE - entry->line_length;
+    }
+    if (b->lines_capacity - b->lines_length < length) {
+        size_t capacity = b->lines_capacity == 0 ? 64 << 10 : b->lines_capacity * 2;
+        char *grown = realloc(b->lines, capacity);
+        if (grown == NULL) {
+            return false;
+        }
+        b->lines = grown;
+        b->lines_capacity = capacity;
+    }
+    memcpy(&b->lines[b->lines_length], bytes, length);
+    b->lines_length += length;
+    entry->line_length += length;
+    return true;
+}
+
+/// index bytes that start position bytes into the file, or into what it decompresses to.
+static bool builder_add(struct builder *b, const char *bytes, size_t length, off_t position) {
+    size_t i = 0;
+    while (i < length) {
+        if (b->at_line_start) {
+            bool is_due = b->length == 0 || b->lines_since_entry >= b->every;
+            if (is_due && (!b->is_compressed || !b->frame_has_entry) && !builder_add_entry(b, position + i)) {
+                return false;
+            }
+            b->lines_since_entry++;
+            b->at_line_start = false;
+        }
+        const char *newline = memchr(&bytes[i], '\n', length - i);
+        size_t end = newline != NULL ? (size_t)(newline - bytes) + 1 : length;
+        if (b->is_storing && !builder_store(b, &bytes[i], end - i)) {
+            return false;
+        }
+        if (newline != NULL) {
+            if (b->is_storing) {
+                b->entries[b->length-1].is_complete = b->stored_length <= MAX_LINE;
+                b->is_storing = false;
+            }
+            b->at_line_start = true;
+        }
+        i = end;
+    }
+    return true;
+}
+
+/// write the sidecar next to path and rename it into place.
+static int builder_write(const struct builder *b, const char *path, const struct index_header *header) {
+    size_t path_length = strlen(path);
+    char *temporary = malloc(path_length + sizeof(INDEX_SUFFIX ".tmp"));
+    if (temporary == NULL) {
+        return -1;
+    }
+    sprintf(temporary, "%s" INDEX_SUFFIX ".tmp", path);
+    FILE *file = fopen(temporary, "w");
+    if (file == NULL) {
+        free(temporary);
+        return -1;
+    }
+    fwrite(header, sizeof(*header), 1, file);
+    fwrite(b->entries, sizeof(struct index_entry), b->length, file);
+    fwrite(b->lines, 1, b->lines_length, file);
+    bool failed = ferror(file) != 0 || fflush(file) != 0 || fsync(fileno(file)) != 0;
+    failed |= fclose(file) != 0;
+    // the sidecar is the temporary path without ".tmp"
+    char *sidecar = strdup(temporary);
+    if (sidecar != NULL) {
+        sidecar[path_length + strlen(INDEX_SUFFIX)] = '\0';
+    }
+    if (failed || sidecar == NULL || rename(temporary, sidecar) != 0) {
+        int error = sidecar == NULL ? ENOMEM : errno;
+        unlink(temporary);
+        free(temporary);
+        free(sidecar);
+        errno = error;
+        return -1;
+    }
+    free(temporary);
+    free(sidecar);
+    return 0;
+}
+
+int index_build(const char *path, unsigned long every) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat info;
+    bool is_stat = fstat(fd, &info) == 0;
+    if (!is_stat || !S_ISREG(info.st_mode)) {
+        // only regular files can be searched
+        int error = is_stat ? EINVAL : errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    enum compression compression = compression_detect(fd);
+    struct decompressor *decompressor = NULL;
+    if (compression != COMPRESSION_NONE && (decompressor = decompressor_create(compression, fd)) == NULL) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    struct builder b = {
+        .entries = NULL, .length = 0, .capacity = 0,
+        .lines = NULL, .lines_length = 0, .lines_capacity = 0,
+        .every = every == 0 ? 1 : every,
+        .lines_since_entry = 0,
+        .at_line_start = true,
+        .is_storing = false,
+        .is_compressed = decompressor != NULL,
+        .frame_offset = 0,
+        .frame_position = 0,
+        .frame_has_entry = false
+    };
+    char *chunk = malloc(CHUNK_SIZE);
+    off_t position = 0;
+    ssize_t read_bytes = chunk == NULL ? -1 : 0;
+    while (chunk != NULL) {
+        read_bytes = decompressor != NULL
+            ? decompressor_read(decompressor, chunk, CHUNK_SIZE)
+            : read(fd, chunk, CHUNK_SIZE);
+        if (read_bytes < 0 && errno == EINTR) {
+            continue;
+        } else if (read_bytes <= 0) {
+            break;
+        }
+        if (decompressor != NULL && decompressor_frame_offset(decompressor) != b.frame_offset) {
+            b.frame_offset = decompressor_frame_offset(decompressor);
+            b.frame_position = position;
+            b.frame_has_entry = false;
+        }
+        if (!builder_add(&b, chunk, read_bytes, position)) {
+            read_bytes = -1;
+            errno = ENOMEM;
+            break;
+        }
+        position += read_bytes;
+    }
+    int error = chunk == NULL ? ENOMEM : errno;
+    // the size after reading, for compressed files
+    int result = read_bytes < 0 || fstat(fd, &info) != 0 ? -1 : 0;
+    if (result == 0) {
+        struct index_header header = {
+            .byte_order = BYTE_ORDER_MARK,
+            .is_compressed = decompressor != NULL,
+            .device = info.st_dev,
+            .inode = info.st_ino,
+            // what has been appended since is searched without the index
+            .size = decompressor != NULL || position > info.st_size ? (uint64_t)info.st_size : (uint64_t)position,
+            .modified_sec = info.st_mtim.tv_sec,
+            .modified_nsec = info.st_mtim.tv_nsec,
+            .entries_length = b.length,
+            .lines_length = b.lines_length
+        };
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        result = builder_write(&b, path, &header);
+        error = errno;
+    }
+    if (decompressor != NULL) {
+        decompressor_destroy(decompressor);
+    }
+    close(fd);
+    free(chunk);
+    free(b.entries);
+    free(b.lines);
+    errno = error;
+    return result;
+}
+
+/// check that the sidecar is complete and that its entries are in order.
+static bool is_valid(const struct index *index) {
+    const struct index_header *header = index->header;
+    size_t length = index->mapping_length - sizeof(*header);
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->byte_order != BYTE_ORDER_MARK
+            || header->entries_length > length / sizeof(struct index_entry)
+            || header->lines_length != length - header->entries_length * sizeof(struct index_entry)) {
+        return false;
+    }
+    for (uint64_t i=0; i<header->entries_length; i++) {
+        const struct index_entry *entry = &index->entries[i];
+        if (entry->line_start > header->lines_length || entry->line_length > header->lines_length - entry->line_start
+                || (i != 0 && entry->offset < index->entries[i-1].offset)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// check that the last indexed line of an uncompressed file is still there, in case it has been rewritten.
+static bool last_line_is_unchanged(const struct index *index, int fd) {
+    uint64_t length = index->header->entries_length;
+    if (length == 0) {
+        return true;
+    }
+    struct iovec line = index_line(index, length-1);
+    char stored[MAX_LINE];
+    return line.iov_len <= MAX_LINE
+        && pread(fd, stored, line.iov_len, index->entries[length-1].offset) == (ssize_t)line.iov_len
+        && memcmp(stored, line.iov_base, line.iov_len) == 0;
+}
+
+bool index_open(struct index *index, const char *path, int fd, bool is_compressed) {
+    index->mapping = NULL;
+    char *sidecar = malloc(strlen(path) + sizeof(INDEX_SUFFIX));
+    if (sidecar == NULL) {
+        return false;
+    }
+    sprintf(sidecar, "%s" INDEX_SUFFIX, path);
+    int index_fd = open(sidecar, O_RDONLY);
+    free(sidecar);
+    struct stat info, indexed;
+    if (index_fd < 0) {
+        return false;
+    } else if (fstat(index_fd, &info) != 0 || info.st_size < (off_t)sizeof(struct index_header)
+            || fstat(fd, &indexed) != 0) {
+        close(index_fd);
+        return false;
+    }
+    void *mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, index_fd, 0);
+    close(index_fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    index->mapping = mapping;
+    index->mapping_length = info.st_size;
+    index->header = mapping;
+    index->entries = (const struct index_entry*)&index->header[1];
+    index->lines = (const char*)&index->entries[index->header->entries_length];
+    const struct index_header *header = index->header;
+    if (!is_valid(index) || header->device != (uint64_t)indexed.st_dev || header->inode != (uint64_t)indexed.st_ino
+            || (uint64_t)indexed.st_size < header->size || header->is_compressed != is_compressed
+            || (is_compressed && ((uint64_t)indexed.st_size != header->size
+                                  || header->modified_sec != indexed.st_mtim.tv_sec
+                                  || header->modified_nsec != indexed.st_mtim.tv_nsec))
+            || (!is_compressed && !last_line_is_unchanged(index, fd))) {
+        index_close(index);
+        return false;
+    }
+    return true;
+}
+
+void index_close(struct index *index) {
+    if (index->mapping != NULL) {
+        munmap(index->mapping, index->mapping_length);
+    }
+    index->mapping = NULL;
+}
+
+struct iovec index_line(const struct index *index, long entry) {
+    struct iovec line = {
+        .iov_base = (char*)&index->lines[index->entries[entry].line_start],
+        .iov_len = index->entries[entry].line_length
+    };
+    return line;
+}
+
+bool index_key(const struct index *index, long entry, const struct bisect *bisect, struct bisect_key *key) {
+    return index->entries[entry].is_complete && bisect_key_of_line(bisect, index_line(index, entry), key);
+}
+
+long index_find(const struct index *index, const struct bisect *bisect, const struct bisect_key *key,
+                bool include_equal, long *before) {
+    // entries that can't be used are skipped by using the next one that can
+    long low = 0, high = (long)index->header->entries_length, found = high;
+    while (low < high) {
+        long middle = low + (high - low) / 2, usable = middle;
+        struct bisect_key indexed;
+        while (usable < high && !index_key(index, usable, bisect, &indexed)) {
+            usable++;
+        }
+        if (usable == high) {
+            high = middle;
+            continue;
+        }
+        int cmp = bisect_compare(bisect->order, &indexed, key);
+        if (cmp > 0 || (cmp == 0 && include_equal)) {
+            found = usable;
+            high = middle;
+        } else {
+            low = usable + 1;
+        }
+    }
+    *before = found - 1;
+    struct bisect_key indexed;
+    while (*before >= 0 && !index_key(index, *before, bisect, &indexed)) {
+        (*before)--;
+    }
+    return found;
+}
@@ -0,0 +1,85 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! --build-index: sparse sidecar files with every Nth line of a file and where it starts,
+//! which are mapped by later runs so that --since, --until and --split=ranges can find lines without reading
+//! much of the file, and so that compressed files can be started at a gzip member or zstd or lz4 frame.
+//! The sidecar of a file is its path with INDEX_SUFFIX added, and has a header and an array of entries
+//! followed by the start of the indexed lines. It's in the byte order of the machine that made it.
+//! Lines are stored instead of keys so that an index works with any key options.
+
+#ifndef _INDEX_H_
+#define _INDEX_H_
+#include "bisect.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h> // off_t
+#include <sys/uio.h> // struct iovec
+
+#define INDEX_SUFFIX ".tmidx"
+
+struct index_header {
+    char magic[8];
+    uint32_t byte_order; //< detects an index from a machine with a different one
+    uint32_t is_compressed;
+    uint64_t device, inode;
+    uint64_t size; //< of the file, or how much of it was indexed if it's not compressed
+    int64_t modified_sec, modified_nsec; //< of compressed files, which aren't appended to
+    uint64_t entries_length;
+    uint64_t lines_length; //< bytes after entries
+};
+
+struct index_entry {
+    uint64_t offset; //< where the line starts, or in compressed files where the member or frame it's in starts
+    uint64_t skip; //< compressed files: how much of the decompressed member or frame is before the line
+    uint64_t line_start; //< where in the bytes after the entries the start of the line is
+    uint32_t line_length;
+    uint32_t is_complete; //< the whole line is stored, including its newline
+};
+
+struct index {
+    void *mapping; //< owned
+    size_t mapping_length;
+    const struct index_header *header;
+    const struct index_entry *entries;
+    const char *lines;
+};
+
+/// reads the file at path and writes its sidecar, with every `every` lines, or for compressed files
+/// the first line that starts in each member or frame that starts at least that many lines after the previous.
+/// returns -1 with errno set if that fails.
+int index_build(const char *path, unsigned long every);
+
+/// maps the sidecar of path if there is one and it's for the file open as fd:
+/// the same inode, compressed or not like when indexed, and at least as big and with the last indexed line
+/// unchanged if it's not compressed, or unmodified if it is.
+/// returns false if there isn't one that can be used.
+bool index_open(struct index *index, const char *path, int fd, bool is_compressed);
+void index_close(struct index *index);
+
+/// the indexed line of an entry, which might only be the start of it.
+struct iovec index_line(const struct index *index, long entry);
+/// sets key to the key of the line of an entry as compared by bisect.
+/// returns false if the whole line isn't stored or it doesn't have a key to compare, so it can't be used.
+bool index_key(const struct index *index, long entry, const struct bisect *bisect, struct bisect_key *key);
+/// finds the first entry whose line is after key (or equal to it if include_equal) like bisect_find(),
+/// or returns the number of entries if there is none. The file must be sorted.
+/// Sets before to the last entry before that which can be used, or to -1 if there is none.
+long index_find(const struct index *index, const struct bisect *bisect, const struct bisect_key *key,
+                bool include_equal, long *before);
+
+#endif // !defined(_INDEX_H_)
@@ -0,0 +1,262 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // REG_STARTEND
+#include "key.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h> // NAN, ldexp()
+#include <float.h> // DBL_MIN_EXP
+
+/// parse a positive number, and return the character after it.
+static const char* parse_position(const char *arg, unsigned int *position) {
+    char *end;
+    errno = 0;
+    unsigned long parsed = strtoul(arg, &end, 10);
+    if (errno != 0 || end == arg || *arg == '-' || *arg == '+' || parsed == 0 || parsed > UINT_MAX) {
+        return NULL;
+    }
+    *position = (unsigned int)parsed;
+    return end;
+}
+
+bool key_parse_fields(const char *arg, struct key_spec *spec) {
+    const char *after = parse_position(arg, &spec->first);
+    spec->last = 0;
+    if (after != NULL && *after == ',') {
+        after = parse_position(after + 1, &spec->last);
+    }
+    if (after == NULL || *after != '\0' || (spec->last != 0 && spec->last < spec->first)) {
+        return false;
+    }
+    spec->type = KEY_FIELDS;
+    return true;
+}
+
+bool key_parse_bytes(const char *arg, struct key_spec *spec) {
+    const char *after = arg;
+    spec->first = 1;
+    spec->last = 0;
+    if (*after != '-') {
+        after = parse_position(after, &spec->first);
+    }
+    if (after == NULL || *after != '-') {
+        return false;
+    }
+    after++;
+    if (*after != '\0') {
+        after = parse_position(after, &spec->last);
+    } else if (arg[0] == '-') {
+        // just a dash
+        return false;
+    }
+    if (after == NULL || *after != '\0' || (spec->last != 0 && spec->last < spec->first)) {
+        return false;
+    }
+    spec->type = KEY_BYTES;
+    return true;
+}
+
+bool key_parse_regex(const char *arg, struct key_spec *spec) {
+    if (regcomp(&spec->regex, arg, REG_EXTENDED) != 0) {
+        return false;
+    }
+    spec->has_subexpression = spec->regex.re_nsub > 0;
+    spec->type = KEY_REGEX;
+    return true;
+}
+
+void key_spec_destroy(struct key_spec *spec) {
+    if (spec->type == KEY_REGEX) {
+        regfree(&spec->regex);
+    }
+    spec->type = KEY_LINE;
+}
+
+static bool is_blank(char c) {
+    return c == ' ' || c == '\t';
+}
+
+/// find the start of field `field` (counted from 1) in line[from..length), or return length.
+static size_t find_field(const struct key_spec *spec, const char *line, size_t length, unsigned int field) {
+    size_t position = 0;
+    for (unsigned int skipped = 1; skipped < field; skipped++) {
+        if (spec->separator >= 0) {
+            const char *separator = memchr(&line[position], spec->separator, length - position);
+            if (separator == NULL) {
+                return length;
+            }
+            position = separator - line + 1;
+        } else {
+            // a field is blanks followed by non-blanks
+            while (position < length && is_blank(line[position])) {
+                position++;
+            }
+            while (position < length && !is_blank(line[position])) {
+                position++;
+            }
+            if (position == length) {
+                return length;
+            }
+        }
+    }
+    return position;
+}
+
+/// find where the field starting at `start` ends.
+static size_t field_end(const struct key_spec *spec, const char *line, size_t length, size_t start) {
+    if (spec->separator >= 0) {
+        const char *separator = memchr(&line[start], spec->separator, length - start);
+        return separator == NULL ? length : (size_t)(separator - line);
+    }
+    while (start < length && is_blank(line[start])) {
+        start++;
+    }
+    while (start < length && !is_blank(line[start])) {
+        start++;
+    }
+    return start;
+}
+
+static struct iovec regex_key(const struct key_spec *spec, const char *line, size_t length) {
+    regmatch_t matches[2];
+    struct iovec key = { .iov_base = (char*)line + length, .iov_len = 0 };
+#ifdef REG_STARTEND
+    matches[0].rm_so = 0;
+    matches[0].rm_eo = length;
+    int result = regexec(&spec->regex, line, 2, matches, REG_STARTEND);
+#else
+    // needs a NUL-terminated copy
+    char *copy = malloc(length + 1);
+    if (copy == NULL) {
+        return key;
+    }
+    memcpy(copy, line, length);
+    copy[length] = '\0';
+    int result = regexec(&spec->regex, copy, 2, matches, 0);
+    free(copy);
+#endif
+    regmatch_t *match = spec->has_subexpression ? &matches[1] : &matches[0];
+    if (result == 0 && match->rm_so != -1) {
+        key.iov_base = (char*)line + match->rm_so;
+        key.iov_len = match->rm_eo - match->rm_so;
+    }
+    return key;
+}
+
+struct iovec key_extract(const struct key_spec *spec, struct iovec line) {
+    const char *bytes = line.iov_base;
+    size_t length = line.iov_len;
+    if (spec->type == KEY_LINE && spec->compare != COMPARE_VERSIONS) {
+        return line;
+    }
+    if (length != 0 && bytes[length-1] == '\n') {
+        length--;
+    }
+    if (spec->type == KEY_LINE) {
+        // sort -V orders the end before letters, which a newline wouldn't be
+        line.iov_len = length;
+        return line;
+    }
+    size_t start = length, end = length;
+    if (spec->type == KEY_REGEX) {
+        return regex_key(spec, bytes, length);
+    } else if (spec->type == KEY_BYTES) {
+        if (spec->first <= length) {
+            start = spec->first - 1;
+            end = spec->last == 0 || spec->last > length ? length : spec->last;
+        }
+    } else {
+        start = find_field(spec, bytes, length, spec->first);
+        if (spec->last != 0) {
+            end = start;
+            for (unsigned int field = spec->first; field <= spec->last && end < length; field++) {
+                // skip the separator after the previous field
+                if (field != spec->first && spec->separator >= 0) {
+                    end++;
+                }
+                end = field_end(spec, bytes, length, end);
+            }
+        }
+    }
+    struct iovec key = { .iov_base = (char*)bytes + start, .iov_len = end - start };
+    return key;
+}
+
+/// longer numbers are truncated, which only affects those that are already rounded to infinity
+#define MAX_NUMBER_LENGTH 511
+
+/// sort -h compares the suffix before the number, so that 0.9G is after 991M.
+/// To keep that in one double, each suffix gets its own band of exponents
+/// and magnitudes outside 2^-93 to 2^93 are clamped to fit in it.
+#define HUMAN_BAND_EXPONENTS 186
+
+static double human_size(double parsed, int order) {
+    double magnitude = fabs(parsed);
+    double smallest = ldexp(1.0, -HUMAN_BAND_EXPONENTS/2);
+    double largest = nextafter(ldexp(1.0, HUMAN_BAND_EXPONENTS/2), 0.0);
+    magnitude = magnitude < smallest ? smallest : magnitude > largest ? largest : magnitude;
+    // the bands start at the smallest normal double, and the tenth ends just below the largest
+    magnitude = ldexp(magnitude, DBL_MIN_EXP - 1 + HUMAN_BAND_EXPONENTS * order + HUMAN_BAND_EXPONENTS/2);
+    return parsed < 0 ? -magnitude : magnitude;
+}
+
+double key_number(const struct key_spec *spec, struct iovec key) {
+    const char *bytes = key.iov_base;
+    size_t length = key.iov_len;
+    char number[MAX_NUMBER_LENGTH + 1];
+    size_t copied = 0;
+    if (spec->compare == COMPARE_GENERAL_NUMBERS) {
+        copied = length < MAX_NUMBER_LENGTH ? length : MAX_NUMBER_LENGTH;
+        memcpy(number, bytes, copied);
+        number[copied] = '\0';
+        char *end;
+        double parsed = strtod(number, &end);
+        return end == number ? NAN : parsed;
+    }
+    size_t position = 0;
+    while (position < length && is_blank(bytes[position])) {
+        position++;
+    }
+    if (position < length && bytes[position] == '-') {
+        number[copied++] = '-';
+        position++;
+    }
+    bool seen_point = false;
+    for (; position < length && copied < MAX_NUMBER_LENGTH; position++) {
+        char c = bytes[position];
+        if (c == '.' && !seen_point) {
+            seen_point = true;
+        } else if (c < '0' || c > '9') {
+            break;
+        }
+        number[copied++] = c;
+    }
+    number[copied] = '\0';
+    double parsed = strtod(number, NULL);
+    if (spec->compare == COMPARE_HUMAN_SIZES && parsed != 0.0) {
+        static const char SUFFIXES[] = "KMGTPEZYRQ";
+        int order = 0;
+        if (position < length && bytes[position] != '\0') {
+            const char *suffix = strchr(SUFFIXES, bytes[position] == 'k' ? 'K' : bytes[position]);
+            order = suffix != NULL ? (int)(suffix - SUFFIXES + 1) : 0;
+        }
+        return human_size(parsed, order);
+    }
+    return parsed;
+}
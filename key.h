@@ -0,0 +1,71 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Which part of a line is compared: the whole line, a field, a range of bytes, or what a regex matches,
+//! and how: as bytes, versions or numbers.
+
+#ifndef _KEY_H_
+#define _KEY_H_
+#include <sys/uio.h> // struct iovec
+#include <stdbool.h>
+#include <regex.h>
+
+enum key_type {
+    KEY_LINE, //< the whole line including the newline, except with COMPARE_VERSIONS
+    KEY_FIELDS, //< like sort -t SEP -k FIRST,LAST
+    KEY_BYTES, //< like cut -b FIRST-LAST
+    KEY_REGEX //< the first subexpression of a match, or the whole match if there are none
+};
+
+enum key_compare {
+    COMPARE_BYTES, //< memcmp(), or by timestamp if --timestamp is used
+    COMPARE_NUMBERS, //< like sort -n: an optional minus and digits with an optional decimal point
+    COMPARE_GENERAL_NUMBERS, //< like sort -g: anything strtod() accepts, and other keys before NaN
+    COMPARE_HUMAN_SIZES, //< like sort -h: by the K, M, G, T, P, E, Z, Y, R or Q suffix and then the number
+    COMPARE_VERSIONS //< like sort -V: runs of digits compared by value, see heap_compare_versions()
+};
+
+struct key_spec {
+    enum key_type type;
+    enum key_compare compare;
+    /// KEY_FIELDS: fields are separated by this, or if it's -1 start at blanks after something else,
+    /// so that they include the blanks before them like with sort.
+    int separator;
+    /// KEY_FIELDS and KEY_BYTES: counted from 1, and last is 0 for the end of the line.
+    unsigned int first, last;
+    regex_t regex; //< KEY_REGEX
+    bool has_subexpression; //< KEY_REGEX
+};
+
+/// Parses a sort-style FIRST[,LAST] field position for -k.
+/// Returns false if it's invalid. Doesn't set the separator.
+bool key_parse_fields(const char *arg, struct key_spec *spec);
+/// Parses a cut-style FIRST-LAST, FIRST- or -LAST byte range.
+bool key_parse_bytes(const char *arg, struct key_spec *spec);
+/// Compiles an extended regular expression, and returns false if it's invalid.
+bool key_parse_regex(const char *arg, struct key_spec *spec);
+void key_spec_destroy(struct key_spec *spec);
+
+/// Parses the number at the start of a key for the numeric ways to compare.
+/// Keys without a number are 0 except for COMPARE_GENERAL_NUMBERS, where they are NaN.
+double key_number(const struct key_spec *spec, struct iovec key);
+
+/// Returns the part of the line to compare, which is empty (at the end of the line)
+/// if the line doesn't have the field or doesn't match.
+/// Except for KEY_LINE, the newline at the end isn't included.
+struct iovec key_extract(const struct key_spec *spec, struct iovec line);
+
+#endif // !defined(_KEY_H_)
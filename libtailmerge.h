@@ -0,0 +1,53 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! The merging of tailmerge as a shared library (make libtailmerge.so), for programs that want the merged
+//! output without starting tailmerge and reading it back through a pipe.
+//! The output is passed in the same batches it would be written in, as slices of the mapped files and of
+//! the buffers that the other files are read into, so it isn't copied.
+
+#ifndef _LIBTAILMERGE_H_
+#define _LIBTAILMERGE_H_
+#include <sys/uio.h> // struct iovec
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Receives a batch of output. The slices are only valid until it returns.
+/// It's only called from the thread that called tailmerge_run(), also with --jobs,
+/// as the other threads merge into buffers or temporary files that this thread writes from.
+typedef void (*tailmerge_output)(void *opaque, const struct iovec *slices, int length);
+
+/// Receives the message of the error that made the merge fail, without a trailing newline.
+/// It's called at most once per merge, but can be called from one of the merging threads.
+typedef void (*tailmerge_error)(void *opaque, const char *message);
+
+/// Merges like running tailmerge with argv, which starts with a program name that is only used in messages,
+/// but passes the output to output (if not NULL) instead of writing it to stdout.
+/// Returns the exit code tailmerge would have exited with, after releasing everything the merge used.
+/// Errors (including in the arguments) are passed to error, or printed to stderr if it's NULL,
+/// and --help returns 0 after printing the help to stdout.
+/// If a merge fails, it waits for its threads to stop, which they do after the read they're waiting for.
+/// Several merges can run at the same time on different threads.
+__attribute__((visibility("default")))
+int tailmerge_run(int argc, char **argv, tailmerge_output output, tailmerge_error error, void *opaque);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // !defined(_LIBTAILMERGE_H_)
@@ -0,0 +1,137 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "newlines.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h> // memchr()
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/// store the set bits of a mask where bit i<<shift means buffer[offset+i] is a newline.
+/// returns false if offsets became full before all of them were stored.
+static inline bool store_mask(uint64_t mask, int shift, int offset, int *offsets, int max,
+                              int *found, int *scanned) {
+    while (mask != 0) {
+        int newline = offset + (__builtin_ctzll(mask) >> shift);
+        if (*found == max) {
+            *scanned = newline;
+            return false;
+        }
+        offsets[(*found)++] = newline;
+        mask &= mask - 1;
+    }
+    return true;
+}
+
+/// the part that's too short for a vector, or everything if none are supported
+static int find_scalar(const char *buffer, int from, int length, int *offsets, int max, int found, int *scanned) {
+    const char *newline;
+    while ((newline = memchr(&buffer[from], '\n', length - from)) != NULL) {
+        if (found == max) {
+            *scanned = newline - buffer;
+            return found;
+        }
+        offsets[found++] = newline - buffer;
+        from = newline + 1 - buffer;
+    }
+    *scanned = length;
+    return found;
+}
+
+#if defined(__SSE2__)
+static int find_sse2(const char *buffer, int from, int length, int *offsets, int max, int *scanned) {
+    const __m128i newlines = _mm_set1_epi8('\n');
+    int found = 0;
+    for (; from + 16 <= length; from += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)&buffer[from]);
+        uint64_t mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newlines));
+        if (!store_mask(mask, 0, from, offsets, max, &found, scanned)) {
+            return found;
+        }
+    }
+    return find_scalar(buffer, from, length, offsets, max, found, scanned);
+}
+
+__attribute__((target("avx2")))
+static int find_avx2(const char *buffer, int from, int length, int *offsets, int max, int *scanned) {
+    const __m256i newlines = _mm256_set1_epi8('\n');
+    int found = 0;
+    for (; from + 32 <= length; from += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)&buffer[from]);
+        uint64_t mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, newlines));
+        if (!store_mask(mask, 0, from, offsets, max, &found, scanned)) {
+            return found;
+        }
+    }
+    return find_scalar(buffer, from, length, offsets, max, found, scanned);
+}
+
+__attribute__((target("avx512bw")))
+static int find_avx512(const char *buffer, int from, int length, int *offsets, int max, int *scanned) {
+    const __m512i newlines = _mm512_set1_epi8('\n');
+    int found = 0;
+    for (; from + 64 <= length; from += 64) {
+        __m512i bytes = _mm512_loadu_si512((const void*)&buffer[from]);
+        uint64_t mask = _mm512_cmpeq_epi8_mask(bytes, newlines);
+        if (!store_mask(mask, 0, from, offsets, max, &found, scanned)) {
+            return found;
+        }
+    }
+    return find_scalar(buffer, from, length, offsets, max, found, scanned);
+}
+
+typedef int (*find_function)(const char *buffer, int from, int length, int *offsets, int max, int *scanned);
+
+/// the best implementation the CPU supports
+static find_function find = find_sse2;
+
+/// chosen before main(), so that threads merging files in parallel don't race to do it
+__attribute__((constructor)) static void choose_find(void) {
+    __builtin_cpu_init();
+    find = __builtin_cpu_supports("avx512bw") ? find_avx512
+        : __builtin_cpu_supports("avx2") ? find_avx2
+        : find_sse2;
+}
+
+#elif defined(__aarch64__)
+static int find(const char *buffer, int from, int length, int *offsets, int max, int *scanned) {
+    const uint8x16_t newlines = vdupq_n_u8('\n');
+    int found = 0;
+    for (; from + 16 <= length; from += 16) {
+        uint8x16_t matches = vceqq_u8(vld1q_u8((const uint8_t*)&buffer[from]), newlines);
+        // narrow to four bits per byte, as there is no movemask
+        uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(matches), 4);
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) & 0x1111111111111111;
+        if (!store_mask(mask, 2, from, offsets, max, &found, scanned)) {
+            return found;
+        }
+    }
+    return find_scalar(buffer, from, length, offsets, max, found, scanned);
+}
+
+#else
+static int find(const char *buffer, int from, int length, int *offsets, int max, int *scanned) {
+    return find_scalar(buffer, from, length, offsets, max, 0, scanned);
+}
+#endif
+
+int newlines_find(const char *buffer, int from, int length, int *offsets, int max, int *scanned) {
+    return find(buffer, from, length, offsets, max, scanned);
+}
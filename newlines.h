@@ -0,0 +1,29 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+//! Finds many newlines in a buffer in one pass, using SSE2, AVX2, AVX-512 or NEON where available.
+
+#ifndef _NEWLINES_H_
+#define _NEWLINES_H_
+
+/// Stores the offsets of up to `max` newlines in buffer[from..length) into `offsets`, in order,
+/// and returns how many were found.
+/// `*scanned` is set to where the next search should start: `length` if all newlines were stored,
+/// otherwise the offset of the first one that didn't fit.
+int newlines_find(const char *buffer, int from, int length, int *offsets, int max, int *scanned);
+
+#endif // !defined(_NEWLINES_H_)
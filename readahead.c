@@ -0,0 +1,411 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // pthreads when compiling as c11
+#include "readahead.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h> // uintptr_t
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+enum slot_state {
+    SLOT_IDLE,
+    SLOT_QUEUED, //< waiting for or being read by a thread, or submitted to io_uring
+    SLOT_DONE
+};
+
+struct readahead_slot {
+    enum slot_state state;
+    int fd;
+    readahead_reader reader; //< used instead of read() if not NULL
+    void *reader_state;
+    void *buffer;
+    size_t length;
+    ssize_t result;
+    int error;
+};
+
+#ifdef __linux__
+struct ring {
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+#endif
+
+struct threads {
+    pthread_mutex_t lock;
+    pthread_cond_t queued; //< signaled when a slot is queued or stopping is set
+    pthread_cond_t done; //< broadcast when any read is done
+    unsigned int *queue; //< ring buffer of slots, which can't be longer than the number of slots
+    unsigned int queue_start;
+    unsigned int queue_length;
+    bool stopping;
+    unsigned int workers_length;
+    pthread_t workers[];
+};
+
+struct readahead {
+    enum readahead_backend backend;
+    unsigned int slots_length;
+    struct readahead_slot *slots;
+#ifdef __linux__
+    struct ring ring;
+#endif
+    struct threads *threads;
+};
+
+/// how many threads to read with if io_uring isn't available
+static const unsigned int MAX_WORKERS = 4;
+
+#ifdef __linux__
+static bool ring_setup(struct ring *ring, unsigned int slots) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // submissions are entered one at a time, but every slot might complete before being waited for
+    const unsigned int sq_entries = 16;
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = slots < sq_entries ? sq_entries : slots;
+    ring->fd = (int)syscall(__NR_io_uring_setup, sq_entries, &params);
+    if (ring->fd < 0) {
+        return false;
+    }
+    // reading from the current position of pipes and files requires kernel 5.6
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return false;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        int error = errno;
+        if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+        if (ring->cq_ring != MAP_FAILED) munmap(ring->cq_ring, ring->cq_ring_size);
+        if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+        close(ring->fd);
+        errno = error;
+        return false;
+    }
+    char *sq = ring->sq_ring;
+    ring->sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int*)(sq + params.sq_off.array);
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned int*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+static void ring_destroy(struct ring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+static int ring_enter(struct ring *ring, unsigned int to_submit, unsigned int min_complete) {
+    unsigned int flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+    do {
+        ret = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+static void ring_submit(struct readahead *engine, unsigned int slot) {
+    struct ring *ring = &engine->ring;
+    unsigned int tail = *ring->sq_tail;
+    unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = engine->slots[slot].fd;
+    sqe->off = (__u64)-1; // current position
+    sqe->addr = (__u64)(uintptr_t)engine->slots[slot].buffer;
+    sqe->len = engine->slots[slot].length;
+    sqe->user_data = slot;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail+1, __ATOMIC_RELEASE);
+    if (ring_enter(ring, 1, 0) < 0) {
+        // complete it with the error so that it's reported by readahead_wait()
+        engine->slots[slot].state = SLOT_DONE;
+        engine->slots[slot].result = -1;
+        engine->slots[slot].error = errno;
+    }
+}
+
+/// store the results of all completed reads
+static void ring_reap(struct readahead *engine) {
+    struct ring *ring = &engine->ring;
+    unsigned int head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        struct readahead_slot *slot = &engine->slots[cqe->user_data];
+        slot->state = SLOT_DONE;
+        slot->result = cqe->res < 0 ? -1 : cqe->res;
+        slot->error = cqe->res < 0 ? -cqe->res : 0;
+        head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif // defined(__linux__)
+
+static void* worker(void *arg) {
+    struct readahead *engine = arg;
+    struct threads *threads = engine->threads;
+    pthread_mutex_lock(&threads->lock);
+    while (true) {
+        while (threads->queue_length == 0 && !threads->stopping) {
+            pthread_cond_wait(&threads->queued, &threads->lock);
+        }
+        if (threads->queue_length == 0) {
+            break;
+        }
+        struct readahead_slot *slot = &engine->slots[threads->queue[threads->queue_start]];
+        threads->queue_start = (threads->queue_start + 1) % engine->slots_length;
+        threads->queue_length--;
+        pthread_mutex_unlock(&threads->lock);
+
+        ssize_t result;
+        do {
+            result = slot->reader != NULL
+                ? slot->reader(slot->reader_state, slot->buffer, slot->length)
+                : read(slot->fd, slot->buffer, slot->length);
+        } while (result < 0 && errno == EINTR);
+        int error = errno;
+
+        pthread_mutex_lock(&threads->lock);
+        slot->result = result;
+        slot->error = result < 0 ? error : 0;
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&threads->done);
+    }
+    pthread_mutex_unlock(&threads->lock);
+    return NULL;
+}
+
+static void threads_stop(struct readahead *engine, unsigned int started) {
+    struct threads *threads = engine->threads;
+    pthread_mutex_lock(&threads->lock);
+    threads->stopping = true;
+    pthread_cond_broadcast(&threads->queued);
+    pthread_mutex_unlock(&threads->lock);
+    for (unsigned int i=0; i<started; i++) {
+        pthread_join(threads->workers[i], NULL);
+    }
+    pthread_cond_destroy(&threads->done);
+    pthread_cond_destroy(&threads->queued);
+    pthread_mutex_destroy(&threads->lock);
+    free(threads->queue);
+    free(threads);
+    engine->threads = NULL;
+}
+
+static bool threads_start(struct readahead *engine) {
+    unsigned int workers = engine->slots_length < MAX_WORKERS ? engine->slots_length : MAX_WORKERS;
+    struct threads *threads = malloc(sizeof(struct threads) + workers * sizeof(pthread_t));
+    unsigned int *queue = malloc(engine->slots_length * sizeof(unsigned int));
+    if (threads == NULL || queue == NULL) {
+        free(threads);
+        free(queue);
+        errno = ENOMEM;
+        return false;
+    }
+    pthread_mutex_init(&threads->lock, NULL);
+    pthread_cond_init(&threads->queued, NULL);
+    pthread_cond_init(&threads->done, NULL);
+    threads->queue = queue;
+    threads->queue_start = threads->queue_length = 0;
+    threads->stopping = false;
+    threads->workers_length = workers;
+    engine->threads = threads;
+    for (unsigned int i=0; i<workers; i++) {
+        int error = pthread_create(&threads->workers[i], NULL, worker, engine);
+        if (error != 0) {
+            threads_stop(engine, i);
+            errno = error;
+            return false;
+        }
+    }
+    return true;
+}
+
+struct readahead* readahead_create(enum readahead_backend backend, unsigned int slots) {
+    struct readahead *engine = malloc(sizeof(struct readahead));
+    struct readahead_slot *slot_array = calloc(slots == 0 ? 1 : slots, sizeof(struct readahead_slot));
+    if (engine == NULL || slot_array == NULL) {
+        free(engine);
+        free(slot_array);
+        errno = ENOMEM;
+        return NULL;
+    }
+    engine->slots_length = slots;
+    engine->slots = slot_array;
+    engine->threads = NULL;
+
+#ifdef __linux__
+    if (backend != READAHEAD_THREADS && ring_setup(&engine->ring, slots)) {
+        engine->backend = READAHEAD_IO_URING;
+        return engine;
+    }
+#else
+    errno = ENOSYS;
+#endif
+    if (backend != READAHEAD_IO_URING && threads_start(engine)) {
+        engine->backend = READAHEAD_THREADS;
+        return engine;
+    }
+    int error = errno;
+    free(slot_array);
+    free(engine);
+    errno = error;
+    return NULL;
+}
+
+void readahead_destroy(struct readahead *engine) {
+    // the kernel or threads must be done writing to the buffers before they are freed
+    for (unsigned int i=0; i<engine->slots_length; i++) {
+        if (readahead_is_pending(engine, i)) {
+            readahead_wait(engine, i);
+        }
+    }
+    if (engine->backend == READAHEAD_THREADS) {
+        threads_stop(engine, engine->threads->workers_length);
+    }
+#ifdef __linux__
+    else {
+        ring_destroy(&engine->ring);
+    }
+#endif
+    free(engine->slots);
+    free(engine);
+}
+
+enum readahead_backend readahead_get_backend(const struct readahead *engine) {
+    return engine->backend;
+}
+
+/// queue the slot for the threads, or submit a read() to io_uring
+static void submit(struct readahead *engine, unsigned int slot) {
+    struct readahead_slot *s = &engine->slots[slot];
+    if (engine->backend == READAHEAD_THREADS) {
+        struct threads *threads = engine->threads;
+        pthread_mutex_lock(&threads->lock);
+        s->state = SLOT_QUEUED;
+        unsigned int end = (threads->queue_start + threads->queue_length) % engine->slots_length;
+        threads->queue[end] = slot;
+        threads->queue_length++;
+        pthread_cond_signal(&threads->queued);
+        pthread_mutex_unlock(&threads->lock);
+    }
+#ifdef __linux__
+    else {
+        s->state = SLOT_QUEUED;
+        ring_submit(engine, slot);
+    }
+#endif
+}
+
+void readahead_submit(struct readahead *engine, unsigned int slot, int fd, void *buffer, size_t length) {
+    struct readahead_slot *s = &engine->slots[slot];
+    s->fd = fd;
+    s->reader = NULL;
+    s->buffer = buffer;
+    s->length = length;
+    submit(engine, slot);
+}
+
+void readahead_submit_reader(struct readahead *engine, unsigned int slot,
+                             readahead_reader reader, void *state, void *buffer, size_t length) {
+    struct readahead_slot *s = &engine->slots[slot];
+    s->fd = -1;
+    s->reader = reader;
+    s->reader_state = state;
+    s->buffer = buffer;
+    s->length = length;
+    if (engine->backend != READAHEAD_THREADS) {
+        // the kernel can't run it, so do it now
+        s->result = reader(state, buffer, length);
+        s->error = s->result < 0 ? errno : 0;
+        s->state = SLOT_DONE;
+        return;
+    }
+    submit(engine, slot);
+}
+
+bool readahead_is_pending(const struct readahead *engine, unsigned int slot) {
+    // only the thread using the engine changes a slot from or to idle
+    return engine->slots[slot].state != SLOT_IDLE;
+}
+
+ssize_t readahead_wait(struct readahead *engine, unsigned int slot) {
+    struct readahead_slot *s = &engine->slots[slot];
+    if (engine->backend == READAHEAD_THREADS) {
+        struct threads *threads = engine->threads;
+        pthread_mutex_lock(&threads->lock);
+        while (s->state != SLOT_DONE) {
+            pthread_cond_wait(&threads->done, &threads->lock);
+        }
+        pthread_mutex_unlock(&threads->lock);
+    }
+#ifdef __linux__
+    else {
+        ring_reap(engine);
+        while (s->state != SLOT_DONE) {
+            if (ring_enter(&engine->ring, 0, 1) < 0) {
+                s->result = -1;
+                s->error = errno;
+                break;
+            }
+            ring_reap(engine);
+        }
+    }
+#endif
+    s->state = SLOT_IDLE;
+    if (s->result < 0) {
+        errno = s->error;
+    } else if (s->reader == NULL) {
+        STAT_ADD(STAT_READS, 1);
+        STAT_ADD(STAT_READ_BYTES, s->result);
+    }
+    return s->result;
+}
@@ -0,0 +1,54 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+//! Reads that happen in the background while the caller does other work,
+//! using io_uring if available and otherwise a few threads.
+
+#ifndef _READAHEAD_H_
+#define _READAHEAD_H_
+#include <stddef.h> // size_t
+#include <stdbool.h>
+#include <sys/types.h> // ssize_t
+
+enum readahead_backend {
+    READAHEAD_ANY, //< io_uring if it works, otherwise threads
+    READAHEAD_IO_URING,
+    READAHEAD_THREADS
+};
+
+struct readahead;
+
+/// Each read is identified by a slot number below `slots`, and a slot can only have one read at a time.
+/// Returns NULL and sets errno if the backend isn't available.
+struct readahead* readahead_create(enum readahead_backend backend, unsigned int slots);
+void readahead_destroy(struct readahead *engine);
+enum readahead_backend readahead_get_backend(const struct readahead *engine);
+
+/// Starts reading from the current position of fd. The buffer must stay untouched until waited for.
+void readahead_submit(struct readahead *engine, unsigned int slot, int fd, void *buffer, size_t length);
+/// A function that works like read(), such as for decompressing.
+typedef ssize_t (*readahead_reader)(void *state, void *buffer, size_t length);
+/// Runs the reader in the background. The state and buffer must stay untouched until waited for.
+/// io_uring can only do plain reads, so with that backend the reader is called before returning.
+void readahead_submit_reader(struct readahead *engine, unsigned int slot,
+                             readahead_reader reader, void *state, void *buffer, size_t length);
+bool readahead_is_pending(const struct readahead *engine, unsigned int slot);
+/// Waits for the read in the slot to complete,
+/// and returns what read() would have: the number of bytes read or -1 with errno set.
+ssize_t readahead_wait(struct readahead *engine, unsigned int slot);
+
+#endif // !defined(_READAHEAD_H_)
@@ -0,0 +1,134 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // pthreads when compiling as c11
+#include "spsc.h"
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/// how many times to check again before sleeping, as the other side is usually busy for only a moment
+static const int SPINS_BEFORE_SLEEPING = 100;
+
+struct spsc_ring {
+    /// incremented by the consumer after reading an item.
+    /// head and tail are never wrapped, only the index into items is.
+    _Alignas(64) atomic_uint head;
+    /// incremented by the producer after writing an item.
+    _Alignas(64) atomic_uint tail;
+    /// set by the side that is about to sleep, so that the other side knows to signal changed.
+    /// only one side can wait at a time since the ring can't be both empty and full.
+    _Alignas(64) atomic_bool waiting;
+    pthread_mutex_t lock; //< only used for sleeping
+    pthread_cond_t changed;
+    unsigned int mask; //< capacity - 1
+    void *items[];
+};
+
+struct spsc_ring* spsc_create(unsigned int capacity) {
+    unsigned int rounded = 1;
+    while (rounded < capacity) {
+        rounded *= 2;
+    }
+    struct spsc_ring *ring = aligned_alloc(64, (sizeof(struct spsc_ring) + rounded * sizeof(void*) + 63) / 64 * 64);
+    if (ring == NULL) {
+        return NULL;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->waiting, false);
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->changed, NULL);
+    ring->mask = rounded - 1;
+    return ring;
+}
+
+void spsc_destroy(struct spsc_ring *ring) {
+    pthread_cond_destroy(&ring->changed);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring);
+}
+
+/// wake the other side if it's sleeping, after changing head or tail.
+static void wake(struct spsc_ring *ring) {
+    // orders the change before reading waiting, pairing with the fence in sleep_until()
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->waiting, memory_order_relaxed)) {
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_broadcast(&ring->changed);
+        pthread_mutex_unlock(&ring->lock);
+    }
+}
+
+bool spsc_try_push(struct spsc_ring *ring, void *item) {
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head > ring->mask) {
+        return false;
+    }
+    ring->items[tail & ring->mask] = item;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    wake(ring);
+    return true;
+}
+
+void* spsc_try_pop(struct spsc_ring *ring) {
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == tail) {
+        return NULL;
+    }
+    void *item = ring->items[head & ring->mask];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    wake(ring);
+    return item;
+}
+
+/// sleep until the ring is no longer full (for the producer) or empty (for the consumer).
+static void sleep_until(struct spsc_ring *ring, bool not_full) {
+    pthread_mutex_lock(&ring->lock);
+    atomic_store_explicit(&ring->waiting, true, memory_order_relaxed);
+    // the other side either sees waiting, or this sees what it changed
+    atomic_thread_fence(memory_order_seq_cst);
+    while (true) {
+        unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (not_full ? tail - head <= ring->mask : head != tail) {
+            break;
+        }
+        pthread_cond_wait(&ring->changed, &ring->lock);
+    }
+    atomic_store_explicit(&ring->waiting, false, memory_order_relaxed);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+void spsc_push(struct spsc_ring *ring, void *item) {
+    for (int spins = 0; !spsc_try_push(ring, item); spins++) {
+        if (spins >= SPINS_BEFORE_SLEEPING) {
+            sleep_until(ring, true);
+        }
+    }
+}
+
+void* spsc_pop(struct spsc_ring *ring) {
+    void *item;
+    for (int spins = 0; (item = spsc_try_pop(ring)) == NULL; spins++) {
+        if (spins >= SPINS_BEFORE_SLEEPING) {
+            sleep_until(ring, false);
+        }
+    }
+    return item;
+}
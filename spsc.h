@@ -0,0 +1,40 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! A bounded single-producer single-consumer queue of pointers,
+//! which is lock-free except when one side has to wait for the other.
+
+#ifndef _SPSC_H_
+#define _SPSC_H_
+#include <stdbool.h>
+
+struct spsc_ring;
+
+/// capacity is rounded up to a power of two.
+/// returns NULL if out of memory.
+struct spsc_ring* spsc_create(unsigned int capacity);
+void spsc_destroy(struct spsc_ring *ring);
+
+/// returns false if the ring is full. Must only be called by the producer thread.
+bool spsc_try_push(struct spsc_ring *ring, void *item);
+/// returns NULL if the ring is empty. Must only be called by the consumer thread.
+void* spsc_try_pop(struct spsc_ring *ring);
+/// like spsc_try_push(), but sleeps while the ring is full.
+void spsc_push(struct spsc_ring *ring, void *item);
+/// like spsc_try_pop(), but sleeps while the ring is empty. item must not be NULL.
+void* spsc_pop(struct spsc_ring *ring);
+
+#endif // !defined(_SPSC_H_)
@@ -0,0 +1,116 @@
+/* logmerge - A program to merge files like tail -f
+ * Copyright (C) 2021 Torbjørn Birch Moltu
+ *
+ * licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Bindings to libtailmerge, the merging of the C version as a shared library,
+//! for merging inside a Rust program instead of starting tailmerge and copying its output from a pipe.
+//! Enabled by the `libtailmerge` feature, which links with the libtailmerge.so built by `make libtailmerge.so`.
+
+#[cfg(feature="libtailmerge")]
+pub use self::libtailmerge::{merge, Error};
+
+#[cfg(feature="libtailmerge")]
+mod libtailmerge {
+    use std::ffi::{CStr, CString, OsStr};
+    use std::fmt::{self, Display, Formatter};
+    use std::io::IoSlice;
+    use std::os::raw::{c_char, c_int, c_void};
+    use std::os::unix::ffi::OsStrExt;
+    use std::ptr::addr_of_mut;
+
+    // IoSlice has the same layout as struct iovec on unix
+    type Output = extern "C" fn(opaque: *mut c_void,  slices: *const IoSlice,  length: c_int);
+    type ErrorCallback = extern "C" fn(opaque: *mut c_void,  message: *const c_char);
+
+    #[link(name = "tailmerge")]
+    extern "C" {
+        fn tailmerge_run(argc: c_int,  argv: *mut *mut c_char,
+                         output: Option<Output>,  error: Option<ErrorCallback>,  opaque: *mut c_void
+        ) -> c_int;
+    }
+
+    /// Why a merge failed.
+    #[derive(Clone, Debug, PartialEq, Eq)]
+    pub struct Error {
+        /// The exit code tailmerge would have exited with, from sysexits.h
+        pub code: i32,
+        /// What tailmerge would have printed to stderr
+        pub message: String,
+    }
+
+    impl Display for Error {
+        fn fmt(&self,  fmtr: &mut Formatter) -> fmt::Result {
+            fmtr.write_str(&self.message)
+        }
+    }
+
+    impl std::error::Error for Error {}
+
+    /// What the callbacks get as opaque.
+    /// The error callback can be called from another thread while output is running,
+    /// so they only borrow their own field.
+    struct Callbacks<F> {
+        output: F,
+        message: Option<String>,
+    }
+
+    extern "C" fn call_output<F: FnMut(&[IoSlice])>(opaque: *mut c_void,  slices: *const IoSlice,  length: c_int) {
+        let output = unsafe { &mut *addr_of_mut!((*(opaque as *mut Callbacks<F>)).output) };
+        let slices = unsafe { std::slice::from_raw_parts(slices, length as usize) };
+        output(slices);
+    }
+
+    extern "C" fn save_error<F>(opaque: *mut c_void,  message: *const c_char) {
+        let saved = unsafe { &mut *addr_of_mut!((*(opaque as *mut Callbacks<F>)).message) };
+        let message = unsafe { CStr::from_ptr(message) };
+        *saved = Some(message.to_string_lossy().into_owned());
+    }
+
+    /// Merges like running tailmerge with `args` (without the program name), and passes each batch of output
+    /// to `output` instead of writing it to stdout.
+    /// The slices point into the files or the buffers they're read into, and can't be kept after it returns.
+    ///
+    /// Returns the exit code tailmerge would have exited with, which is 0 unless it fails,
+    /// and everything the merge used has been released when it returns.
+    /// `--help` prints to stdout and returns `Ok(0)`. A panic in `output` aborts.
+    /// `output` is only called on the current thread, also with `--jobs`, so it doesn't need to be `Send`.
+    /// Several merges can run at the same time.
+    pub fn merge<A: AsRef<OsStr>,  F: FnMut(&[IoSlice])>(args: &[A],  output: F) -> Result<i32, Error> {
+        let mut owned = Vec::with_capacity(args.len() + 1);
+        owned.push(CString::new("tailmerge").unwrap());
+        for arg in args {
+            // arguments can't contain NUL when coming from a command line either
+            owned.push(CString::new(arg.as_ref().as_bytes()).expect("argument contains NUL"));
+        }
+        let mut argv = owned.iter().map(|arg| arg.as_ptr() as *mut c_char ).collect::<Vec<_>>();
+        argv.push(std::ptr::null_mut());
+        let mut callbacks = Callbacks { output,  message: None };
+        let code = unsafe {
+            tailmerge_run(
+                owned.len() as c_int,
+                argv.as_mut_ptr(),
+                Some(call_output::<F>),
+                Some(save_error::<F>),
+                &mut callbacks as *mut Callbacks<F> as *mut c_void,
+            )
+        };
+        match (code,  callbacks.message) {
+            (0, _) => Ok(0),
+            (code, Some(message)) => Err(Error { code,  message }),
+            // only usage errors that getopt_long() printed don't have a message, which libtailmerge avoids
+            (code, None) => Err(Error { code,  message: format!("merging failed with exit code {}", code) }),
+        }
+    }
+}
@@ -0,0 +1,177 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // fileno() and fsync() when compiling as c11
+#include "state.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h> // fsync(), unlink()
+
+static const char *VERSION_LINE = "tailmerge state 1\n";
+
+/// read length bytes and then a newline into a new NUL-terminated allocation, or return NULL.
+static char* read_field(FILE *file, size_t length) {
+    char *field = malloc(length + 1);
+    if (field == NULL) {
+        return NULL;
+    } else if (fread(field, 1, length, file) != length || fgetc(file) != '\n') {
+        free(field);
+        errno = ferror(file) ? errno : EINVAL;
+        return NULL;
+    }
+    field[length] = '\0';
+    return field;
+}
+
+int state_load(const char *path, struct saved_state *state) {
+    state->files = NULL;
+    state->length = 0;
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    char version[32];
+    if (fgets(version, sizeof(version), file) == NULL || strcmp(version, VERSION_LINE) != 0) {
+        fclose(file);
+        errno = EINVAL;
+        return -1;
+    }
+    int capacity = 0;
+    while (true) {
+        unsigned long long device, inode;
+        long long offset;
+        size_t path_length, key_length;
+        int fields = fscanf(file, "%llu %llu %lld %zu %zu", &device, &inode, &offset, &path_length, &key_length);
+        if (fields == EOF && !ferror(file)) {
+            break;
+        } else if (fields != 5 || fgetc(file) != '\n' || offset < 0) {
+            fclose(file);
+            state_destroy(state);
+            errno = EINVAL;
+            return -1;
+        }
+        if (state->length == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            struct file_state *grown = realloc(state->files, capacity * sizeof(struct file_state));
+            if (grown == NULL) {
+                fclose(file);
+                state_destroy(state);
+                return -1;
+            }
+            state->files = grown;
+        }
+        struct file_state *entry = &state->files[state->length];
+        entry->device = (dev_t)device;
+        entry->inode = (ino_t)inode;
+        entry->offset = (off_t)offset;
+        entry->key_length = key_length;
+        entry->path = read_field(file, path_length);
+        entry->key = entry->path != NULL ? read_field(file, key_length) : NULL;
+        if (entry->key == NULL) {
+            int error = errno;
+            free(entry->path);
+            fclose(file);
+            state_destroy(state);
+            errno = error;
+            return -1;
+        }
+        state->length++;
+    }
+    fclose(file);
+    return 0;
+}
+
+const struct file_state* state_find(const struct saved_state *state, const char *path) {
+    for (int i=0; i<state->length; i++) {
+        if (state->files[i].path != NULL && strcmp(state->files[i].path, path) == 0) {
+            return &state->files[i];
+        }
+    }
+    return NULL;
+}
+
+void state_forget(struct saved_state *state, const char *path) {
+    for (int i=0; i<state->length; i++) {
+        if (state->files[i].path != NULL && strcmp(state->files[i].path, path) == 0) {
+            file_state_destroy(&state->files[i]);
+        }
+    }
+}
+
+void file_state_destroy(struct file_state *file) {
+    free(file->path);
+    file->path = NULL;
+    free(file->key);
+    file->key = NULL;
+}
+
+void state_destroy(struct saved_state *state) {
+    for (int i=0; i<state->length; i++) {
+        file_state_destroy(&state->files[i]);
+    }
+    free(state->files);
+    state->files = NULL;
+    state->length = 0;
+}
+
+static void write_file_state(FILE *file, const struct file_state *state) {
+    fprintf(file, "%llu %llu %lld %zu %zu\n",
+            (unsigned long long)state->device, (unsigned long long)state->inode,
+            (long long)state->offset, strlen(state->path), state->key_length);
+    fputs(state->path, file);
+    fputc('\n', file);
+    fwrite(state->key, 1, state->key_length, file);
+    fputc('\n', file);
+}
+
+int state_save(const char *path, const struct file_state *files, int length, const struct saved_state *kept) {
+    char *temporary = malloc(strlen(path) + sizeof(".tmp"));
+    if (temporary == NULL) {
+        return -1;
+    }
+    sprintf(temporary, "%s.tmp", path);
+    FILE *file = fopen(temporary, "w");
+    if (file == NULL) {
+        free(temporary);
+        return -1;
+    }
+    fputs(VERSION_LINE, file);
+    for (int i=0; i<length; i++) {
+        if (files[i].path != NULL) {
+            write_file_state(file, &files[i]);
+        }
+    }
+    for (int i=0; i<kept->length; i++) {
+        if (kept->files[i].path != NULL) {
+            write_file_state(file, &kept->files[i]);
+        }
+    }
+    // don't replace the old state with one that might not have reached the disk
+    bool failed = fflush(file) != 0 || fsync(fileno(file)) != 0;
+    failed |= fclose(file) != 0;
+    if (failed || rename(temporary, path) != 0) {
+        int error = errno;
+        unlink(temporary);
+        free(temporary);
+        errno = error;
+        return -1;
+    }
+    free(temporary);
+    return 0;
+}
@@ -0,0 +1,55 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! --state: how far each file was merged by the previous run, so that the next one can continue from there.
+//! The file holds a version line, and then for each file a line with its device, inode, the offset after the
+//! last line merged and the lengths of the path and of the key of that line, followed by the path and the
+//! key on lines of their own. The lengths make any bytes in them unambiguous.
+
+#ifndef _STATE_H_
+#define _STATE_H_
+#include <stddef.h>
+#include <sys/types.h> // off_t, dev_t, ino_t
+
+struct file_state {
+    char *path; //< owned, as given on the command line
+    dev_t device;
+    ino_t inode;
+    off_t offset; //< after the last line that was merged
+    char *key; //< owned, the compared part of that line, for checking that it's still the same file
+    size_t key_length;
+};
+
+struct saved_state {
+    struct file_state *files; //< owned
+    int length;
+};
+
+/// reads the state written by state_save(), or an empty one if path doesn't exist.
+/// returns -1 with errno set if it can't be read, or to EINVAL if it's not a state file.
+int state_load(const char *path, struct saved_state *state);
+/// returns NULL if the file isn't in state.
+const struct file_state* state_find(const struct saved_state *state, const char *path);
+/// removes the file from state if it's there, so that state_save() doesn't keep it.
+void state_forget(struct saved_state *state, const char *path);
+void state_destroy(struct saved_state *state);
+
+/// replaces path with the files and then those in kept, skipping those with a NULL path,
+/// so that it's either the old or the new state if interrupted. returns -1 with errno set if that fails.
+int state_save(const char *path, const struct file_state *files, int length, const struct saved_state *kept);
+void file_state_destroy(struct file_state *file);
+
+#endif // !defined(_STATE_H_)
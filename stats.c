@@ -0,0 +1,160 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // sigaction() when compiling as c11
+#include "stats.h"
+#include "heap.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#ifdef TAILMERGE_STATS
+const bool STATS_AVAILABLE = true;
+
+atomic_ullong stat_counters[STAT_COUNTERS];
+static atomic_ullong *lines_per_file = NULL;
+static char *const *file_paths = NULL;
+static int files_length = 0;
+
+static const char *const COUNTER_NAMES[STAT_COUNTERS] = {
+    [STAT_READS] = "reads",
+    [STAT_READ_BYTES] = "bytes read",
+    [STAT_WRITES] = "writes",
+    [STAT_WRITTEN_BYTES] = "bytes written",
+    [STAT_COPIED_BYTES] = "bytes copied by the kernel",
+    [STAT_FLUSHES] = "flushes",
+    [STAT_FORCED_FLUSHES] = "forced flushes",
+    [STAT_TRUNCATED_LINES] = "truncated lines",
+};
+
+void stats_init(int files, char *const *paths) {
+    // the counters are never freed, as the signal handler can read them until exit
+    lines_per_file = calloc(files, sizeof(atomic_ullong));
+    if (lines_per_file != NULL) {
+        file_paths = paths;
+        files_length = files;
+    }
+}
+
+void stats_count_line(int index) {
+    if (index < files_length) {
+        atomic_fetch_add_explicit(&lines_per_file[index], 1, memory_order_relaxed);
+    }
+}
+
+/// a line of output being built without stdio, which isn't async-signal-safe
+struct report_line {
+    char bytes[512];
+    size_t length;
+};
+
+static void append(struct report_line *line, const char *text) {
+    size_t length = strlen(text);
+    if (length > sizeof(line->bytes) - line->length) {
+        length = sizeof(line->bytes) - line->length;
+    }
+    memcpy(&line->bytes[line->length], text, length);
+    line->length += length;
+}
+
+static void append_number(struct report_line *line, unsigned long long n) {
+    char digits[20];
+    int length = 0;
+    do {
+        digits[length++] = (char)('0' + n % 10);
+        n /= 10;
+    } while (n != 0);
+    while (length > 0 && line->length < sizeof(line->bytes)) {
+        line->bytes[line->length++] = digits[--length];
+    }
+}
+
+static void write_line(int fd, struct report_line *line) {
+    append(line, "\n");
+    size_t written = 0;
+    while (written < line->length) {
+        ssize_t result = write(fd, &line->bytes[written], line->length - written);
+        if (result <= 0) {
+            break;
+        }
+        written += result;
+    }
+    line->length = 0;
+}
+
+void stats_print(int fd) {
+    struct report_line line = {.length = 0};
+    append(&line, "comparisons: ");
+    append_number(&line, heap_comparisons());
+    write_line(fd, &line);
+    unsigned long long levels;
+    unsigned long long sifts = heap_sifts(&levels);
+    append(&line, "heap sifts: ");
+    append_number(&line, sifts);
+    append(&line, ", average depth ");
+    unsigned long long hundredths = sifts == 0 ? 0 : levels * 100 / sifts;
+    append_number(&line, hundredths / 100);
+    append(&line, hundredths % 100 < 10 ? ".0" : ".");
+    append_number(&line, hundredths % 100);
+    write_line(fd, &line);
+    for (int c=0; c<STAT_COUNTERS; c++) {
+        append(&line, COUNTER_NAMES[c]);
+        append(&line, ": ");
+        append_number(&line, atomic_load(&stat_counters[c]));
+        write_line(fd, &line);
+    }
+    for (int i=0; i<files_length; i++) {
+        append(&line, "lines from ");
+        append(&line, file_paths[i]);
+        append(&line, ": ");
+        append_number(&line, atomic_load(&lines_per_file[i]));
+        write_line(fd, &line);
+    }
+}
+
+static void print_to_stderr(int signal) {
+    (void)signal;
+    int saved = errno;
+    stats_print(STDERR_FILENO);
+    errno = saved;
+}
+
+void stats_print_on_signal(int signal) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = print_to_stderr;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(signal, &action, NULL);
+}
+#else
+const bool STATS_AVAILABLE = false;
+
+void stats_init(int files, char *const *paths) {
+    (void)files;
+    (void)paths;
+}
+
+void stats_print(int fd) {
+    (void)fd;
+}
+
+void stats_print_on_signal(int signal) {
+    (void)signal;
+}
+#endif
@@ -0,0 +1,58 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//! Counters of what a merge spends its time on, for --stats.
+//! They are only compiled in with -DTAILMERGE_STATS (`make tailmerge_stats`),
+//! so that the default build doesn't pay for updating them.
+
+#ifndef _STATS_H_
+#define _STATS_H_
+#include <stdbool.h>
+
+enum stat_counter {
+    STAT_READS, //< read() calls and completed reads ahead, of files or compressed input
+    STAT_READ_BYTES,
+    STAT_WRITES, //< write() and writev() calls
+    STAT_WRITTEN_BYTES,
+    STAT_COPIED_BYTES, //< copied by copy_file_range() or sendfile()
+    STAT_FLUSHES,
+    STAT_FORCED_FLUSHES, //< flushes before --batch-size bytes or as many slices as writev() takes were collected
+    STAT_TRUNCATED_LINES, //< times a line continued past the end of a buffer
+    STAT_COUNTERS
+};
+
+#ifdef TAILMERGE_STATS
+#include <stdatomic.h>
+extern atomic_ullong stat_counters[STAT_COUNTERS];
+#define STAT_ADD(counter, n) atomic_fetch_add_explicit(&stat_counters[counter], (n), memory_order_relaxed)
+/// count a line written from the file at index.
+void stats_count_line(int index);
+#else
+#define STAT_ADD(counter, n) ((void)0)
+#define stats_count_line(index) ((void)0)
+#endif
+
+/// true if the counters are compiled in
+extern const bool STATS_AVAILABLE;
+
+/// start counting lines per file. paths are borrowed for the rest of the program.
+void stats_init(int files, char *const *paths);
+/// write the counters to fd, using only functions that can be called from a signal handler.
+void stats_print(int fd);
+/// print the counters to stderr when the signal is received.
+void stats_print_on_signal(int signal);
+
+#endif // !defined(_STATS_H_)
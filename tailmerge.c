@@ -14,53 +14,315 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE // copy_file_range(), madvise()
 #include "heap.h"
+#include "timestamp.h"
+#include "readahead.h"
+#include "newlines.h"
+#include "follow.h"
+#include "decompress.h"
+#include "spsc.h"
+#include "bisect.h"
+#include "key.h"
+#include "arena.h"
+#include "stats.h"
+#include "state.h"
+#include "index.h"
+#include "libtailmerge.h"
 
 #include <stdio.h> //
 #include <errno.h> // errno
 #include <string.h> // strerror()
 #include <stdarg.h>
 #include <stdbool.h>
-#include <stdlib.h> // memcmp(), memcpy(), malloc(), realloc(), free()
+#include <stdlib.h> // memcmp(), memcpy(), malloc(), realloc(), free(), strtoull()
+#include <limits.h> // IOV_MAX, PATH_MAX
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h> // close()
 #include <sys/uio.h> // struct iovec, writev()
 #include <sysexits.h> // EX_OK, EX_USAGE, EX_NOINPUT, EX_UNAVAILABLE, EX_IOERR
+#include <getopt.h> // getopt_long()
+#include <sys/sendfile.h> // sendfile()
+#include <sys/mman.h> // mmap(), munmap(), madvise()
+#include <time.h> // clock_gettime()
+#include <sys/time.h> // gettimeofday()
+#include <sys/resource.h> // getrlimit(), setrlimit()
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h> // SIGUSR1
+#include <setjmp.h> // setjmp(), longjmp()
 
 const char *HELP_MESSAGE = "\
-Usage: tailmerge file1 [file2]...\n\
+Usage: tailmerge [options] file1 [file2]...\n\
 \n\
 \"Sorts\" the files but prints the file name above each group of lines from a file, like `tail -f`.\n\
 Files are merged by sorting the next unprinted line from each file,\n\
 without reordering lines from the same file or keeping everything in RAM.\n\
 (Memory usage is linear with the number of files, not with the file sizes.)\n\
+Regular files compressed with gzip, zstd or lz4 are decompressed, in the background if reading ahead.\n\
+\n\
+Options:\n\
+  --timestamp=FORMAT  compare the timestamp at the start of lines (or of the key) instead of the line.\n\
+                      FORMAT is iso8601, syslog (Jun  1 10:00:00), epoch or epoch-ms.\n\
+                      Lines without a timestamp are kept together with the previous line.\n\
+  -k, --key=F1[,F2]   compare only fields F1 to F2 (or the end of the line), counted from 1.\n\
+                      Without -t, fields start at blanks following a non-blank, like with sort.\n\
+  -t, --field-separator=SEP  separate fields with the character SEP instead.\n\
+  --key-bytes=B1-B2   compare only bytes B1 to B2 of lines, counted from 1. Either can be left out.\n\
+  --key-regex=REGEX   compare only the first subexpression of an extended regular expression,\n\
+                      or what it matches if it has none.\n\
+                      Lines without the key are compared as if it was empty.\n\
+  -n, --numeric-sort  compare the number at the start of the key, like sort -n.\n\
+  -g, --general-numeric-sort  compare floating-point numbers such as 1e3, like sort -g.\n\
+  --human-numeric-sort  compare sizes such as 2K and 1.5G by suffix and then number, like sort -h.\n\
+  -V, --version-sort  compare versions like sort -V, so that 1.9 is before 1.10.\n\
+  -u, --unique[=N]    drop lines that are the same as the last line written, or as one of the last N.\n\
+                      Lines that are too long to fit in a buffer are never dropped.\n\
+  --read-ahead=WHAT   how to read pipes and other files that can't be mapped in the background:\n\
+                      auto (the default), io_uring, threads or off.\n\
+  --batch-size=BYTES  how much output to collect before writing it, 128K by default.\n\
+                      The suffixes K, M and G are supported.\n\
+  -f, --follow        keep waiting for regular files to grow, and switch to the new file\n\
+                      if one is moved or deleted and another is created with the same name.\n\
+                      Pipes are read until closed. Files are not mapped or read ahead.\n\
+  --latency=MS        in follow mode, how long to hold back a line after reading it,\n\
+                      in case files that have no new lines get an earlier one. 100 by default.\n\
+  --since=KEY         skip lines before KEY, which is compared with the start of each line,\n\
+                      or in timestamp mode is a timestamp in the format or a duration before now\n\
+                      such as 90s, 30m, 2h or 1d. Regular files are binary searched for it,\n\
+                      so they must be sorted.\n\
+  --until=KEY         stop reading a file after its first line that is sorted after KEY,\n\
+                      which is interpreted like for --since.\n\
+  -j, --jobs=N        split the files into up to N groups that are merged on separate threads,\n\
+                      and then merge the output of those. Can't be combined with --follow.\n\
+  --split=HOW         how --jobs divides the work: files (the default) merges groups of files,\n\
+                      while ranges merges all files on each thread but only lines with keys in\n\
+                      a range, which requires that files are sorted and are regular files.\n\
+";
+/// the rest of the help, as compilers only have to support string literals up to 4095 bytes
+const char *HELP_RESOURCES = "\
+  --max-open=N        keep at most N files open, by closing and unmapping regular files that aren't\n\
+                      compressed or followed until their next line is sorted first. By default\n\
+                      this is as many as the limit on file descriptors allows.\n\
+  --memory=BYTES      divide BYTES between the buffers of the files that are open, and how much of\n\
+                      each regular file to map at a time. The suffixes K, M and G are supported.\n\
+  --buffer-size=BYTES  how much to read at a time from files that aren't mapped, 64K by default.\n\
+                      Buffers of files that often fill them grow, as do those with longer lines,\n\
+                      up to 4M and within --memory (or 64M in total beyond BYTES without it).\n\
+  --format=FORMAT     how to write lines: headers (the default) writes the file name above each\n\
+                      group of lines from a file, plain writes only the lines, tagged writes the\n\
+                      index of the file (counted from 0) and a tab before each line, ndjson writes\n\
+                      {\"source\":INDEX,\"line\":\"...\"} objects, and binary writes frames of\n\
+                      the length of the line and the index as 32-bit little-endian numbers\n\
+                      followed by the line without its newline.\n\
+  --state=FILE        continue regular files from where the last run with the same FILE stopped,\n\
+                      if they're the same files, and record how far they're merged in FILE.\n\
+                      A last line without a newline is left for the next run.\n\
+  --build-index[=N]   write a sidecar FILE.tmidx for each file with the start of every Nth line\n\
+                      (1024 by default) and where it is, and exit. Later runs use it for --since,\n\
+                      --until and --split=ranges instead of searching the file. Compressed files\n\
+                      can only be started at a gzip member or zstd or lz4 frame.\n\
+  --stats             print how many comparisons, reads, writes and lines from each file there were\n\
+                      to stderr at exit and when receiving SIGUSR1. Only in builds with the counters\n\
+                      (make tailmerge_stats).\n\
+  -h, --help          print this message and exit\n\
 ";
 const char *MARKER = "\n>>> ";
+/// default for --batch-size
+const size_t DEFAULT_BATCH_BYTES = 128 << 10;
+/// default for --latency
+const int DEFAULT_LATENCY_MS = 100;
+/// use a loser tree instead of a binary heap when merging at least this many files
+const int LOSER_TREE_MIN_SOURCES = 8;
+/// --unique compares lines with each of the ones in the window, so it must be small
+const int MAX_UNIQUE_WINDOW = 1024;
+/// default for --buffer-size
+const int DEFAULT_BUFFER_SIZE = 0xffff;
+/// default for --build-index
+const unsigned long DEFAULT_INDEX_EVERY = 1024;
+/// space left before what is read ahead, for the unfinished line in the current buffer.
+/// longer unfinished lines are only compared by the part before it.
+const int READ_AHEAD_HEADROOM = 4096;
+/// the smallest --buffer-size, and what --memory can reduce it to, which must fit more than
+/// what is read ahead behind
+const int MIN_BUFFER_SIZE = 2 * READ_AHEAD_HEADROOM;
+/// the largest buffers grow to, which is also how much of long lines is compared
+const int MAX_BUFFER_SIZE = 4 << 20;
+/// without --memory, how much buffers can grow beyond --buffer-size in total
+const size_t DEFAULT_GROWTH_BUDGET = 64 << 20;
+/// --jobs: don't make groups smaller than this, as merging one file on a separate thread only adds work
+const int MIN_GROUP_SOURCES = 2;
+
+/// libtailmerge: what the threads of a merge share about it failing
+struct failure {
+    atomic_int status; //< of the first failure, or -1 while none of the threads have failed
+    tailmerge_error error; //< receives the message of the first failure, or NULL to print it to stderr
+    void *opaque;
+};
+
+/// how many resources a thread can have registered to release if it fails
+#define MAX_CLEANUPS 32
+
+/// libtailmerge: where a thread of a merge continues if it fails, and what it must release first.
+/// the program exits instead, which releases everything.
+struct catcher {
+    jmp_buf jump;
+    struct failure *failure; //< shared with the other threads of the merge
+    struct cleanup {
+        void (*release)(void *resource);
+        void *resource;
+    } cleanups[MAX_CLEANUPS]; //< in the order they were registered
+    int cleanups_length;
+};
+
+/// NULL unless this is one of the threads of a merge started with tailmerge_run()
+_Thread_local struct catcher *catcher = NULL;
+
+/// libtailmerge: make this thread continue from where catching is set with setjmp() if it fails.
+/// returns false if failure is NULL, as the program exits instead.
+bool catch_failures(struct catcher *catching, struct failure *failure) {
+    if (failure == NULL) {
+        return false;
+    }
+    catching->failure = failure;
+    catching->cleanups_length = 0;
+    catcher = catching;
+    return true;
+}
+
+/// libtailmerge: release resource if this thread fails before forget_on_failure() is called with it.
+void on_failure(void (*release)(void *resource), void *resource) {
+    if (catcher == NULL) {
+        return;
+    }
+    if (catcher->cleanups_length == MAX_CLEANUPS) {
+        // every function forgets what it registered before returning, so this is a bug
+        abort();
+    }
+    catcher->cleanups[catcher->cleanups_length].release = release;
+    catcher->cleanups[catcher->cleanups_length].resource = resource;
+    catcher->cleanups_length++;
+}
+
+void forget_on_failure(const void *resource) {
+    if (catcher == NULL) {
+        return;
+    }
+    for (int i=catcher->cleanups_length-1; i>=0; i--) {
+        if (catcher->cleanups[i].resource == resource) {
+            memmove(&catcher->cleanups[i], &catcher->cleanups[i+1],
+                    (catcher->cleanups_length - i - 1) * sizeof(struct cleanup));
+            catcher->cleanups_length--;
+            return;
+        }
+    }
+}
+
+/// libtailmerge: whether another thread of the merge has failed, so that this one should stop too.
+bool merge_has_failed(void) {
+    return catcher != NULL && atomic_load(&catcher->failure->status) != -1;
+}
+
+/// print the message followed by a newline (unless it ends with one),
+/// or in libtailmerge pass it to the error callback if this is the first failure of the merge.
+void report_failure(int status, const char *format, va_list args) {
+    if (catcher != NULL) {
+        int none = -1;
+        if (!atomic_compare_exchange_strong(&catcher->failure->status, &none, status)) {
+            // stopping because of the first failure, or failing again while cleaning up after it
+            return;
+        }
+    }
+    if (format == NULL) {
+        return;
+    }
+    char *message = NULL;
+    va_list copy;
+    va_copy(copy, args);
+    int length = vasprintf(&message, format, copy);
+    va_end(copy);
+    if (length < 0) {
+        vfprintf(stderr, format, args);
+        fputc('\n', stderr);
+    } else if (catcher != NULL && catcher->failure->error != NULL) {
+        catcher->failure->error(catcher->failure->opaque, message);
+    } else {
+        fputs(message, stderr);
+        if (length == 0 || message[length-1] != '\n') {
+            fputc('\n', stderr);
+        }
+    }
+    free(message);
+}
 
-// print error messages and exit if `ret` is negative,
+/// report an error with status, unless format is NULL, and exit.
+/// in libtailmerge, release what this thread has registered with on_failure() instead,
+/// and continue from where tailmerge_run() or the merging thread started.
+_Noreturn void fail(int status, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    report_failure(status, format, args);
+    va_end(args);
+    if (catcher == NULL) {
+        exit(status);
+    }
+    // newest first, and before jumping, as they can refer to the frames that will be gone.
+    // if one of them fails, the failing call continues with the rest.
+    while (catcher->cleanups_length > 0) {
+        catcher->cleanups_length--;
+        struct cleanup *cleanup = &catcher->cleanups[catcher->cleanups_length];
+        cleanup->release(cleanup->resource);
+    }
+    longjmp(catcher->jump, 1);
+}
+
+/// libtailmerge: continue from where the thread started, after releasing its resources,
+/// if another thread of the merge has failed.
+void stop_if_failed(void) {
+    if (merge_has_failed()) {
+        fail(EX_SOFTWARE, NULL);
+    }
+}
+
+void unlock_mutex(void *mutex) {
+    pthread_mutex_unlock(mutex);
+}
+
+// fail with the error message if `ret` is negative,
 // otherwise pass it through to caller.
 int checkerr(int ret, int status, const char *desc, ...) {
     if (ret >= 0) {
         return ret;
     }
     int err = errno;
-    fprintf(stderr, "Failed to ");
+    // a buffer, as there is no other way to release an allocation if failing doesn't return
+    char description[PATH_MAX + 256];
     va_list args;
     va_start(args, desc);
-    vfprintf(stderr, desc, args);
+    vsnprintf(description, sizeof(description), desc, args);
     va_end(args);
-    fprintf(stderr, ": %s\n", strerror(err));
-    exit(status);
+    fail(status, "Failed to %s: %s", description, strerror(err));
 }
 
 void *check_malloc(size_t bytes) {
     void *allocation = malloc(bytes);
     if (allocation == NULL)
     {
-        fputs("Not enough memory.\n", stderr);
-        exit(EX_UNAVAILABLE);
+        fail(EX_UNAVAILABLE, "Not enough memory.");
+    }
+    return allocation;
+}
+
+/// allocate from the arena if there is room left, and otherwise with malloc(), or fail.
+/// buffers are laid out to not share cache sets, see arena_allocate_buffer().
+void *check_allocate(struct arena *arena, size_t bytes, bool is_buffer) {
+    void *allocation = arena == NULL ? malloc(bytes)
+        : is_buffer ? arena_allocate_buffer(arena, bytes)
+        : arena_allocate(arena, bytes);
+    if (allocation == NULL) {
+        fail(EX_UNAVAILABLE, "Not enough memory.");
     }
     return allocation;
 }
@@ -73,127 +335,475 @@ void single_free(void **allocation) {
 }
 
 
-struct source {
-    char *buffer; //< owned allocation that bytes are read into
-    int capacity; //< size of buffer
-    int length; //< how many bytes in buffer have been read
-    int start; //< offset of the next line; bytes in buffer before this have already been written
-    int end; //< offset of the following line
-    const char *path; //< borrowed name of the file, NUL-terminated
-    int fd; //< owned file descriptor
+/// --format: how lines are written
+enum output_format {
+    FORMAT_HEADERS, //< a header with the file name before each group of lines from a file
+    FORMAT_PLAIN, //< only the lines
+    FORMAT_TAGGED, //< the index of the file and a tab before each line
+    FORMAT_NDJSON, //< one JSON object per line, with the index of the file and the line as a string
+    FORMAT_BINARY //< frames with the length of the line and the index of the file before it
 };
 
-struct source source_create(const char *path, int default_buffer_size) {
-    struct source s = {
-        .buffer = check_malloc(default_buffer_size),
-        .capacity = default_buffer_size,
-        .end = s.start = s.length = 0,
-        .path = path,
-        .fd = checkerr(open(path, O_RDONLY), 2, "opening %s", path)
-    };
-    return s;
-}
+struct options {
+    bool by_timestamp;
+    enum timestamp_format timestamp_format;
+    enum heap_type order; //< how keys are compared, which depends on --timestamp and the key options
+    bool read_ahead;
+    enum readahead_backend read_ahead_backend;
+    size_t batch_bytes;
+    bool follow;
+    int latency_ms;
+    int jobs;
+    bool split_ranges;
+    bool has_since;
+    struct bisect_key since; //< compared as a prefix of lines unless in timestamp mode
+    bool has_until;
+    struct bisect_key until;
+    struct key_spec key; //< which part of lines to compare
+    int max_open; //< how many files can be open at a time, not counting what else needs file descriptors
+    size_t memory; //< how much to divide between buffers and mappings of the open files, or 0 for no limit
+    int buffer_size; //< the initial size of the buffers of files that aren't mapped
+    int unique_window; //< --unique: how many of the last lines written to compare lines with, or 0
+    enum output_format format;
+    bool stats; //< print counters at exit and on SIGUSR1
+    const char *state_path; //< --state: where to read and write how far files have been merged, or NULL
+    unsigned long index_every; //< --build-index: index every this many lines of the files and exit, or 0
+    struct failure *failure; //< libtailmerge: shared by the threads of the merge, NULL in the program
+};
 
-void source_destroy(struct source *source) {
-    single_free((void**)&source->buffer);
-    if (source->fd != -1) {
-        if (close(source->fd) != 0) {
-            fprintf(stderr, "Error closing %s: %s\n", source->path, strerror(errno));
-            // but don't exit
-        }
-        source->fd = -1;
+enum long_option_only {
+    OPTION_TIMESTAMP = 256,
+    OPTION_READ_AHEAD,
+    OPTION_BATCH_SIZE,
+    OPTION_LATENCY,
+    OPTION_SPLIT,
+    OPTION_SINCE,
+    OPTION_UNTIL,
+    OPTION_KEY_BYTES,
+    OPTION_KEY_REGEX,
+    OPTION_HUMAN_NUMERIC_SORT,
+    OPTION_MAX_OPEN,
+    OPTION_MEMORY,
+    OPTION_BUFFER_SIZE,
+    OPTION_FORMAT,
+    OPTION_STATS,
+    OPTION_STATE,
+    OPTION_BUILD_INDEX
+};
+
+/// parse a positive number of bytes with an optional K, M or G suffix, or fail.
+size_t parse_size(const char *arg, const char *option) {
+    char *suffix;
+    errno = 0;
+    unsigned long long size = strtoull(arg, &suffix, 10);
+    int shift = 0;
+    switch (*suffix) {
+        case 'K': case 'k': shift = 10; suffix++; break;
+        case 'M': case 'm': shift = 20; suffix++; break;
+        case 'G': case 'g': shift = 30; suffix++; break;
+    }
+    if (errno != 0 || suffix == arg || *suffix != '\0' || *arg == '-' || size == 0
+            || size > (SIZE_MAX >> shift)) {
+        fail(EX_USAGE, "Invalid size %s for --%s", arg, option);
     }
+    return (size_t)size << shift;
 }
 
-struct iovec source_line(const struct source *source) {
-    struct iovec slice = {
-        .iov_base = &source->buffer[source->start],
-        .iov_len = source->end - source->start
+/// parse --since or --until, which in timestamp mode can also be a number of seconds, minutes, hours or days
+/// before now, or fail.
+struct bisect_key parse_bound(const char *arg, const char *option, const struct options *options) {
+    struct bisect_key key = {
+        .line = { .iov_base = (char*)arg, .iov_len = strlen(arg) },
+        .timestamp = {.tv_sec = 0, .tv_usec = 0},
+        .is_prefix = true
     };
-    return slice;
-}
-
-/// find the next line.
-/// returns true if there is another line
-bool source_advance(struct source *source) {
-    if (source->end == source->length) {
-        source->start = source->end;
-        return false;
+    if (options->order == NUMBER_MIN) {
+        key.number = key_number(&options->key, key.line);
+        return key;
+    } else if (!options->by_timestamp) {
+        return key;
     }
-    char *next_end = memchr(
-        &source->buffer[source->end],
-        '\n',
-        source->length - source->end
-    );
-    if (next_end != NULL) {
-        source->start = source->end;
-        source->end = next_end + 1 - source->buffer;
-        return true;
-    } else {
-        return false;
+    char *unit;
+    errno = 0;
+    long long duration = strtoll(arg, &unit, 10);
+    if (errno == 0 && unit != arg && *arg != '-' && unit[0] != '\0' && unit[1] == '\0'
+            && strchr("smhd", unit[0]) != NULL) {
+        long long multiplier = unit[0] == 's' ? 1 : unit[0] == 'm' ? 60 : unit[0] == 'h' ? 60*60 : 24*60*60;
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        key.timestamp.tv_sec = now.tv_sec - duration * multiplier;
+        key.timestamp.tv_usec = now.tv_usec;
+    } else if (!timestamp_parse(options->timestamp_format, arg, strlen(arg), &key.timestamp)) {
+        fail(EX_USAGE, "Invalid timestamp or duration %s for --%s", arg, option);
     }
+    return key;
 }
 
-bool source_read(struct source *source) {
-    // move start of unfinished line to front
-    if (source->start != 0) {
-        memmove(
-            source->buffer,
-            &source->buffer[source->start],
-            source->end - source->start
-        );
-        source->end -= source->start;
-        source->start = 0;
+/// getopt_long() keeps its state in globals, so merges started at the same time take turns parsing.
+pthread_mutex_t parsing = PTHREAD_MUTEX_INITIALIZER;
+
+void release_key(void *key) {
+    key_spec_destroy(key);
+}
+
+/// parse the options, or fail. files is set to the index in argv of the first file.
+struct options parse_args(int argc, char **argv, int *files) {
+    static const struct option LONG_OPTIONS[] = {
+        {"timestamp", required_argument, NULL, OPTION_TIMESTAMP},
+        {"read-ahead", required_argument, NULL, OPTION_READ_AHEAD},
+        {"batch-size", required_argument, NULL, OPTION_BATCH_SIZE},
+        {"follow", no_argument, NULL, 'f'},
+        {"latency", required_argument, NULL, OPTION_LATENCY},
+        {"jobs", required_argument, NULL, 'j'},
+        {"split", required_argument, NULL, OPTION_SPLIT},
+        {"since", required_argument, NULL, OPTION_SINCE},
+        {"until", required_argument, NULL, OPTION_UNTIL},
+        {"key", required_argument, NULL, 'k'},
+        {"field-separator", required_argument, NULL, 't'},
+        {"key-bytes", required_argument, NULL, OPTION_KEY_BYTES},
+        {"key-regex", required_argument, NULL, OPTION_KEY_REGEX},
+        {"numeric-sort", no_argument, NULL, 'n'},
+        {"general-numeric-sort", no_argument, NULL, 'g'},
+        {"human-numeric-sort", no_argument, NULL, OPTION_HUMAN_NUMERIC_SORT},
+        {"version-sort", no_argument, NULL, 'V'},
+        {"unique", optional_argument, NULL, 'u'},
+        {"max-open", required_argument, NULL, OPTION_MAX_OPEN},
+        {"memory", required_argument, NULL, OPTION_MEMORY},
+        {"buffer-size", required_argument, NULL, OPTION_BUFFER_SIZE},
+        {"format", required_argument, NULL, OPTION_FORMAT},
+        {"stats", no_argument, NULL, OPTION_STATS},
+        {"state", required_argument, NULL, OPTION_STATE},
+        {"build-index", optional_argument, NULL, OPTION_BUILD_INDEX},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct options options = {
+        .by_timestamp = false,
+        .order = SLICE_MIN,
+        .timestamp_format = TIMESTAMP_ISO8601,
+        .read_ahead = true,
+        .read_ahead_backend = READAHEAD_ANY,
+        .batch_bytes = DEFAULT_BATCH_BYTES,
+        .follow = false,
+        .latency_ms = DEFAULT_LATENCY_MS,
+        .jobs = 1,
+        .split_ranges = false,
+        .has_since = false,
+        .has_until = false,
+        .key = {.type = KEY_LINE, .compare = COMPARE_BYTES, .separator = -1},
+        .max_open = 0,
+        .memory = 0,
+        .buffer_size = DEFAULT_BUFFER_SIZE,
+        .unique_window = 0,
+        .format = FORMAT_HEADERS,
+        .stats = false,
+        .state_path = NULL,
+        .index_every = 0,
+        .failure = NULL
+    };
+    pthread_mutex_lock(&parsing);
+    on_failure(unlock_mutex, &parsing);
+    on_failure(release_key, &options.key);
+    // from the start, as libtailmerge can parse arguments many times.
+    // libtailmerge reports errors like the others, so that they can go to the error callback.
+    optind = 0;
+    opterr = catcher == NULL;
+    // parsed after the other options, as they depend on --timestamp
+    const char *since = NULL, *until = NULL;
+    int option;
+    while ((option = getopt_long(argc, argv, "fhj:k:t:ngVu::", LONG_OPTIONS, NULL)) != -1) {
+        switch (option) {
+            case OPTION_TIMESTAMP:
+                if (!timestamp_format_from_name(optarg, &options.timestamp_format)) {
+                    fail(EX_USAGE, "Unknown timestamp format %s", optarg);
+                }
+                options.by_timestamp = true;
+                break;
+            case OPTION_READ_AHEAD:
+                options.read_ahead = strcmp(optarg, "off") != 0;
+                if (strcmp(optarg, "auto") == 0) {
+                    options.read_ahead_backend = READAHEAD_ANY;
+                } else if (strcmp(optarg, "io_uring") == 0) {
+                    options.read_ahead_backend = READAHEAD_IO_URING;
+                } else if (strcmp(optarg, "threads") == 0) {
+                    options.read_ahead_backend = READAHEAD_THREADS;
+                } else if (options.read_ahead) {
+                    fail(EX_USAGE, "Unknown read-ahead method %s", optarg);
+                }
+                break;
+            case OPTION_BATCH_SIZE:
+                options.batch_bytes = parse_size(optarg, "batch-size");
+                break;
+            case 'f':
+                options.follow = true;
+                break;
+            case OPTION_LATENCY: {
+                char *end;
+                errno = 0;
+                long latency = strtol(optarg, &end, 10);
+                if (errno != 0 || end == optarg || *end != '\0' || latency < 0 || latency > INT_MAX) {
+                    fail(EX_USAGE, "Invalid latency %s", optarg);
+                }
+                options.latency_ms = (int)latency;
+                break;
+            }
+            case OPTION_MAX_OPEN: {
+                char *end;
+                errno = 0;
+                long max_open = strtol(optarg, &end, 10);
+                if (errno != 0 || end == optarg || *end != '\0' || max_open < 1 || max_open > INT_MAX) {
+                    fail(EX_USAGE, "Invalid number of open files %s", optarg);
+                }
+                options.max_open = (int)max_open;
+                break;
+            }
+            case OPTION_MEMORY:
+                options.memory = parse_size(optarg, "memory");
+                break;
+            case OPTION_BUFFER_SIZE: {
+                size_t size = parse_size(optarg, "buffer-size");
+                if (size < (size_t)MIN_BUFFER_SIZE || size > (size_t)MAX_BUFFER_SIZE) {
+                    fail(EX_USAGE, "--buffer-size must be between %d and %d bytes", MIN_BUFFER_SIZE, MAX_BUFFER_SIZE);
+                }
+                options.buffer_size = (int)size;
+                break;
+            }
+            case OPTION_FORMAT:
+                if (strcmp(optarg, "headers") == 0) {
+                    options.format = FORMAT_HEADERS;
+                } else if (strcmp(optarg, "plain") == 0) {
+                    options.format = FORMAT_PLAIN;
+                } else if (strcmp(optarg, "tagged") == 0) {
+                    options.format = FORMAT_TAGGED;
+                } else if (strcmp(optarg, "ndjson") == 0) {
+                    options.format = FORMAT_NDJSON;
+                } else if (strcmp(optarg, "binary") == 0) {
+                    options.format = FORMAT_BINARY;
+                } else {
+                    fail(EX_USAGE, "Unknown output format %s", optarg);
+                }
+                break;
+            case OPTION_STATS:
+                if (!STATS_AVAILABLE) {
+                    fail(EX_USAGE, "--stats requires building with -DTAILMERGE_STATS, such as by make tailmerge_stats");
+                }
+                options.stats = true;
+                break;
+            case OPTION_STATE:
+                options.state_path = optarg;
+                break;
+            case OPTION_BUILD_INDEX: {
+                unsigned long every = DEFAULT_INDEX_EVERY;
+                char *end = NULL;
+                errno = 0;
+                if (optarg != NULL) {
+                    every = strtoul(optarg, &end, 10);
+                }
+                if (optarg != NULL && (errno != 0 || end == optarg || *end != '\0' || *optarg == '-' || every == 0)) {
+                    fail(EX_USAGE, "Invalid number of lines %s for --build-index", optarg);
+                }
+                options.index_every = every;
+                break;
+            }
+            case 'j': {
+                char *end;
+                errno = 0;
+                long jobs = strtol(optarg, &end, 10);
+                if (errno != 0 || end == optarg || *end != '\0' || jobs < 1 || jobs > INT_MAX) {
+                    fail(EX_USAGE, "Invalid number of jobs %s", optarg);
+                }
+                options.jobs = (int)jobs;
+                break;
+            }
+            case OPTION_SINCE:
+                since = optarg;
+                break;
+            case OPTION_UNTIL:
+                until = optarg;
+                break;
+            case OPTION_SPLIT:
+                options.split_ranges = strcmp(optarg, "ranges") == 0;
+                if (!options.split_ranges && strcmp(optarg, "files") != 0) {
+                    fail(EX_USAGE, "Unknown way to split %s", optarg);
+                }
+                break;
+            case 'k': case OPTION_KEY_BYTES: case OPTION_KEY_REGEX:
+                if (options.key.type != KEY_LINE) {
+                    fail(EX_USAGE, "Only one of -k, --key-bytes and --key-regex can be used");
+                } else if (option == 'k' && !key_parse_fields(optarg, &options.key)) {
+                    fail(EX_USAGE, "Invalid field range %s", optarg);
+                } else if (option == OPTION_KEY_BYTES && !key_parse_bytes(optarg, &options.key)) {
+                    fail(EX_USAGE, "Invalid byte range %s", optarg);
+                } else if (option == OPTION_KEY_REGEX && !key_parse_regex(optarg, &options.key)) {
+                    fail(EX_USAGE, "Invalid regular expression %s", optarg);
+                }
+                break;
+            case 'n': case 'g': case OPTION_HUMAN_NUMERIC_SORT: case 'V': {
+                enum key_compare compare = option == 'n' ? COMPARE_NUMBERS
+                    : option == 'g' ? COMPARE_GENERAL_NUMBERS
+                    : option == 'V' ? COMPARE_VERSIONS
+                    : COMPARE_HUMAN_SIZES;
+                if (options.key.compare != COMPARE_BYTES && options.key.compare != compare) {
+                    fail(EX_USAGE, "Only one of -n, -g, --human-numeric-sort and -V can be used");
+                }
+                options.key.compare = compare;
+                break;
+            }
+            case 'u': {
+                long window = 1;
+                char *end = NULL;
+                errno = 0;
+                if (optarg != NULL) {
+                    window = strtol(optarg, &end, 10);
+                }
+                if (optarg != NULL && (errno != 0 || end == optarg || *end != '\0' || window < 1
+                                       || window > MAX_UNIQUE_WINDOW)) {
+                    fail(EX_USAGE, "Invalid number of lines %s for --unique", optarg);
+                }
+                options.unique_window = (int)window;
+                break;
+            }
+            case 't':
+                if (strlen(optarg) != 1) {
+                    fail(EX_USAGE, "The field separator must be a single byte, not %s", optarg);
+                }
+                options.key.separator = (unsigned char)optarg[0];
+                break;
+            case 'h':
+                fputs(HELP_MESSAGE, stdout);
+                fputs(HELP_RESOURCES, stdout);
+                // which libtailmerge returns without merging anything
+                fail(EX_OK, NULL);
+            default:
+                if (opterr) {
+                    // getopt_long() has printed the error
+                    fail(EX_USAGE, NULL);
+                } else if (optopt > 0 && optopt < 256) {
+                    fail(EX_USAGE, "Unknown option or missing argument -%c", optopt);
+                }
+                fail(EX_USAGE, "Unknown option or missing argument %s", argv[optind-1]);
+        }
     }
-    int more = checkerr(
-        read(source->fd, &source->buffer[source->end], source->capacity - source->end),
-        EX_IOERR,
-        "reading from %s", source->path
-    );
-    source->length = source->end + more;
-    if (source->length == 0) {
-        // end of file and nothing left in buffer
-        return false;
+    if (optind == argc) {
+        fail(EX_USAGE, "%s%s", HELP_MESSAGE, HELP_RESOURCES);
     }
-    char *end = memchr(&source->buffer[source->end], '\n', more);
-    if (end == NULL) {
-        source->end = source->length;
-    } else {
-        source->end = end + 1 - source->buffer;
+    if (options.follow && options.jobs > 1) {
+        fail(EX_USAGE, "--jobs can't be combined with --follow");
     }
-    return true;
+    if (options.follow && options.state_path != NULL) {
+        // which is only written when the merge has finished
+        fail(EX_USAGE, "--state can't be combined with --follow");
+    }
+    if (options.by_timestamp && options.key.compare != COMPARE_BYTES) {
+        fail(EX_USAGE, "--timestamp can't be combined with -n, -g, --human-numeric-sort or -V");
+    }
+    options.order = options.by_timestamp ? TIME_MIN
+        : options.key.compare == COMPARE_BYTES ? SLICE_MIN
+        : options.key.compare == COMPARE_VERSIONS ? VERSION_MIN
+        : NUMBER_MIN;
+    if (since != NULL) {
+        options.has_since = true;
+        options.since = parse_bound(since, "since", &options);
+    }
+    if (until != NULL) {
+        options.has_until = true;
+        options.until = parse_bound(until, "until", &options);
+    }
+    *files = optind;
+    forget_on_failure(&options.key);
+    forget_on_failure(&parsing);
+    pthread_mutex_unlock(&parsing);
+    return options;
 }
 
 
 struct lines {
+    int fd; //< where to write, usually stdout, or -1 if given to output
+    tailmerge_output output; //< libtailmerge: receives what would be written, or NULL
+    void *output_opaque;
     struct iovec *to_write; //< owned allocation
+    const struct arena *arena; //< borrowed, which to_write might be allocated from, or NULL
     int length; //< number of unwritten slices
     int capacity; //< max number of slices
+    size_t bytes; //< total length of the unwritten slices
+    size_t max_bytes; //< write once this many bytes are collected
+    unsigned long flushes; //< how many times lines have been written, for knowing when buffers can be reused
+    char *formatted; //< owned, for what --format writes around lines, which is reused after each flush
+    size_t formatted_length;
 };
 
-struct lines lines_create(int capacity) {
+/// how much lines can have of what --format adds before it must be written,
+/// which is more than enough for a full to_write of prefixes
+const size_t FORMATTED_CAPACITY = 64 << 10;
+
+/// capacity is limited to how many slices writev() accepts.
+/// arena can be NULL.
+struct lines lines_create(int fd, int capacity, size_t max_bytes, struct arena *arena) {
+    long iov_max = sysconf(_SC_IOV_MAX);
+    if (iov_max <= 0) {
+        iov_max = IOV_MAX;
+    }
+    if (capacity > iov_max) {
+        capacity = (int)iov_max;
+    }
     struct lines lines = {
-        .to_write = check_malloc(capacity * sizeof(struct iovec)),
+        .fd = fd,
+        .output = NULL,
+        .output_opaque = NULL,
+        .to_write = check_allocate(arena, capacity * sizeof(struct iovec), false),
+        .arena = arena,
         .length = 0,
-        .capacity = capacity
+        .capacity = capacity,
+        .bytes = 0,
+        .max_bytes = max_bytes,
+        .flushes = 0,
+        .formatted = NULL,
+        .formatted_length = 0
     };
     return lines;
 }
 
 void lines_destroy(struct lines *lines) {
-    single_free((void**)&lines->to_write);
+    arena_free(lines->arena, lines->to_write);
+    lines->to_write = NULL;
+    single_free((void**)&lines->formatted);
+}
+
+void release_lines(void *lines) {
+    lines_destroy(lines);
 }
 
 void lines_flush(struct lines *lines) {
-    int completely_written = 0;
+    // libtailmerge: stop writing if another thread of the merge has failed, as the output won't be complete
+    stop_if_failed();
+    if (lines->length != 0) {
+        STAT_ADD(STAT_FLUSHES, 1);
+        STAT_ADD(STAT_WRITTEN_BYTES, lines->bytes);
+        if (lines->bytes < lines->max_bytes && lines->length < lines->capacity) {
+            STAT_ADD(STAT_FORCED_FLUSHES, 1);
+        }
+    }
+    if (lines->output != NULL && lines->length != 0) {
+        lines->output(lines->output_opaque, lines->to_write, lines->length);
+        STAT_ADD(STAT_WRITES, 1);
+    }
+    int completely_written = lines->output != NULL ? lines->length : 0;
     while (completely_written < lines->length) {
-        ssize_t written = writev(
-            STDOUT_FILENO,
-            &lines->to_write[completely_written],
-            lines->length-completely_written
-        );
-        checkerr((int)written, EX_IOERR, "writing to stdout");
-        while (written >= (ssize_t)lines->to_write[completely_written].iov_len) {
+        ssize_t written = lines->length - completely_written == 1
+            ? write(
+                lines->fd,
+                lines->to_write[completely_written].iov_base,
+                lines->to_write[completely_written].iov_len
+            )
+            : writev(
+                lines->fd,
+                &lines->to_write[completely_written],
+                lines->length-completely_written
+            );
+        checkerr((int)written, EX_IOERR, lines->fd == STDOUT_FILENO ? "writing to stdout" : "writing to a temporary file");
+        STAT_ADD(STAT_WRITES, 1);
+        while (completely_written < lines->length
+                && written >= (ssize_t)lines->to_write[completely_written].iov_len) {
             written -= lines->to_write[completely_written].iov_len;
             completely_written++;
         }
@@ -203,108 +813,2743 @@ void lines_flush(struct lines *lines) {
             lines->to_write[completely_written].iov_len -= written;
         }
     }
-    // TODO use regular write() if one?
     lines->length = 0;
+    lines->bytes = 0;
+    lines->formatted_length = 0;
+    lines->flushes++;
 }
 
+/// slices that continue where the previous one ended are merged with it,
+/// which consecutive lines from the same buffer always do.
 void lines_add(struct lines *lines, struct iovec slice) {
-    if (lines->length == lines->capacity) {
+    if (lines->length == lines->capacity || lines->bytes >= lines->max_bytes) {
         lines_flush(lines);
+    } else if (lines->length != 0) {
+        struct iovec *previous = &lines->to_write[lines->length-1];
+        if ((char*)previous->iov_base + previous->iov_len == slice.iov_base) {
+            previous->iov_len += slice.iov_len;
+            lines->bytes += slice.iov_len;
+            return;
+        }
     }
     lines->to_write[lines->length] = slice;
     lines->length++;
+    lines->bytes += slice.iov_len;
 }
 
-const struct iovec NEWLINE = { .iov_base = "\n", .iov_len = 1 };
+/// add a copy of bytes that aren't in any buffer, such as a prefix of a line.
+void lines_add_formatted(struct lines *lines, const void *bytes, size_t length) {
+    if (lines->formatted == NULL) {
+        lines->formatted = check_malloc(FORMATTED_CAPACITY);
+    }
+    // flush before copying, as lines_add() would reuse the copy if it did
+    if (lines->formatted_length + length > FORMATTED_CAPACITY
+            || lines->length == lines->capacity || lines->bytes >= lines->max_bytes) {
+        lines_flush(lines);
+    }
+    struct iovec copy = { .iov_base = lines->formatted + lines->formatted_length, .iov_len = length };
+    memcpy(copy.iov_base, bytes, length);
+    lines->formatted_length += length;
+    lines_add(lines, copy);
+}
+
+long long monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/// how much of a regular file to map at a time, unless limited by --memory
+const size_t MAP_WINDOW = sizeof(void*) >= 8 ? 1 << 30 : 1 << 24;
+/// how many buffers a file that isn't mapped can use
+#define MAX_SOURCE_BUFFERS 3
+/// how many newlines to find in one pass
+#define LINE_INDEX_LENGTH 256
 
+/// how much the buffers of all files can grow beyond their initial size, shared by the merging threads.
+struct buffer_budget {
+    atomic_size_t grown;
+    size_t limit;
+    int initial; //< --buffer-size after --memory
+};
+
+struct source {
+    char *buffer; //< the current one of buffers, or the mapped part of the file
+    int capacity; //< size of buffer
+    int length; //< how many bytes in buffer have been read
+    int start; //< offset of the next line; bytes in buffer before this have already been written
+    int end; //< offset of the following line
+    int line_ends[LINE_INDEX_LENGTH]; //< offsets of the next newlines in buffer, found in one pass
+    int line_ends_next; //< index of the first one in line_ends that end hasn't been moved past
+    int line_ends_length; //< how many of line_ends are found
+    int indexed; //< offset in buffer up to which newlines are in line_ends
+    const char *path; //< borrowed name of the file, NUL-terminated
+    char *header; //< owned MARKER, path and newline, so that it can be written as one slice
+    int header_length; //< including the leading newline
+    int fd; //< owned file descriptor
+    struct decompressor *decompressor; //< owned, NULL if the file isn't compressed
+    bool is_mapped; //< regular files are mapped instead of read into allocated buffers
+    off_t map_offset; //< position in the file where buffer starts if is_mapped
+    size_t map_window; //< how much of the file to map at a time
+    off_t limit; //< --split=ranges: where the part of the file to merge ends, or -1 for the end of the file
+    const struct index *index; //< borrowed --build-index sidecar of the file, or NULL
+    /// owned allocations that bytes are read into in turn, so that lines in one don't need to be written
+    /// before reading into the next. When reading ahead, the one after the current is being read into.
+    char *buffers[MAX_SOURCE_BUFFERS];
+    /// the value of lines.flushes before a buffer can be overwritten (or the mapping unmapped)
+    unsigned long flushes_needed[MAX_SOURCE_BUFFERS];
+    int buffers_length; //< how many of buffers are used
+    int buffer_capacities[MAX_SOURCE_BUFFERS]; //< sizes of buffers, which differ after some are resized
+    struct buffer_budget *budget; //< shared, NULL if buffers aren't resized
+    int wanted_capacity; //< what buffers are resized to when next read into
+    int full_reads; //< reads in a row that filled the buffer, which means more is probably waiting
+    int partial_reads; //< reads in a row that didn't
+    int current; //< index of buffer in buffers
+    struct readahead *readahead; //< borrowed, NULL if not reading ahead
+    int slot; //< readahead slot
+    int ahead_length; //< bytes read into the next buffer that haven't been moved to buffer yet
+    bool at_eof; //< a read has returned 0, and the file won't grow
+    bool is_regular; //< a regular file, which can grow after reaching the end
+    bool is_followed; //< don't stop when reaching the end of a regular file, and don't block on pipes
+    bool is_waiting; //< follow mode: there is no complete line until more is written to the file
+    bool maybe_replaced; //< follow mode: the file might have been replaced, and should be checked when waiting
+    bool is_idle; //< follow mode: has run out of lines and isn't in the heap, but might get more
+    bool before_since; //< --since: lines up to the first one that isn't before it haven't been skipped yet
+    long long read_at; //< follow mode: when the buffer was last read into, in milliseconds
+    struct timeval timestamp; //< of the current line, or the last line that had one
+    double number; //< of the current line, when comparing numbers
+    int key_start; //< offset of the compared part of the current line from start
+    int key_length; //< length of the compared part of the current line
+    /// --max-open: closed and unmapped until the current line is sorted first, with buffer pointing to
+    /// parked_key so that the heap can still compare it
+    bool is_parked;
+    off_t resume_offset; //< where in the file the current line starts when parked
+    char *parked_key; //< owned copy of the compared part of the current line
+    int parked_key_capacity;
+    const struct arena *arena; //< borrowed, which header and the first buffers might be allocated from
+};
 
-int main(int argc, const char **argv) {
-    if (argc < 2) {
-        fputs(HELP_MESSAGE, stderr);
-        exit(EX_USAGE);
+void source_destroy(struct source *source) {
+    if (source->is_mapped && !source->is_parked && source->buffer != NULL) {
+        munmap(source->buffer, source->capacity);
+    }
+    source->buffer = NULL;
+    if (source->readahead != NULL && readahead_is_pending(source->readahead, source->slot)) {
+        // must not free the buffer while it's being read into
+        readahead_wait(source->readahead, source->slot);
+    }
+    for (int i=0; i<MAX_SOURCE_BUFFERS; i++) {
+        arena_free(source->arena, source->buffers[i]);
+        source->buffers[i] = NULL;
+    }
+    arena_free(source->arena, source->header);
+    source->header = NULL;
+    single_free((void**)&source->parked_key);
+    if (source->decompressor != NULL) {
+        decompressor_destroy(source->decompressor);
+        source->decompressor = NULL;
+    }
+    if (source->fd != -1) {
+        if (close(source->fd) != 0) {
+            fprintf(stderr, "Error closing %s: %s\n", source->path, strerror(errno));
+            // but don't exit
+        }
+        source->fd = -1;
     }
-    int sources_length = argc - 1;
+}
 
-    struct source *sources = check_malloc(sources_length * sizeof(struct source));
+void release_source(void *source) {
+    source_destroy(source);
+}
 
-    int last = -1;
-    struct heap sorter = heap_create(SLICE_MIN, sources_length);
-    heap_set_memory(&sorter, check_malloc(heap_get_needed_memory(&sorter)));
-    for (int i=0; i<sources_length; i++) {
-        sources[i] = source_create(argv[i+1], 0xffff);
-        if (source_read(&sources[i])) {
-            heap_push_slice(&sorter, source_line(&sources[i]), i);
-        } else {
-            source_destroy(&sources[i]);
+/// in follow mode, files aren't mapped and pipes are made nonblocking.
+/// arena can be NULL, and must only be used by one thread at a time.
+struct source source_create(const char *path, int default_buffer_size, bool follow, struct arena *arena) {
+    struct source s = {
+        .buffer = NULL,
+        .capacity = 0,
+        .length = 0,
+        .start = 0,
+        .end = 0,
+        .line_ends_next = 0,
+        .line_ends_length = 0,
+        .indexed = 0,
+        .path = path,
+        .header = NULL,
+        .header_length = strlen(MARKER) + strlen(path) + 1,
+        .fd = checkerr(open(path, O_RDONLY), 2, "opening %s", path),
+        .decompressor = NULL,
+        .is_mapped = false,
+        .map_offset = 0,
+        .map_window = MAP_WINDOW,
+        .limit = -1,
+        .index = NULL,
+        .buffers = {NULL},
+        .flushes_needed = {0},
+        .buffers_length = 1,
+        .buffer_capacities = {0},
+        .budget = NULL,
+        .wanted_capacity = default_buffer_size,
+        .full_reads = 0,
+        .partial_reads = 0,
+        .current = 0,
+        .readahead = NULL,
+        .slot = -1,
+        .ahead_length = 0,
+        .at_eof = false,
+        .is_regular = false,
+        .is_followed = follow,
+        .is_waiting = false,
+        .maybe_replaced = false,
+        .is_idle = false,
+        .before_since = false,
+        .read_at = 0,
+        .timestamp = {.tv_sec = 0, .tv_usec = 0},
+        .is_parked = false,
+        .resume_offset = 0,
+        .parked_key = NULL,
+        .parked_key_capacity = 0,
+        .arena = arena
+    };
+    on_failure(release_source, &s);
+    s.header = check_allocate(arena, s.header_length + 1, false);
+    sprintf(s.header, "%s%s\n", MARKER, path);
+    struct stat info;
+    checkerr(fstat(s.fd, &info), 2, "getting type of %s", path);
+    s.is_regular = S_ISREG(info.st_mode);
+    enum compression compression = compression_detect(s.fd);
+    if (compression != COMPRESSION_NONE) {
+        s.decompressor = decompressor_create(compression, s.fd);
+        if (s.decompressor == NULL) {
+            checkerr(-1, EX_UNAVAILABLE, "decompress %s with %s", path, compression_name(compression));
+        }
+        // appending to or truncating a compressed file doesn't produce anything sensible
+        s.is_followed = false;
+    }
+    if (follow && !s.is_regular) {
+        int flags = checkerr(fcntl(s.fd, F_GETFL), 2, "getting flags of %s", path);
+        checkerr(fcntl(s.fd, F_SETFL, flags | O_NONBLOCK), 2, "making %s nonblocking", path);
+    }
+    // some special files pretend to be empty regular files, so only map files that aren't
+    if (s.is_regular && info.st_size > 0 && !follow && s.decompressor == NULL) {
+        s.is_mapped = true;
+    } else {
+        // the one for reading ahead is allocated when needed
+        s.buffers[0] = s.buffer = check_allocate(arena, default_buffer_size, true);
+        if (arena != NULL) {
+            // where there is no cost until it's used
+            s.buffers[1] = check_allocate(arena, default_buffer_size, true);
+        }
+        s.capacity = default_buffer_size;
+        s.buffers_length = 2;
+        for (int i=0; i<MAX_SOURCE_BUFFERS; i++) {
+            s.buffer_capacities[i] = default_buffer_size;
         }
     }
+    forget_on_failure(&s);
+    return s;
+}
 
-    struct lines lines = lines_create(1024);
-    struct iovec line;
-    int next = -1;
-    while ((next = heap_pop_slice_value(&sorter, &line)) != -1) {
-        if (next != last) {
-            // add header
-            struct iovec separator = { .iov_base = "\n>>> ", .iov_len = 5 };
-            if (last == -1) {
-                // first line of output, skip newline
-                separator.iov_base = (char*)separator.iov_base + 1;
-                separator.iov_len--;
-            }
-            lines_add(&lines, separator);
-            struct iovec name = {
-                .iov_base = (void*)sources[next].path,
-                .iov_len = strlen(sources[next].path)
-            };
-            lines_add(&lines, name);
-            lines_add(&lines, NEWLINE);
-            last = next;
-        }
-
-        lines_add(&lines, line);
-
-        if (source_advance(&sources[next])) {
-            line = source_line(&sources[next]);
-            // have more lines in buffer
-            heap_push_slice(&sorter, line, next);
-        } else if (((char*)line.iov_base)[line.iov_len-1] != '\n') {
-            // was truncated
-            lines_flush(&lines);
-            bool is_truncated = true;
-            while (source_read(&sources[next])) {
-                line = source_line(&sources[next]);
-                lines_add(&lines, line);
-                is_truncated = ((char*)line.iov_base)[line.iov_len-1] != '\n';
-                if ((! is_truncated) && source_advance(&sources[next])) {
-                    // that means there was a newline
-                    heap_push_slice(&sorter, line, next);
-                    break;
-                } else {
-                    lines_flush(&lines);
-                }
-            }
-            if (is_truncated) {
-                lines_add(&lines, NEWLINE);
-            }
-        } else {
-            // need to read more
-            lines_flush(&lines);
-            if (source_read(&sources[next])) {
-                line = source_line(&sources[next]);
-                heap_push_slice(&sorter, line, next);
-            }
+/// read the next buffer in the background.
+void source_set_readahead(struct source *source, struct readahead *readahead, int slot) {
+    source->readahead = readahead;
+    source->slot = slot;
+    source->buffers_length = MAX_SOURCE_BUFFERS;
+}
+
+/// write any lines that refer to a buffer, and allocate it if necessary.
+char* source_reclaim(struct source *source, int index, struct lines *lines) {
+    if (lines->flushes < source->flushes_needed[index]) {
+        lines_flush(lines);
+    }
+    if (source->buffers[index] == NULL && !source->is_mapped) {
+        source->buffers[index] = check_malloc(source->buffer_capacities[index]);
+    }
+    return source->buffers[index];
+}
+
+/// how many reads in a row must fill the buffer before it's doubled
+const int GROW_AFTER_READS = 4;
+/// how many reads in a row must not fill a grown buffer before it's halved
+const int SHRINK_AFTER_READS = 16;
+
+/// resize one of buffers, which nothing must refer to, keeping the first `keep` bytes.
+/// returns false if the budget doesn't allow it to grow, unless forced to.
+bool source_resize(struct source *source, int index, int capacity, int keep, bool force) {
+    struct buffer_budget *budget = source->budget;
+    int old = source->buffer_capacities[index];
+    // only what is beyond the initial size is counted
+    size_t before = old > budget->initial ? (size_t)(old - budget->initial) : 0;
+    size_t after = capacity > budget->initial ? (size_t)(capacity - budget->initial) : 0;
+    if (after > before) {
+        size_t grown = atomic_fetch_add(&budget->grown, after - before) + (after - before);
+        if (grown > budget->limit && !force) {
+            atomic_fetch_sub(&budget->grown, after - before);
+            return false;
+        }
+    } else {
+        atomic_fetch_sub(&budget->grown, before - after);
+    }
+    char *resized = check_malloc(capacity);
+    if (source->buffers[index] != NULL) {
+        memcpy(resized, source->buffers[index], keep);
+        arena_free(source->arena, source->buffers[index]);
+    }
+    source->buffers[index] = resized;
+    source->buffer_capacities[index] = capacity;
+    if (index == source->current) {
+        source->buffer = resized;
+        source->capacity = capacity;
+    }
+    return true;
+}
+
+/// grow the buffers of files that keep filling them, as they are probably read more slowly than they're written,
+/// and shrink them back once that stops.
+void source_count_read(struct source *source, bool filled) {
+    if (source->budget == NULL) {
+        return;
+    }
+    if (filled) {
+        source->partial_reads = 0;
+        if (++source->full_reads >= GROW_AFTER_READS && source->wanted_capacity < MAX_BUFFER_SIZE) {
+            source->wanted_capacity = source->wanted_capacity <= MAX_BUFFER_SIZE / 2
+                ? 2 * source->wanted_capacity
+                : MAX_BUFFER_SIZE;
+            source->full_reads = 0;
+        }
+    } else {
+        source->full_reads = 0;
+        if (++source->partial_reads >= SHRINK_AFTER_READS && source->wanted_capacity > source->budget->initial) {
+            source->wanted_capacity = source->wanted_capacity / 2 >= source->budget->initial
+                ? source->wanted_capacity / 2
+                : source->budget->initial;
+            source->partial_reads = 0;
         }
     }
+}
 
-    // TODO optimize last remaining file by reading into all buffers
+/// make room for an unfinished line that is longer than READ_AHEAD_HEADROOM in front of what has been read ahead,
+/// which is moved to start after `unfinished` bytes. returns false if the buffer can't grow.
+bool source_widen_ahead(struct source *source, int unfinished) {
+    int next = (source->current + 1) % source->buffers_length;
+    int read_length = source->buffer_capacities[next] - READ_AHEAD_HEADROOM;
+    if (source->budget == NULL || unfinished > MAX_BUFFER_SIZE - read_length
+            || !source_resize(source, next, unfinished + read_length,
+                              READ_AHEAD_HEADROOM + source->ahead_length, false)) {
+        return false;
+    }
+    char *ahead = source->buffers[next];
+    memmove(&ahead[unfinished], &ahead[READ_AHEAD_HEADROOM], source->ahead_length);
+    return true;
+}
 
-    // optional cleanup
-    lines_destroy(&lines);
-    free(heap_get_memory(&sorter));
-    for (int i=0; i<sources_length; i++) {
-        source_destroy(&sources[i]);
+/// make the current buffer fit more of a line that is longer than it.
+/// returns false if it can't grow.
+bool source_grow_for_line(struct source *source) {
+    if (source->budget == NULL || source->capacity >= MAX_BUFFER_SIZE) {
+        return false;
     }
-    free(sources);
+    int capacity = source->capacity <= MAX_BUFFER_SIZE / 2 ? 2 * source->capacity : MAX_BUFFER_SIZE;
+    return source_resize(source, source->current, capacity, source->length, false);
+}
 
-    return EX_OK;
+/// forget the newlines found so far, because buffer has changed from `from`.
+void source_reindex(struct source *source, int from) {
+    source->line_ends_next = source->line_ends_length = 0;
+    source->indexed = from;
+}
+
+/// set end to after the first newline after start, finding more newlines if necessary.
+/// returns false if there are none in the buffer.
+bool source_find_end(struct source *source) {
+    if (source->line_ends_next == source->line_ends_length) {
+        if (source->indexed >= source->length) {
+            return false;
+        }
+        source->line_ends_length = newlines_find(
+            source->buffer,
+            source->indexed,
+            source->length,
+            source->line_ends,
+            LINE_INDEX_LENGTH,
+            &source->indexed
+        );
+        source->line_ends_next = 0;
+        if (source->line_ends_length == 0) {
+            return false;
+        }
+    }
+    source->end = source->line_ends[source->line_ends_next] + 1;
+    source->line_ends_next++;
+    return true;
+}
+
+/// map the part of the file starting with the unfinished line, up to map_window bytes.
+/// returns false if there is nothing after it.
+bool source_map(struct source *source, struct lines *lines) {
+    off_t line_offset = source->map_offset + source->start;
+    struct stat info;
+    // check every time, in case the file has grown
+    checkerr(fstat(source->fd, &info), EX_IOERR, "getting size of %s", source->path);
+    off_t size = source->limit != -1 && source->limit < info.st_size ? source->limit : info.st_size;
+    if (line_offset >= size) {
+        return false;
+    }
+    off_t map_offset = line_offset - line_offset % sysconf(_SC_PAGESIZE);
+    size_t map_length = size - map_offset < (off_t)source->map_window
+        ? (size_t)(size - map_offset)
+        : source->map_window;
+    if (source->buffer != NULL) {
+        source_reclaim(source, 0, lines);
+        munmap(source->buffer, source->capacity);
+    }
+    void *mapping = mmap(NULL, map_length, PROT_READ, MAP_PRIVATE, source->fd, map_offset);
+    if (mapping == MAP_FAILED) {
+        checkerr(-1, EX_IOERR, "mapping %s", source->path);
+    }
+    // not important
+    madvise(mapping, map_length, MADV_SEQUENTIAL);
+    source->buffer = mapping;
+    source->capacity = source->length = map_length;
+    source->map_offset = map_offset;
+    source->start = line_offset - map_offset;
+    source_reindex(source, source->start);
+    return true;
+}
+
+struct iovec source_line(const struct source *source) {
+    struct iovec slice = {
+        .iov_base = &source->buffer[source->start],
+        .iov_len = source->end - source->start
+    };
+    return slice;
+}
+
+/// whether the current line doesn't end with a newline because it's the last line of the file,
+/// and not because it's too long for the buffer.
+bool source_line_ends_file(const struct source *source) {
+    if (source->end != source->length) {
+        return false;
+    } else if (!source->is_mapped) {
+        return source->at_eof;
+    }
+    // mappings end at map_window too
+    struct stat info;
+    off_t size = fstat(source->fd, &info) == 0 ? info.st_size : -1;
+    if (source->limit != -1 && source->limit < size) {
+        size = source->limit;
+    }
+    return source->map_offset + source->length >= size;
+}
+
+/// the part of the current line that is compared, as found by source_parse()
+struct iovec source_key(const struct source *source) {
+    struct iovec slice = {
+        .iov_base = &source->buffer[source->start + source->key_start],
+        .iov_len = source->key_length
+    };
+    return slice;
+}
+
+/// find the next line.
+/// returns true if there is another complete line in the buffer;
+/// otherwise the unfinished line starts at `start` and `source_read()` must be called.
+bool source_advance(struct source *source) {
+    source->start = source->end;
+    if (source_find_end(source)) {
+        return true;
+    } else {
+        source->end = source->start;
+        return false;
+    }
+}
+
+/// start reading into the next buffer in the background.
+void source_read_ahead(struct source *source, struct lines *lines) {
+    if (source->readahead == NULL || source->at_eof) {
+        return;
+    }
+    int next = (source->current + 1) % source->buffers_length;
+    char *ahead = source_reclaim(source, next, lines);
+    if (source->budget != NULL && source->buffer_capacities[next] != source->wanted_capacity
+            && source_resize(source, next, source->wanted_capacity, 0, false)) {
+        ahead = source->buffers[next];
+    }
+    if (source->decompressor != NULL) {
+        readahead_submit_reader(
+            source->readahead,
+            source->slot,
+            decompressor_read,
+            source->decompressor,
+            &ahead[READ_AHEAD_HEADROOM],
+            source->buffer_capacities[next] - READ_AHEAD_HEADROOM
+        );
+        return;
+    }
+    readahead_submit(
+        source->readahead,
+        source->slot,
+        source->fd,
+        &ahead[READ_AHEAD_HEADROOM],
+        source->buffer_capacities[next] - READ_AHEAD_HEADROOM
+    );
+}
+
+/// read() from the file, or decompress it.
+ssize_t source_read_bytes(struct source *source, char *into, size_t length) {
+    if (source->decompressor != NULL) {
+        return decompressor_read(source->decompressor, into, length);
+    }
+    ssize_t read_bytes = read(source->fd, into, length);
+    if (read_bytes >= 0) {
+        STAT_ADD(STAT_READS, 1);
+        STAT_ADD(STAT_READ_BYTES, read_bytes);
+    }
+    return read_bytes;
+}
+
+/// follow mode: start from the beginning if the file has been truncated.
+bool source_was_truncated(struct source *source) {
+    struct stat info;
+    checkerr(fstat(source->fd, &info), EX_IOERR, "getting size of %s", source->path);
+    off_t position = lseek(source->fd, 0, SEEK_CUR);
+    checkerr(position < 0 ? -1 : 0, EX_IOERR, "getting position in %s", source->path);
+    if (position <= info.st_size) {
+        return false;
+    }
+    checkerr(lseek(source->fd, 0, SEEK_SET) < 0 ? -1 : 0, EX_IOERR, "seeking in %s", source->path);
+    return true;
+}
+
+/// read until there is at least one line in the buffer.
+/// if the buffer fills up without a newline, or the file doesn't end with one,
+/// the line is the rest of the buffer.
+/// lines are only written if they refer to the buffer that is going to be read into.
+/// returns false at end of file when nothing is left in the buffer,
+/// or in follow mode with is_waiting set if there isn't a complete line yet.
+bool source_read(struct source *source, struct lines *lines) {
+    if (source->is_mapped) {
+        if (!source_map(source, lines)) {
+            source->end = source->start;
+            return false;
+        }
+        if (!source_find_end(source)) {
+            source->end = source->length;
+        }
+        return true;
+    }
+
+    if (source->readahead != NULL && readahead_is_pending(source->readahead, source->slot)) {
+        source->ahead_length = checkerr(
+            readahead_wait(source->readahead, source->slot),
+            EX_IOERR,
+            "reading from %s", source->path
+        );
+        source->at_eof = source->ahead_length == 0;
+        int next = (source->current + 1) % source->buffers_length;
+        source_count_read(source, source->ahead_length == source->buffer_capacities[next] - READ_AHEAD_HEADROOM);
+    }
+    int unfinished = source->length - source->start;
+    if (source->ahead_length != 0) {
+        int headroom = READ_AHEAD_HEADROOM;
+        if (unfinished > headroom && !source_widen_ahead(source, unfinished)) {
+            // return it as if it was longer than the buffer
+            source->end = source->length;
+            return true;
+        } else if (unfinished > headroom) {
+            headroom = unfinished;
+        }
+        // put the unfinished line in front of what was read ahead
+        source->current = (source->current + 1) % source->buffers_length;
+        char *ahead = source->buffers[source->current];
+        int unfinished_start = headroom - unfinished;
+        memcpy(&ahead[unfinished_start], &source->buffer[source->start], unfinished);
+        source->buffer = ahead;
+        source->capacity = source->buffer_capacities[source->current];
+        source->start = unfinished_start;
+        source->length = headroom + source->ahead_length;
+        source->ahead_length = 0;
+        source_reindex(source, headroom);
+        if (source_find_end(source)) {
+            source_read_ahead(source, lines);
+            return true;
+        }
+        // otherwise read the rest into the same buffer, which nothing refers to yet
+    } else if (source->at_eof) {
+        // the unfinished line is the last one
+        source->end = source->length;
+        return unfinished != 0;
+    }
+
+    // move start of unfinished line to front, of the next buffer if this one is still referred to
+    unfinished = source->length - source->start;
+    char *unfinished_line = &source->buffer[source->start];
+    if (lines->flushes < source->flushes_needed[source->current]) {
+        int previous_capacity = source->capacity;
+        source->current = (source->current + 1) % source->buffers_length;
+        source->buffer = source_reclaim(source, source->current, lines);
+        source->capacity = source->buffer_capacities[source->current];
+        int wanted = source->wanted_capacity > unfinished ? source->wanted_capacity : previous_capacity;
+        if (source->budget != NULL && source->capacity != wanted) {
+            // the unfinished line must fit even if over budget
+            source_resize(source, source->current, wanted, 0, unfinished >= source->capacity);
+        }
+    } else if (source->budget != NULL && source->capacity != source->wanted_capacity
+               && unfinished < source->wanted_capacity) {
+        // the line that is kept is moved to the start first
+        memmove(source->buffer, unfinished_line, unfinished);
+        source_resize(source, source->current, source->wanted_capacity, unfinished, false);
+        // which has copied it to the start of the new buffer, and freed the old one
+        unfinished_line = source->buffer;
+    }
+    memmove(source->buffer, unfinished_line, unfinished);
+    source->length = unfinished;
+    source->start = 0;
+    source_reindex(source, unfinished);
+    while (source->length < source->capacity || source_grow_for_line(source)) {
+        size_t wanted = source->capacity - source->length;
+        ssize_t more = source_read_bytes(source, &source->buffer[source->length], wanted);
+        source_count_read(source, more == (ssize_t)wanted);
+        if (more < 0 && errno == EAGAIN && source->is_followed) {
+            source->is_waiting = true;
+            break;
+        }
+        checkerr((int)more, EX_IOERR, "reading from %s", source->path);
+        if (more == 0 && source->is_followed && source->is_regular && source_was_truncated(source)) {
+            continue;
+        } else if (more == 0) {
+            // regular files that are followed might grow
+            source->is_waiting = source->is_followed && source->is_regular;
+            source->at_eof = !source->is_waiting;
+            break;
+        }
+        source->length += more;
+        if (source->is_followed) {
+            source->read_at = monotonic_ms();
+        }
+        if (source_find_end(source)) {
+            source_read_ahead(source, lines);
+            return true;
+        }
+    }
+    if (source->is_waiting) {
+        // keep the unfinished line until the rest of it is written
+        source->end = source->start;
+        return false;
+    }
+    source->end = source->length;
+    source_read_ahead(source, lines);
+    return source->length != 0;
+}
+
+/// follow mode: switch to the file now at the path if the old one has been replaced.
+/// should only be called when the old file has been read to the end.
+/// returns true if the file descriptor has changed.
+bool source_check_replaced(struct source *source) {
+    struct stat info;
+    checkerr(fstat(source->fd, &info), EX_IOERR, "getting type of %s", source->path);
+    int fd = open(source->path, O_RDONLY);
+    if (fd == -1) {
+        // not created yet
+        return false;
+    }
+    struct stat new_info;
+    checkerr(fstat(fd, &new_info), EX_IOERR, "getting type of %s", source->path);
+    if (new_info.st_dev == info.st_dev && new_info.st_ino == info.st_ino) {
+        close(fd);
+        return false;
+    }
+    close(source->fd);
+    source->fd = fd;
+    return true;
+}
+
+/// compare the current line with --since or --until.
+int source_compare_bound(const struct source *source, const struct options *options, const struct bisect_key *bound) {
+    struct bisect_key key = {.line = source_key(source), .timestamp = source->timestamp, .is_prefix = false};
+    key.number = source->number;
+    return bisect_compare(options->order, &key, bound);
+}
+
+/// find the key of the current line, and in timestamp mode parse the timestamp at its start.
+/// lines without one keep the timestamp of the previous line.
+/// returns false if the line is after --until, in which case the file should be treated as ended.
+bool source_parse(struct source *source, const struct options *options) {
+    struct iovec line = source_line(source);
+    struct iovec key = key_extract(&options->key, line);
+    source->key_start = (char*)key.iov_base - (char*)line.iov_base;
+    source->key_length = (int)key.iov_len;
+    if (options->order == TIME_MIN) {
+        timestamp_parse(options->timestamp_format, key.iov_base, key.iov_len, &source->timestamp);
+    } else if (options->order == NUMBER_MIN) {
+        source->number = key_number(&options->key, key);
+    }
+    return !options->has_until || source_compare_bound(source, options, &options->until) <= 0;
+}
+
+/// --since: move past the lines before it, which can only be done by reading them for files that
+/// aren't regular. returns false if there is no line left, or in follow mode none yet.
+bool source_skip_to_since(struct source *source, struct lines *lines, const struct options *options) {
+    bool is_truncated = false;
+    while (source->before_since) {
+        // the rest of a line that is longer than the buffer isn't compared
+        if (!is_truncated) {
+            source_parse(source, options);
+            if (source_compare_bound(source, options, &options->since) >= 0) {
+                source->before_since = false;
+                break;
+            }
+        }
+        struct iovec line = source_line(source);
+        is_truncated = ((char*)line.iov_base)[line.iov_len-1] != '\n';
+        if (!source_advance(source) && !source_read(source, lines)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// like bisect_find(), but only search the file between the indexed lines around key if it has an index.
+off_t source_find(const struct source *source, struct bisect *search, const struct bisect_key *key,
+                  bool include_equal) {
+    if (source->index == NULL) {
+        return bisect_find(search, key, include_equal);
+    }
+    const struct index *index = source->index;
+    long before;
+    long found = index_find(index, search, key, include_equal, &before);
+    off_t high = found < (long)index->header->entries_length ? (off_t)index->entries[found].offset : search->size;
+    off_t low = before >= 0 ? (off_t)index->entries[before].offset + 1 : 0;
+    high = high < search->size ? high : search->size;
+    return bisect_find_between(search, key, include_equal, low < high ? low : high, high);
+}
+
+/// --since with an index: start decompressing from the last indexed member or frame before it,
+/// and skip the lines before it as they're read.
+void source_skip_frames(struct source *source, const struct options *options) {
+    struct bisect search = bisect_create(source->fd, 0, &options->key, options->order, options->timestamp_format);
+    long before;
+    index_find(source->index, &search, &options->since, true, &before);
+    if (before >= 0) {
+        const struct index_entry *entry = &source->index->entries[before];
+        checkerr(decompressor_seek_frame(source->decompressor, entry->offset, entry->skip), EX_IOERR,
+                 "seeking in %s", source->path);
+    }
+    bisect_destroy(&search);
+}
+
+/// --since, --until: binary search regular files for the first line to merge,
+/// and for mapped files also for where to stop.
+void source_bisect(struct source *source, const struct options *options) {
+    struct stat info;
+    checkerr(fstat(source->fd, &info), EX_IOERR, "getting size of %s", source->path);
+    if (options->has_since && source->decompressor != NULL && source->index != NULL) {
+        source_skip_frames(source, options);
+    }
+    if ((!options->has_since && !options->has_until) || !source->is_regular || source->decompressor != NULL
+            || info.st_size == 0) {
+        return;
+    }
+    struct bisect search = bisect_create(source->fd, info.st_size, &options->key,
+                                         options->order, options->timestamp_format);
+    if (options->has_since) {
+        off_t start = source_find(source, &search, &options->since, true);
+        checkerr(start < 0 ? -1 : 0, EX_IOERR, "reading from %s", source->path);
+        if (source->is_mapped) {
+            source->map_offset = start;
+        } else {
+            checkerr(lseek(source->fd, start, SEEK_SET) < 0 ? -1 : 0, EX_IOERR, "seeking in %s", source->path);
+        }
+    }
+    if (options->has_until && source->is_mapped) {
+        // files that aren't mapped might be followed and grow, so the lines are checked as they're read instead
+        source->limit = source_find(source, &search, &options->until, false);
+        checkerr(source->limit < 0 ? -1 : 0, EX_IOERR, "reading from %s", source->path);
+    }
+    bisect_destroy(&search);
+}
+
+/// --state: find the offset after the last newline between from and to by reading backwards,
+/// or return from if there is none.
+off_t source_after_last_newline(const struct source *source, off_t from, off_t to) {
+    char chunk[4096];
+    while (to > from) {
+        size_t length = to - from < (off_t)sizeof(chunk) ? (size_t)(to - from) : sizeof(chunk);
+        ssize_t read_bytes = pread(source->fd, chunk, length, to - length);
+        if (read_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        checkerr(read_bytes != (ssize_t)length ? -1 : 0, EX_IOERR, "reading from %s", source->path);
+        char *newline = memrchr(chunk, '\n', length);
+        if (newline != NULL) {
+            return to - length + (newline - chunk) + 1;
+        }
+        to -= length;
+    }
+    return from;
+}
+
+/// --state: copy the compared part of the line that ends at end into a new allocation,
+/// which is empty if end is the start of the file.
+char* source_key_before(const struct source *source, off_t end, const struct options *options, size_t *key_length) {
+    off_t start = end == 0 ? 0 : source_after_last_newline(source, 0, end - 1);
+    // only the start of long lines is compared when merging too
+    size_t length = end - start < MAX_BUFFER_SIZE ? (size_t)(end - start) : (size_t)MAX_BUFFER_SIZE;
+    char *line = check_malloc(length + 1);
+    ssize_t read_bytes = pread(source->fd, line, length, start);
+    checkerr(read_bytes != (ssize_t)length ? -1 : 0, EX_IOERR, "reading from %s", source->path);
+    struct iovec whole = { .iov_base = line, .iov_len = length };
+    struct iovec key = key_extract(&options->key, whole);
+    memmove(line, key.iov_base, key.iov_len);
+    *key_length = key.iov_len;
+    return line;
+}
+
+/// --state: continue a mapped file from where the previous run stopped if saved says it's the same file,
+/// and stop at the end of its last complete line, which is recorded in merged for the next run.
+/// A last line without a newline might still be being written, so it's left for the next run.
+/// Other files are merged from the start, and merged->path is set to NULL.
+void source_continue_from_state(struct source *source, const struct saved_state *saved, const struct options *options,
+                   struct file_state *merged) {
+    merged->path = merged->key = NULL;
+    if (!source->is_mapped) {
+        return;
+    }
+    struct stat info;
+    checkerr(fstat(source->fd, &info), EX_IOERR, "getting size of %s", source->path);
+    off_t end = source->limit != -1 && source->limit < info.st_size ? source->limit : info.st_size;
+    const struct file_state *previous = state_find(saved, source->path);
+    if (previous != NULL && previous->device == info.st_dev && previous->inode == info.st_ino
+            && previous->offset > source->map_offset && previous->offset <= end) {
+        // a file that has been truncated and grown again is unlikely to have the same line there
+        size_t key_length;
+        char *key = source_key_before(source, previous->offset, options, &key_length);
+        if (key_length == previous->key_length && memcmp(key, previous->key, key_length) == 0) {
+            source->map_offset = previous->offset;
+        }
+        free(key);
+    }
+    source->limit = source_after_last_newline(source, source->map_offset, end);
+    merged->path = check_malloc(strlen(source->path) + 1);
+    strcpy(merged->path, source->path);
+    merged->device = info.st_dev;
+    merged->inode = info.st_ino;
+    merged->offset = source->limit;
+    merged->key = source_key_before(source, source->limit, options, &merged->key_length);
+}
+
+/// check whether the current line can be written without updating the heap,
+/// because the source is on top and the line is still not greater than the runner-up.
+bool source_stays(const struct source *source, const struct heap *sorter, const struct options *options,
+                  int runner_up) {
+    if (options->order == TIME_MIN) {
+        return heap_top_stays_timestamp(sorter, runner_up, source->timestamp);
+    } else if (options->order == NUMBER_MIN) {
+        return heap_top_stays_number(sorter, runner_up, source->number);
+    }
+    return heap_top_stays_slice(sorter, runner_up, source_key(source));
+}
+
+/// put the current line in the heap, either as a new entry or replacing the top.
+void source_sort(struct source *source, int index, struct heap *sorter, const struct options *options,
+                 bool replace_top) {
+    struct iovec key = source_key(source);
+    if (options->order == TIME_MIN) {
+        if (replace_top) {
+            heap_replace_top_timestamp(sorter, NULL, source->timestamp, index);
+        } else {
+            heap_push_timestamp(sorter, source->timestamp, index);
+        }
+    } else if (options->order == NUMBER_MIN) {
+        if (replace_top) {
+            heap_replace_top_number(sorter, NULL, source->number, index);
+        } else {
+            heap_push_number(sorter, source->number, index);
+        }
+    } else if (replace_top) {
+        heap_replace_top_slice(sorter, NULL, key, index);
+    } else {
+        heap_push_slice(sorter, key, index);
+    }
+}
+
+
+/// a mapping of a parked file that lines still refer to
+struct parked_mapping {
+    void *mapping;
+    size_t length;
+    unsigned long flushes_needed; //< the value of lines.flushes before it can be unmapped
+};
+
+/// --max-open: which mapped files of a merge are open, so that the others can be parked.
+/// Files aren't necessarily parked in the order they were last used: when the limit is reached,
+/// the file that was just merged from is parked, so the ones that are open stay open until they end.
+struct source_pool {
+    int open; //< mapped files that have a file descriptor
+    int max_open;
+    struct parked_mapping *unmapping; //< owned
+    int unmapping_length;
+    int unmapping_capacity;
+};
+
+/// count the mapped files that are open, which can be more than max_open until they're parked.
+struct source_pool pool_create(const struct source *sources, int sources_length, int max_open) {
+    struct source_pool pool = {
+        .open = 0,
+        .max_open = max_open,
+        .unmapping = NULL,
+        .unmapping_length = 0,
+        .unmapping_capacity = 0
+    };
+    for (int i=0; i<sources_length; i++) {
+        pool.open += sources[i].is_mapped && !sources[i].is_parked && sources[i].fd != -1;
+    }
+    return pool;
+}
+
+/// unmap what lines no longer refer to.
+void pool_collect(struct source_pool *pool, const struct lines *lines) {
+    int kept = 0;
+    for (int i=0; i<pool->unmapping_length; i++) {
+        if (lines->flushes >= pool->unmapping[i].flushes_needed) {
+            munmap(pool->unmapping[i].mapping, pool->unmapping[i].length);
+        } else {
+            pool->unmapping[kept++] = pool->unmapping[i];
+        }
+    }
+    pool->unmapping_length = kept;
+}
+
+/// should be called after lines have been flushed for the last time.
+void pool_destroy(struct source_pool *pool, const struct lines *lines) {
+    pool_collect(pool, lines);
+    single_free((void**)&pool->unmapping);
+}
+
+/// close the file and unmap it once it's no longer referred to, but keep the rest of the source.
+void pool_close(struct source_pool *pool, struct source *source, const struct lines *lines) {
+    if (!source->is_mapped || source->is_parked || source->fd == -1) {
+        return;
+    }
+    if (source->buffer != NULL && lines->flushes >= source->flushes_needed[0]) {
+        munmap(source->buffer, source->capacity);
+    } else if (source->buffer != NULL) {
+        if (pool->unmapping_length == pool->unmapping_capacity) {
+            pool->unmapping_capacity = pool->unmapping_capacity == 0 ? 16 : pool->unmapping_capacity * 2;
+            struct parked_mapping *grown = realloc(pool->unmapping,
+                                                   pool->unmapping_capacity * sizeof(struct parked_mapping));
+            if (grown == NULL) {
+                fail(EX_UNAVAILABLE, "Not enough memory.");
+            }
+            pool->unmapping = grown;
+        }
+        struct parked_mapping parked = {
+            .mapping = source->buffer,
+            .length = source->capacity,
+            .flushes_needed = source->flushes_needed[0]
+        };
+        pool->unmapping[pool->unmapping_length++] = parked;
+    }
+    source->buffer = NULL;
+    source->capacity = source->length = 0;
+    close(source->fd);
+    source->fd = -1;
+    pool->open--;
+}
+
+/// close and unmap the file if too many are open, keeping a copy of the key of the current line
+/// or, if `has_line` is false, not having read from it yet.
+void pool_release(struct source_pool *pool, struct source *source, const struct lines *lines, bool has_line) {
+    if (pool->open < pool->max_open || !source->is_mapped || source->is_parked) {
+        return;
+    }
+    struct iovec key = {.iov_base = NULL, .iov_len = 0};
+    if (has_line) {
+        key = source_key(source);
+    }
+    if ((int)key.iov_len >= source->parked_key_capacity) {
+        free(source->parked_key);
+        source->parked_key_capacity = (int)key.iov_len + 1;
+        source->parked_key = check_malloc(source->parked_key_capacity);
+    }
+    if (has_line) {
+        memcpy(source->parked_key, key.iov_base, key.iov_len);
+    }
+    source->resume_offset = source->map_offset + source->start;
+    pool_close(pool, source, lines);
+    // so that source_key() returns the copy
+    source->buffer = source->parked_key;
+    source->start = source->end = source->key_start = 0;
+    source->key_length = (int)key.iov_len;
+    source->is_parked = true;
+}
+
+/// reopen a parked file, which must then be read and parsed again to get the current line back.
+void pool_acquire(struct source_pool *pool, struct source *source, const struct lines *lines) {
+    if (!source->is_parked) {
+        return;
+    }
+    pool_collect(pool, lines);
+    source->fd = checkerr(open(source->path, O_RDONLY), EX_IOERR, "reopening %s", source->path);
+    source->buffer = NULL;
+    source->map_offset = source->resume_offset;
+    source->start = source->end = source->length = source->capacity = 0;
+    source_reindex(source, 0);
+    source->is_parked = false;
+    pool->open++;
+}
+
+
+/// a file descriptor for reading the file without changing the position of the source's,
+/// which is opened if the file is parked. Should be given to source_return_fd() when done with.
+int source_borrow_fd(const struct source *source) {
+    if (!source->is_parked) {
+        return source->fd;
+    }
+    return checkerr(open(source->path, O_RDONLY), EX_IOERR, "reopening %s", source->path);
+}
+
+/// close what source_borrow_fd() opened, and set it to -1.
+void source_return_fd(const struct source *source, int *fd) {
+    if (source->is_parked) {
+        close(*fd);
+    }
+    *fd = -1;
+}
+
+
+/// follow mode: try to read a line from a file that had run out of them, and put it in the heap.
+void source_resume(struct source *source, int index, struct heap *sorter, struct lines *lines,
+                   const struct options *options, struct follow *follower) {
+    source->is_waiting = false;
+    bool have_line = source_read(source, lines);
+    if (!have_line && source->is_waiting && source->maybe_replaced) {
+        source->maybe_replaced = false;
+        if (source_check_replaced(source)) {
+            if (!follow_file(follower, index, source->path)) {
+                checkerr(-1, EX_UNAVAILABLE, "watching %s", source->path);
+            }
+            source->is_waiting = false;
+            have_line = source_read(source, lines);
+        }
+    }
+    if (have_line) {
+        have_line = source_skip_to_since(source, lines, options) && source_parse(source, options);
+    }
+    if (have_line) {
+        source->is_idle = false;
+        source_sort(source, index, sorter, options, false);
+    } else if (!source->is_waiting) {
+        // a pipe that has been closed
+        source->is_idle = false;
+        follow_forget(follower, index);
+    }
+}
+
+/// follow mode: read files as they grow until the top of the heap can be written,
+/// which is when every file has a line, or the line was read at least the latency ago.
+/// `last_check` is when idle files were last checked, which is done once in a while if lines
+/// are written without waiting for them.
+/// returns with an empty heap only when all files have ended, which requires that none are regular files.
+void follow_until_ready(struct follow *follower, unsigned int *events,
+                        struct source *sources, int sources_length, struct heap *sorter,
+                        struct lines *lines, const struct options *options, long long *last_check) {
+    while (true) {
+        bool any_idle = false;
+        for (int i=0; i<sources_length; i++) {
+            if (sources[i].is_idle && sources[i].maybe_replaced) {
+                source_resume(&sources[i], i, sorter, lines, options, follower);
+            }
+            any_idle |= sources[i].is_idle;
+        }
+        long long now = monotonic_ms();
+        int timeout = -1;
+        if (!any_idle) {
+            return;
+        } else if (!heap_is_empty(sorter)) {
+            long long left = sources[heap_peek_value(sorter)].read_at + options->latency_ms - now;
+            if (left > 0) {
+                timeout = (int)left;
+            } else if (now - *last_check <= options->latency_ms) {
+                return;
+            } else {
+                // checking is a syscall, so don't do it for every line
+                timeout = 0;
+            }
+        }
+
+        lines_flush(lines);
+        checkerr(follow_wait(follower, timeout, events), EX_IOERR, "waiting for files to change");
+        *last_check = monotonic_ms();
+        for (int i=0; i<sources_length; i++) {
+            if ((events[i] & FOLLOW_REPLACED) != 0) {
+                sources[i].maybe_replaced = true;
+            }
+            if (events[i] != 0 && sources[i].is_idle) {
+                source_resume(&sources[i], i, sorter, lines, options, follower);
+            }
+        }
+    }
+}
+
+
+const struct iovec NEWLINE = { .iov_base = "\n", .iov_len = 1 };
+
+/// how much to ask the kernel to copy at a time
+const size_t COPY_CHUNK = 1 << 30;
+
+/// copy the rest of a regular file from its current position without reading it into userspace,
+/// using either copy_file_range() (which can share extents if `to` is a file) or sendfile().
+/// copies at most `length` bytes unless that is -1.
+/// returns the number of bytes copied, or -1 if the method isn't supported for these files.
+ssize_t copy_by_kernel(int from, int to, off_t length, bool use_sendfile, const char *path) {
+    if (to < 0) {
+        // libtailmerge: the output goes to a callback
+        return -1;
+    }
+    ssize_t total = 0;
+    while (true) {
+        size_t chunk = COPY_CHUNK;
+        if (length != -1 && length - total < (off_t)chunk) {
+            chunk = length - total;
+        }
+        ssize_t copied = chunk == 0 ? 0 : use_sendfile
+            ? sendfile(to, from, NULL, chunk)
+            : copy_file_range(from, NULL, to, NULL, chunk, 0);
+        if (copied > 0) {
+            total += copied;
+            STAT_ADD(STAT_COPIED_BYTES, copied);
+        } else if (copied == 0) {
+            return total;
+        } else if (total == 0 && (errno == EINVAL || errno == EXDEV || errno == ENOSYS
+                                  || errno == EOPNOTSUPP || errno == EBADF)) {
+            // EBADF is also returned by copy_file_range() if stdout is appended to
+            return -1;
+        } else if (errno != EINTR) {
+            checkerr(-1, EX_IOERR, "copying %s", path);
+        }
+    }
+}
+
+/// write the current line and everything after it without looking for newlines,
+/// which can be done when there are no other files left to merge with.
+void source_copy_rest(struct source *source, struct lines *lines) {
+    struct iovec rest = {
+        .iov_base = &source->buffer[source->start],
+        .iov_len = source->length - source->start
+    };
+    lines_add(lines, rest);
+    lines_flush(lines);
+    char last = source->buffer[source->length-1];
+    off_t remaining = -1;
+    if (source->is_mapped) {
+        // the file descriptor hasn't been read from
+        off_t after = source->map_offset + source->length;
+        checkerr(lseek(source->fd, after, SEEK_SET), EX_IOERR, "seeking in %s", source->path);
+        if (source->limit != -1) {
+            remaining = source->limit - after;
+        }
+    }
+    if (source->readahead != NULL && readahead_is_pending(source->readahead, source->slot)) {
+        source->ahead_length = checkerr(
+            readahead_wait(source->readahead, source->slot),
+            EX_IOERR,
+            "reading from %s", source->path
+        );
+    }
+    if (source->ahead_length != 0) {
+        // what has already been read comes first
+        char *ahead = source->buffers[(source->current + 1) % source->buffers_length];
+        rest.iov_base = &ahead[READ_AHEAD_HEADROOM];
+        rest.iov_len = source->ahead_length;
+        lines_add(lines, rest);
+        lines_flush(lines);
+        last = ahead[READ_AHEAD_HEADROOM + source->ahead_length - 1];
+        source->ahead_length = 0;
+    }
+
+    struct stat info;
+    checkerr(fstat(source->fd, &info), EX_IOERR, "getting type of %s", source->path);
+    ssize_t copied = -1;
+    if (S_ISREG(info.st_mode) && source->decompressor == NULL) {
+        copied = copy_by_kernel(source->fd, lines->fd, remaining, false, source->path);
+        if (copied == -1) {
+            copied = copy_by_kernel(source->fd, lines->fd, remaining, true, source->path);
+        }
+        if (copied > 0) {
+            // the last byte didn't pass through here
+            off_t end = checkerr(lseek(source->fd, 0, SEEK_CUR), EX_IOERR, "getting position in %s", source->path);
+            checkerr(pread(source->fd, &last, 1, end-1), EX_IOERR, "reading from %s", source->path);
+        }
+    }
+    if (copied == -1 && source->is_mapped) {
+        source->start = source->length;
+        while (source_map(source, lines)) {
+            rest.iov_base = &source->buffer[source->start];
+            rest.iov_len = source->length - source->start;
+            lines_add(lines, rest);
+            lines_flush(lines);
+            last = source->buffer[source->length-1];
+            source->start = source->length;
+        }
+    } else if (copied == -1) {
+        // pipe or unsupported, but can use the whole buffer now
+        while (true) {
+            int read_bytes = checkerr(
+                source_read_bytes(source, source->buffer, source->capacity),
+                EX_IOERR,
+                "reading from %s", source->path
+            );
+            if (read_bytes == 0) {
+                break;
+            }
+            struct iovec chunk = { .iov_base = source->buffer, .iov_len = read_bytes };
+            lines_add(lines, chunk);
+            lines_flush(lines);
+            last = source->buffer[read_bytes-1];
+        }
+    }
+    source->start = source->end = source->length = 0;
+
+    if (last != '\n') {
+        lines_add(lines, NEWLINE);
+    }
+}
+
+
+/// set up reading ahead for the sources that aren't mapped, unless in follow mode or turned off.
+/// slots are the indexes into sources, so the engines are only used for these.
+void sources_read_ahead(struct source *sources, int sources_length, const struct options *options,
+                        struct readahead **readahead, struct readahead **decompressing) {
+    bool any_unmapped = false, any_compressed = false;
+    for (int i=0; i<sources_length; i++) {
+        any_unmapped |= !sources[i].is_mapped;
+        any_compressed |= sources[i].decompressor != NULL;
+    }
+    *readahead = NULL;
+    if (options->read_ahead && any_unmapped && !options->follow) {
+        *readahead = readahead_create(options->read_ahead_backend, sources_length);
+        if (*readahead == NULL && options->read_ahead_backend != READAHEAD_ANY) {
+            checkerr(-1, EX_UNAVAILABLE, "set up reading ahead");
+        }
+    }
+    // io_uring can't decompress, so use threads for compressed files, which lets several be decompressed in parallel
+    *decompressing = *readahead;
+    if (any_compressed && options->read_ahead && !options->follow
+            && (*readahead == NULL || readahead_get_backend(*readahead) != READAHEAD_THREADS)) {
+        // decompress while waiting if threads aren't available
+        *decompressing = readahead_create(READAHEAD_THREADS, sources_length);
+    }
+    for (int i=0; i<sources_length; i++) {
+        if (sources[i].decompressor != NULL && *decompressing != NULL) {
+            source_set_readahead(&sources[i], *decompressing, i);
+        } else if (!sources[i].is_mapped && *readahead != NULL) {
+            source_set_readahead(&sources[i], *readahead, i);
+        }
+    }
+}
+
+/// wait for any reads that are still in progress, and destroy the engines.
+void sources_stop_reading_ahead(struct source *sources, int sources_length,
+                                struct readahead *readahead, struct readahead *decompressing) {
+    for (int i=0; i<sources_length; i++) {
+        if (sources[i].readahead != NULL && readahead_is_pending(sources[i].readahead, sources[i].slot)) {
+            readahead_wait(sources[i].readahead, sources[i].slot);
+        }
+        sources[i].readahead = NULL;
+    }
+    if (readahead != NULL) {
+        readahead_destroy(readahead);
+    }
+    if (decompressing != NULL && decompressing != readahead) {
+        readahead_destroy(decompressing);
+    }
+}
+
+
+/// --unique: copies of the last lines written, for dropping lines that are the same as one of them.
+struct unique {
+    struct iovec *seen; //< owned, and so are the copies they point to
+    size_t *capacities; //< of each copy
+    int window; //< how many lines are kept, or 0 if not dropping lines
+    int length; //< how many of seen are used, which is less than window at the start
+    int oldest; //< the one that is replaced next once all are used
+};
+
+struct unique unique_create(int window) {
+    struct unique unique = {
+        .seen = window == 0 ? NULL : check_malloc(window * sizeof(struct iovec)),
+        .capacities = window == 0 ? NULL : check_malloc(window * sizeof(size_t)),
+        .window = window,
+        .length = 0,
+        .oldest = 0
+    };
+    return unique;
+}
+
+void unique_destroy(struct unique *unique) {
+    for (int i=0; i<unique->length; i++) {
+        free(unique->seen[i].iov_base);
+    }
+    single_free((void**)&unique->seen);
+    single_free((void**)&unique->capacities);
+}
+
+/// check whether line is the same as one of the last lines written,
+/// and if not remember it, as it's going to be written.
+/// the newline isn't compared, as it's added to the last line of files that don't end with one.
+bool unique_repeats(struct unique *unique, struct iovec line) {
+    if (line.iov_len != 0 && ((char*)line.iov_base)[line.iov_len-1] == '\n') {
+        line.iov_len--;
+    }
+    for (int i=0; i<unique->length; i++) {
+        if (unique->seen[i].iov_len == line.iov_len && memcmp(unique->seen[i].iov_base, line.iov_base, line.iov_len) == 0) {
+            return true;
+        }
+    }
+    int slot = unique->oldest;
+    if (unique->length < unique->window) {
+        slot = unique->length++;
+        unique->seen[slot].iov_base = NULL;
+        unique->capacities[slot] = 0;
+    } else {
+        unique->oldest = (unique->oldest + 1) % unique->window;
+    }
+    if (unique->capacities[slot] < line.iov_len) {
+        free(unique->seen[slot].iov_base);
+        unique->seen[slot].iov_base = check_malloc(line.iov_len);
+        unique->capacities[slot] = line.iov_len;
+    }
+    memcpy(unique->seen[slot].iov_base, line.iov_base, line.iov_len);
+    unique->seen[slot].iov_len = line.iov_len;
+    return false;
+}
+
+
+/// which of the files the first and last lines written came from, or -1 if nothing was written
+struct written_files {
+    int first;
+    int last;
+};
+
+/// add the header of a file before its line, unless the line before was from the same file.
+void add_header(const struct source *source, int index, struct lines *lines, struct written_files *written) {
+    if (index == written->last) {
+        return;
+    }
+    struct iovec header = { .iov_base = source->header, .iov_len = source->header_length };
+    if (written->last == -1) {
+        // first line of output, skip newline
+        header.iov_base = source->header + 1;
+        header.iov_len--;
+        written->first = index;
+    }
+    lines_add(lines, header);
+    written->last = index;
+}
+
+/// write index in decimal to digits, which must have room for 10, and return the number of digits.
+int format_index(char *digits, int index) {
+    char reversed[10];
+    int length = 0;
+    do {
+        reversed[length++] = (char)('0' + index % 10);
+        index /= 10;
+    } while (index != 0);
+    for (int i=0; i<length; i++) {
+        digits[i] = reversed[length-1-i];
+    }
+    return length;
+}
+
+/// add text to lines as the inside of a JSON string, by referencing it between what must be escaped.
+/// bytes that aren't ASCII are written as they are, so invalid UTF-8 stays invalid.
+void lines_add_json_string(struct lines *lines, struct iovec text) {
+    const char *bytes = text.iov_base;
+    size_t unescaped = 0;
+    for (size_t i=0; i<text.iov_len; i++) {
+        unsigned char c = (unsigned char)bytes[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        if (i > unescaped) {
+            struct iovec before = { .iov_base = (char*)bytes + unescaped, .iov_len = i - unescaped };
+            lines_add(lines, before);
+        }
+        char escape[6] = {'\\', (char)c};
+        int length = 2;
+        switch (c) {
+            case '"': case '\\': break;
+            case '\n': escape[1] = 'n'; break;
+            case '\t': escape[1] = 't'; break;
+            case '\r': escape[1] = 'r'; break;
+            case '\b': escape[1] = 'b'; break;
+            case '\f': escape[1] = 'f'; break;
+            default:
+                memcpy(escape, "\\u00", 4);
+                escape[4] = "0123456789abcdef"[c >> 4];
+                escape[5] = "0123456789abcdef"[c & 15];
+                length = 6;
+        }
+        lines_add_formatted(lines, escape, length);
+        unescaped = i + 1;
+    }
+    if (text.iov_len > unescaped) {
+        struct iovec rest = { .iov_base = (char*)bytes + unescaped, .iov_len = text.iov_len - unescaped };
+        lines_add(lines, rest);
+    }
+}
+
+/// add a line from the file at index to lines in the --format, referencing line instead of copying it.
+/// continues is true for the rest of lines that were too long for the buffer they were read into,
+/// and for the newline added after the last line of a file that doesn't end with one.
+void output_line(struct lines *lines, enum output_format format, const struct source *source, int index,
+                 struct iovec line, bool continues, struct written_files *written) {
+    if (format == FORMAT_HEADERS) {
+        add_header(source, index, lines, written);
+        lines_add(lines, line);
+        if (!continues) {
+            stats_count_line(index);
+        }
+        return;
+    }
+    if (written->first == -1) {
+        written->first = index;
+    }
+    written->last = index;
+    if (!continues) {
+        stats_count_line(index);
+    }
+    if (format == FORMAT_PLAIN) {
+        lines_add(lines, line);
+        return;
+    }
+    char prefix[64];
+    if (format == FORMAT_TAGGED) {
+        if (!continues) {
+            int length = format_index(prefix, index);
+            prefix[length] = '\t';
+            lines_add_formatted(lines, prefix, length + 1);
+        }
+        lines_add(lines, line);
+        return;
+    }
+
+    // objects and frames separate lines already
+    if (line.iov_len != 0 && ((char*)line.iov_base)[line.iov_len-1] == '\n') {
+        line.iov_len--;
+    }
+    if (continues && line.iov_len == 0) {
+        return;
+    }
+    if (format == FORMAT_NDJSON) {
+        const char *start = "{\"source\":";
+        const char *end = continues ? ",\"continued\":true,\"line\":\"" : ",\"line\":\"";
+        int length = strlen(start);
+        memcpy(prefix, start, length);
+        length += format_index(&prefix[length], index);
+        memcpy(&prefix[length], end, strlen(end));
+        length += strlen(end);
+        lines_add_formatted(lines, prefix, length);
+        lines_add_json_string(lines, line);
+        lines_add_formatted(lines, "\"}\n", 3);
+    } else {
+        // the length and then the index, with the highest bit set if it continues the line of the previous frame
+        unsigned long length = line.iov_len;
+        unsigned long tag = (unsigned long)index | (continues ? 1UL << 31 : 0);
+        unsigned char frame[8];
+        for (int i=0; i<4; i++) {
+            frame[i] = (unsigned char)(length >> (8*i));
+            frame[4+i] = (unsigned char)(tag >> (8*i));
+        }
+        lines_add_formatted(lines, frame, sizeof(frame));
+        if (line.iov_len != 0) {
+            lines_add(lines, line);
+        }
+    }
+}
+
+/// add a part of the current buffer to lines in the --format, and remember that they must be written before it's reused.
+void source_output(struct source *source, int index, struct lines *lines, struct iovec part, bool continues,
+                   const struct options *options, struct written_files *written) {
+    output_line(lines, options->format, source, index, part, continues, written);
+    source->flushes_needed[source->current] = lines->flushes + 1;
+}
+
+/// libtailmerge: what merge_sources() or group_merge() has set up, for releasing it if the merge fails.
+/// the sources are destroyed by tailmerge_run().
+struct merging {
+    struct source *sources;
+    int sources_length;
+    struct readahead **readahead;
+    struct readahead **decompressing;
+    struct source_pool *pool;
+    struct heap *sorter;
+    const struct arena *arena; //< which the heap might be allocated from, or NULL
+    struct unique *unique; //< NULL in group_merge()
+    struct lines *lines; //< group_merge(): its own, or NULL
+};
+
+void abandon_merging(void *arg) {
+    struct merging *merging = arg;
+    sources_stop_reading_ahead(merging->sources, merging->sources_length,
+                               *merging->readahead, *merging->decompressing);
+    // nothing more is written, so what lines refer to can be unmapped right away
+    for (int i=0; i<merging->pool->unmapping_length; i++) {
+        munmap(merging->pool->unmapping[i].mapping, merging->pool->unmapping[i].length);
+    }
+    single_free((void**)&merging->pool->unmapping);
+    arena_free(merging->arena, heap_get_memory(merging->sorter));
+    if (merging->unique != NULL) {
+        unique_destroy(merging->unique);
+    }
+    if (merging->lines != NULL) {
+        lines_destroy(merging->lines);
+    }
+}
+
+/// merge on this thread, writing to lines.
+/// follower is NULL unless in follow mode, in which case events has one element per file.
+/// at most max_open of the mapped files are kept open.
+/// the heap is allocated from arena unless that is NULL.
+struct written_files merge_sources(struct source *sources, int sources_length,
+                                   struct follow *follower, unsigned int *events,
+                                   struct lines *lines, const struct options *options, int max_open,
+                                   struct arena *arena) {
+    struct written_files written = {.first = -1, .last = -1};
+    struct unique unique = unique_create(options->unique_window);
+    // a loser tree needs fewer comparisons per line, but it doesn't pay off for a few files
+    enum heap_type key_type = options->order;
+    struct heap sorter = sources_length >= LOSER_TREE_MIN_SOURCES
+        ? heap_create_loser_tree(key_type, sources_length)
+        : heap_create(key_type, sources_length);
+    struct readahead *readahead = NULL, *decompressing = NULL;
+    struct source_pool pool = pool_create(sources, sources_length, max_open);
+    struct merging merging = {
+        .sources = sources,
+        .sources_length = sources_length,
+        .readahead = &readahead,
+        .decompressing = &decompressing,
+        .pool = &pool,
+        .sorter = &sorter,
+        .arena = arena,
+        .unique = &unique,
+        .lines = NULL
+    };
+    on_failure(abandon_merging, &merging);
+    heap_set_memory(&sorter, check_allocate(arena, heap_get_needed_memory(&sorter), false));
+    sources_read_ahead(sources, sources_length, options, &readahead, &decompressing);
+    for (int i=0; i<sources_length; i++) {
+        pool_acquire(&pool, &sources[i], lines);
+        if (source_read(&sources[i], lines) && source_skip_to_since(&sources[i], lines, options)
+                && source_parse(&sources[i], options)) {
+            pool_release(&pool, &sources[i], lines, true);
+            source_sort(&sources[i], i, &sorter, options, false);
+        } else if (sources[i].is_waiting) {
+            sources[i].is_idle = true;
+        } else {
+            if (follower != NULL) {
+                follow_forget(follower, i);
+            }
+            pool_close(&pool, &sources[i], lines);
+            source_destroy(&sources[i]);
+        }
+    }
+
+    long long last_check = monotonic_ms();
+    while (true) {
+        if (follower != NULL) {
+            follow_until_ready(follower, events, sources, sources_length, &sorter, lines, options, &last_check);
+        }
+        if (heap_is_empty(&sorter)) {
+            break;
+        }
+        // the line stays in the heap until the next one from the same file is known,
+        // so that it can be replaced without comparing against the other files twice.
+        int next = heap_peek_value(&sorter);
+        struct source *source = &sources[next];
+        if (source->is_parked) {
+            // the line was complete and not after --until when parked
+            pool_acquire(&pool, source, lines);
+            source_read(source, lines);
+            source_parse(source, options);
+        }
+
+        if (heap_length(&sorter) == 1 && follower == NULL && (!options->has_until || source->is_mapped)
+                && options->unique_window == 0
+                && (options->format == FORMAT_HEADERS || options->format == FORMAT_PLAIN)) {
+            // the remaining lines don't need to be compared or formatted, and mapped files end at --until
+            if (options->format == FORMAT_HEADERS) {
+                add_header(source, next, lines, &written);
+            } else if (written.first == -1) {
+                written.first = next;
+            }
+            written.last = next;
+            source_copy_rest(source, lines);
+            heap_pop_slice_value(&sorter, NULL);
+            break;
+        }
+
+        // write lines from the same file until one would be sorted after the next file's,
+        // which is only one comparison per line instead of replacing the top for each of them.
+        // files aren't necessarily sorted, so this can't skip ahead and search for the end of the run.
+        int runner_up = heap_find_runner_up(&sorter);
+        bool is_truncated, have_line;
+        do {
+            struct iovec line = source_line(source);
+            is_truncated = ((char*)line.iov_base)[line.iov_len-1] != '\n';
+            // a missing newline is added right away, so that the line is compared like the others
+            bool ends_file = is_truncated && source_line_ends_file(source);
+            // the rest of long lines isn't kept, so they're never dropped
+            if (options->unique_window == 0 || (is_truncated && !ends_file) || !unique_repeats(&unique, line)) {
+                source_output(source, next, lines, line, false, options, &written);
+                if (ends_file) {
+                    source_output(source, next, lines, NEWLINE, true, options, &written);
+                }
+            }
+            is_truncated = is_truncated && !ends_file;
+            have_line = source_advance(source);
+            while (!have_line) {
+                have_line = source_read(source, lines);
+                if (!have_line || !is_truncated) {
+                    break;
+                }
+                // the rest of a line that was too long for the buffer, which isn't compared
+                STAT_ADD(STAT_TRUNCATED_LINES, 1);
+                line = source_line(source);
+                source_output(source, next, lines, line, true, options, &written);
+                is_truncated = ((char*)line.iov_base)[line.iov_len-1] != '\n';
+                have_line = source_advance(source);
+            }
+            if (have_line) {
+                have_line = source_parse(source, options);
+            }
+        } while (have_line && source_stays(source, &sorter, options, runner_up));
+
+        if (have_line) {
+            pool_release(&pool, source, lines, true);
+            source_sort(source, next, &sorter, options, true);
+        } else {
+            if (is_truncated) {
+                // file doesn't end with a newline
+                output_line(lines, options->format, source, next, NEWLINE, true, &written);
+            }
+            heap_pop_slice_value(&sorter, NULL);
+            if (source->is_waiting) {
+                source->is_idle = true;
+            } else if (follower != NULL) {
+                follow_forget(follower, next);
+            }
+            pool_close(&pool, source, lines);
+        }
+    }
+    lines_flush(lines);
+    forget_on_failure(&merging);
+    pool_destroy(&pool, lines);
+    sources_stop_reading_ahead(sources, sources_length, readahead, decompressing);
+    arena_free(arena, heap_get_memory(&sorter));
+    unique_destroy(&unique);
+    return written;
+}
+
+
+/// --jobs: a line merged by a group, or a part of one.
+struct batch_line {
+    int offset; //< in batch bytes
+    int length;
+    int source; //< index into all sources, for headers
+    bool continues; //< the rest of the previous line, which was too long to compare all of, or a missing newline
+    struct timeval timestamp; //< in timestamp mode
+    double number; //< when comparing numbers
+    int key_start; //< offset of the compared part from offset
+    int key_length;
+};
+
+/// --jobs: lines merged by a group, copied so that the files' buffers can be reused right away,
+/// and so that the final merge can write them without waiting for the group.
+struct batch {
+    char *bytes; //< owned
+    int bytes_length;
+    int bytes_capacity;
+    struct batch_line *lines; //< owned
+    int length; //< number of lines
+    bool is_last; //< the group has no more lines after these
+};
+
+/// how many bytes of lines to copy into each batch, unless a single line is longer
+const int BATCH_BYTES = 256 << 10;
+/// max number of lines per batch
+#define BATCH_LINES 4096
+/// how many batches each group can have, which is the two the final merge might be holding,
+/// one being filled and one spare so that merging the group rarely waits for the final merge
+#define GROUP_BATCHES 4
+
+/// --jobs: some of the files, which are merged on a separate thread and then together with the other groups.
+struct group {
+    struct source *sources; //< borrowed part of all sources
+    int first; //< index of sources[0] in all sources
+    int sources_length;
+    const struct options *options; //< borrowed
+    int max_open; //< how many of the group's mapped files can be open
+    struct spsc_ring *merged; //< batches of lines from the group's thread to the final merge
+    struct spsc_ring *returned; //< batches that have been written and can be reused
+    struct batch batches[GROUP_BATCHES];
+    pthread_t thread;
+    struct batch *filling; //< only used by the group's thread, which ends with it if failing
+
+    // only used by the final merge
+    struct batch *current; //< the batch with the group's next line
+    int next; //< index of the group's next line in current->lines
+    /// the last exhausted batch, which isn't returned until lines referring to it are written
+    struct batch *exhausted;
+    unsigned long exhausted_flushes_needed; //< lines.flushes before exhausted can be returned
+    unsigned long flushes_needed; //< lines.flushes before any line from the group added to lines is written
+};
+
+/// group thread: copy a line or the rest of one into the batch, sending it off if full.
+/// add_newline is for the last line of a file that doesn't end with one.
+/// returns the batch that the line was added to.
+struct batch* batch_add(struct group *group, struct batch *batch, struct iovec line, int source, bool continues,
+                        bool add_newline) {
+    int length = (int)line.iov_len + add_newline;
+    if (batch->length == BATCH_LINES || batch->bytes_length + length > batch->bytes_capacity) {
+        if (batch->length != 0) {
+            // libtailmerge: the final merge has stopped reading batches if it failed
+            stop_if_failed();
+            spsc_push(group->merged, batch);
+            batch = group->filling = spsc_pop(group->returned);
+            batch->length = 0;
+            batch->bytes_length = 0;
+        }
+        if (length > batch->bytes_capacity) {
+            // a line that is too long to compare only a part of
+            free(batch->bytes);
+            batch->bytes = check_malloc(length);
+            batch->bytes_capacity = length;
+        }
+    }
+    struct batch_line *added = &batch->lines[batch->length];
+    added->offset = batch->bytes_length;
+    added->length = length;
+    added->source = source;
+    added->continues = continues;
+    added->timestamp = group->sources[source - group->first].timestamp;
+    added->number = group->sources[source - group->first].number;
+    added->key_start = group->sources[source - group->first].key_start;
+    added->key_length = group->sources[source - group->first].key_length;
+    memcpy(&batch->bytes[batch->bytes_length], line.iov_base, line.iov_len);
+    if (add_newline) {
+        batch->bytes[batch->bytes_length + line.iov_len] = '\n';
+    }
+    batch->bytes_length += length;
+    batch->length++;
+    return batch;
+}
+
+/// group thread: merge the group's files into batches in the same way as merge_sources(),
+/// except that headers aren't added, and lines that files end with are followed by a newline.
+void* group_merge(void *arg) {
+    struct group *group = arg;
+    group->filling = NULL;
+    struct catcher catching;
+    if (catch_failures(&catching, group->options->failure)) {
+        if (setjmp(catching.jump) != 0) {
+            // end the group without the rest of its lines, so that the final merge doesn't wait for them
+            struct batch *last = group->filling != NULL ? group->filling : spsc_pop(group->returned);
+            last->length = 0;
+            last->is_last = true;
+            spsc_push(group->merged, last);
+            catcher = NULL;
+            return NULL;
+        }
+    }
+    struct source *sources = group->sources;
+    const struct options *options = group->options;
+    enum heap_type key_type = options->order;
+    struct heap sorter = group->sources_length >= LOSER_TREE_MIN_SOURCES
+        ? heap_create_loser_tree(key_type, group->sources_length)
+        : heap_create(key_type, group->sources_length);
+    struct readahead *readahead = NULL, *decompressing = NULL;
+    // lines are copied instead of being referred to, so this is never written to,
+    // but reading still takes one for deciding which buffers can be reused.
+    struct lines lines = {.to_write = NULL, .arena = NULL, .formatted = NULL};
+    struct source_pool pool = pool_create(sources, group->sources_length, group->max_open);
+    struct merging merging = {
+        .sources = sources,
+        .sources_length = group->sources_length,
+        .readahead = &readahead,
+        .decompressing = &decompressing,
+        .pool = &pool,
+        .sorter = &sorter,
+        .arena = NULL,
+        .unique = NULL,
+        .lines = &lines
+    };
+    on_failure(abandon_merging, &merging);
+    heap_set_memory(&sorter, check_malloc(heap_get_needed_memory(&sorter)));
+    sources_read_ahead(sources, group->sources_length, options, &readahead, &decompressing);
+    lines = lines_create(-1, 1, 0, NULL);
+    for (int i=0; i<group->sources_length; i++) {
+        pool_acquire(&pool, &sources[i], &lines);
+        if (source_read(&sources[i], &lines) && source_skip_to_since(&sources[i], &lines, options)
+                && source_parse(&sources[i], options)) {
+            pool_release(&pool, &sources[i], &lines, true);
+            source_sort(&sources[i], i, &sorter, options, false);
+        } else {
+            pool_close(&pool, &sources[i], &lines);
+            source_destroy(&sources[i]);
+        }
+    }
+
+    struct batch *batch = group->filling = spsc_pop(group->returned);
+    while (!heap_is_empty(&sorter)) {
+        int next = heap_peek_value(&sorter);
+        struct source *source = &sources[next];
+        if (source->is_parked) {
+            pool_acquire(&pool, source, &lines);
+            source_read(source, &lines);
+            source_parse(source, options);
+        }
+        int runner_up = heap_find_runner_up(&sorter);
+        bool is_truncated, have_line;
+        do {
+            struct iovec line = source_line(source);
+            is_truncated = ((char*)line.iov_base)[line.iov_len-1] != '\n';
+            // with the missing newline the final merge can compare it like other lines for --unique
+            bool ends_file = is_truncated && source_line_ends_file(source);
+            batch = batch_add(group, batch, line, group->first + next, false, ends_file);
+            is_truncated = is_truncated && !ends_file;
+            have_line = source_advance(source);
+            while (!have_line) {
+                have_line = source_read(source, &lines);
+                if (!have_line || !is_truncated) {
+                    break;
+                }
+                STAT_ADD(STAT_TRUNCATED_LINES, 1);
+                line = source_line(source);
+                batch = batch_add(group, batch, line, group->first + next, true, false);
+                is_truncated = ((char*)line.iov_base)[line.iov_len-1] != '\n';
+                have_line = source_advance(source);
+            }
+            if (have_line) {
+                have_line = source_parse(source, options);
+            }
+        } while (have_line && (runner_up == -1 || source_stays(source, &sorter, options, runner_up)));
+
+        if (have_line) {
+            pool_release(&pool, source, &lines, true);
+            source_sort(source, next, &sorter, options, true);
+        } else {
+            if (is_truncated) {
+                batch = batch_add(group, batch, NEWLINE, group->first + next, true, false);
+            }
+            heap_pop_slice_value(&sorter, NULL);
+            pool_close(&pool, source, &lines);
+        }
+    }
+    forget_on_failure(&merging);
+    batch->is_last = true;
+    spsc_push(group->merged, batch);
+
+    pool_destroy(&pool, &lines);
+    sources_stop_reading_ahead(sources, group->sources_length, readahead, decompressing);
+    lines_destroy(&lines);
+    free(heap_get_memory(&sorter));
+    catcher = NULL;
+    return NULL;
+}
+
+struct iovec group_line(const struct group *group) {
+    const struct batch_line *line = &group->current->lines[group->next];
+    struct iovec slice = {
+        .iov_base = &group->current->bytes[line->offset],
+        .iov_len = line->length
+    };
+    return slice;
+}
+
+/// final merge: the compared part of the group's next line
+struct iovec group_key(const struct group *group) {
+    const struct batch_line *line = &group->current->lines[group->next];
+    struct iovec slice = {
+        .iov_base = &group->current->bytes[line->offset + line->key_start],
+        .iov_len = line->key_length
+    };
+    return slice;
+}
+
+/// final merge: move to the group's next line, waiting for the group if it hasn't been merged yet.
+/// returns false if the group has no more lines.
+bool group_advance(struct group *group, struct lines *lines) {
+    group->next++;
+    while (group->next == group->current->length) {
+        if (group->current->is_last) {
+            return false;
+        }
+        if (group->exhausted != NULL) {
+            if (lines->flushes < group->exhausted_flushes_needed) {
+                lines_flush(lines);
+            }
+            spsc_push(group->returned, group->exhausted);
+        }
+        group->exhausted = group->current;
+        group->exhausted_flushes_needed = group->flushes_needed;
+        group->current = spsc_try_pop(group->merged);
+        if (group->current == NULL) {
+            // write what can be written while waiting, and let the group reuse everything
+            if (lines->flushes < group->exhausted_flushes_needed) {
+                lines_flush(lines);
+            }
+            spsc_push(group->returned, group->exhausted);
+            group->exhausted = NULL;
+            group->current = spsc_pop(group->merged);
+        }
+        group->next = 0;
+    }
+    return true;
+}
+
+/// final merge: put the group's next line in the heap, either as a new entry or replacing the top.
+void group_sort(const struct group *group, int index, struct heap *sorter, const struct options *options,
+                bool replace_top) {
+    if (options->order == TIME_MIN) {
+        struct timeval timestamp = group->current->lines[group->next].timestamp;
+        if (replace_top) {
+            heap_replace_top_timestamp(sorter, NULL, timestamp, index);
+        } else {
+            heap_push_timestamp(sorter, timestamp, index);
+        }
+    } else if (options->order == NUMBER_MIN) {
+        double number = group->current->lines[group->next].number;
+        if (replace_top) {
+            heap_replace_top_number(sorter, NULL, number, index);
+        } else {
+            heap_push_number(sorter, number, index);
+        }
+    } else if (replace_top) {
+        heap_replace_top_slice(sorter, NULL, group_key(group), index);
+    } else {
+        heap_push_slice(sorter, group_key(group), index);
+    }
+}
+
+/// final merge: like source_stays()
+bool group_stays(const struct group *group, const struct heap *sorter, const struct options *options,
+                 int runner_up) {
+    if (options->order == TIME_MIN) {
+        return heap_top_stays_timestamp(sorter, runner_up, group->current->lines[group->next].timestamp);
+    } else if (options->order == NUMBER_MIN) {
+        return heap_top_stays_number(sorter, runner_up, group->current->lines[group->next].number);
+    }
+    return heap_top_stays_slice(sorter, runner_up, group_key(group));
+}
+
+/// libtailmerge: what merge_groups() has set up, for stopping the groups and releasing it if the final merge fails
+struct merging_groups {
+    struct group *groups;
+    int length;
+    int started; //< how many of the groups' threads are running
+    struct heap *sorter;
+    struct unique *unique;
+};
+
+void stop_groups(void *arg) {
+    struct merging_groups *merging = arg;
+    for (int g=0; g<merging->started; g++) {
+        // each group fails when sending its next batch, as the merge has failed, and then sends an empty last one
+        struct group *group = &merging->groups[g];
+        while (group->current == NULL || !group->current->is_last) {
+            group->current = spsc_pop(group->merged);
+            spsc_push(group->returned, group->current);
+        }
+        pthread_join(group->thread, NULL);
+    }
+    for (int g=0; g<merging->length; g++) {
+        if (merging->groups[g].merged != NULL) {
+            spsc_destroy(merging->groups[g].merged);
+        }
+        if (merging->groups[g].returned != NULL) {
+            spsc_destroy(merging->groups[g].returned);
+        }
+        for (int b=0; b<GROUP_BATCHES; b++) {
+            free(merging->groups[g].batches[b].bytes);
+            free(merging->groups[g].batches[b].lines);
+        }
+    }
+    free(merging->groups);
+    free(heap_get_memory(merging->sorter));
+    unique_destroy(merging->unique);
+}
+
+/// split the files into groups that are merged on separate threads,
+/// and merge the output of those on this thread, writing to lines.
+/// each group keeps at most max_open of its mapped files open.
+void merge_groups(struct source *sources, int sources_length, int groups_length,
+                  struct lines *lines, const struct options *options, int max_open) {
+    struct group *groups = check_malloc(groups_length * sizeof(struct group));
+    // so that what isn't allocated yet isn't released if failing
+    memset(groups, 0, groups_length * sizeof(struct group));
+    enum heap_type key_type = options->order;
+    struct heap sorter = groups_length >= LOSER_TREE_MIN_SOURCES
+        ? heap_create_loser_tree(key_type, groups_length)
+        : heap_create(key_type, groups_length);
+    struct unique unique = unique_create(options->unique_window);
+    struct merging_groups merging = {
+        .groups = groups,
+        .length = groups_length,
+        .started = 0,
+        .sorter = &sorter,
+        .unique = &unique
+    };
+    on_failure(stop_groups, &merging);
+    for (int g=0; g<groups_length; g++) {
+        // contiguous ranges, so that runs of lines from neighbouring files are more likely to be merged together
+        int first = (int)((long long)sources_length * g / groups_length);
+        int after = (int)((long long)sources_length * (g+1) / groups_length);
+        struct group *group = &groups[g];
+        group->sources = &sources[first];
+        group->first = first;
+        group->sources_length = after - first;
+        group->options = options;
+        group->max_open = max_open;
+        group->merged = spsc_create(GROUP_BATCHES);
+        group->returned = spsc_create(GROUP_BATCHES);
+        if (group->merged == NULL || group->returned == NULL) {
+            checkerr(-1, EX_UNAVAILABLE, "allocate queues");
+        }
+        for (int b=0; b<GROUP_BATCHES; b++) {
+            group->batches[b].bytes = check_malloc(BATCH_BYTES);
+            group->batches[b].bytes_length = 0;
+            group->batches[b].bytes_capacity = BATCH_BYTES;
+            group->batches[b].lines = check_malloc(BATCH_LINES * sizeof(struct batch_line));
+            group->batches[b].length = 0;
+            group->batches[b].is_last = false;
+            spsc_push(group->returned, &group->batches[b]);
+        }
+        group->current = group->exhausted = NULL;
+        group->next = 0;
+        group->exhausted_flushes_needed = group->flushes_needed = 0;
+        errno = pthread_create(&group->thread, NULL, group_merge, group);
+        checkerr(errno != 0 ? -1 : 0, EX_OSERR, "start merging thread");
+        merging.started++;
+    }
+
+    heap_set_memory(&sorter, check_malloc(heap_get_needed_memory(&sorter)));
+    for (int g=0; g<groups_length; g++) {
+        groups[g].current = spsc_pop(groups[g].merged);
+        if (groups[g].current->length != 0) {
+            group_sort(&groups[g], g, &sorter, options, false);
+        }
+    }
+
+    struct written_files written = {.first = -1, .last = -1};
+    while (!heap_is_empty(&sorter)) {
+        int next = heap_peek_value(&sorter);
+        struct group *group = &groups[next];
+        // lines are written until one from another group sorts before it, or until the group ends if it's the last
+        int runner_up = heap_find_runner_up(&sorter);
+        bool have_line;
+        do {
+            do {
+                // a group writes lines from several files, so this is checked for every line
+                int source = group->current->lines[group->next].source;
+                struct iovec line = group_line(group);
+                // only the rest of long lines and missing newlines continue, which a line ending with one never has
+                bool is_complete = ((char*)line.iov_base)[line.iov_len-1] == '\n'
+                    && !group->current->lines[group->next].continues;
+                if (options->unique_window != 0 && is_complete && unique_repeats(&unique, line)) {
+                    have_line = group_advance(group, lines);
+                    continue;
+                }
+                output_line(lines, options->format, &sources[source], source, line,
+                            group->current->lines[group->next].continues, &written);
+                group->flushes_needed = lines->flushes + 1;
+                have_line = group_advance(group, lines);
+            } while (have_line && group->current->lines[group->next].continues);
+        } while (have_line && (runner_up == -1 || group_stays(group, &sorter, options, runner_up)));
+
+        if (have_line) {
+            group_sort(group, next, &sorter, options, true);
+        } else {
+            heap_pop_slice_value(&sorter, NULL);
+        }
+    }
+    lines_flush(lines);
+    forget_on_failure(&merging);
+    unique_destroy(&unique);
+
+    free(heap_get_memory(&sorter));
+    for (int g=0; g<groups_length; g++) {
+        pthread_join(groups[g].thread, NULL);
+        spsc_destroy(groups[g].merged);
+        spsc_destroy(groups[g].returned);
+        for (int b=0; b<GROUP_BATCHES; b++) {
+            free(groups[g].batches[b].bytes);
+            free(groups[g].batches[b].lines);
+        }
+    }
+    free(groups);
+}
+
+
+/// --split=ranges: how many lines to sample per range when choosing the keys to split at
+const int SAMPLES_PER_RANGE = 32;
+
+/// --split=ranges: the lines of all files with keys in a range, which is merged on a separate thread.
+struct range {
+    struct source *sources; //< one for each file, limited to the part in the range
+    int sources_length;
+    const struct options *options; //< borrowed
+    int max_open; //< how many of the files can be open
+    struct lines lines; //< the first range writes to stdout, and the others to temporary files
+    struct written_files written;
+    pthread_t thread;
+};
+
+void* range_merge(void *arg) {
+    struct range *range = arg;
+    // the first range is merged on the thread of the final merge, which already has a catcher
+    bool is_catching = false;
+    struct catcher catching;
+    if (catcher == NULL && catch_failures(&catching, range->options->failure)) {
+        is_catching = true;
+        if (setjmp(catching.jump) != 0) {
+            // merge_ranges() fails when it sees that this has
+            catcher = NULL;
+            return NULL;
+        }
+    }
+    // ranges are limited to mapped files, so there is nothing to follow
+    range->written = merge_sources(range->sources, range->sources_length, NULL, NULL, &range->lines, range->options,
+                                   range->max_open, NULL);
+    if (is_catching) {
+        catcher = NULL;
+    }
+    return NULL;
+}
+
+/// an unnamed file to hold output until what comes before it has been written.
+int create_temporary(void) {
+    const char *directory = getenv("TMPDIR");
+    if (directory == NULL || *directory == '\0') {
+        directory = "/tmp";
+    }
+    char *path = check_malloc(strlen(directory) + sizeof("/tailmerge.XXXXXX"));
+    sprintf(path, "%s/tailmerge.XXXXXX", directory);
+    on_failure(free, path);
+    int fd = checkerr(mkstemp(path), EX_CANTCREAT, "create a temporary file in %s", directory);
+    // it's removed when closed
+    unlink(path);
+    forget_on_failure(path);
+    free(path);
+    return fd;
+}
+
+/// write everything after `offset` in a temporary file to lines.
+void copy_temporary(int fd, off_t offset, struct lines *lines) {
+    lines_flush(lines);
+    checkerr(lseek(fd, offset, SEEK_SET) < 0 ? -1 : 0, EX_IOERR, "seeking in a temporary file");
+    ssize_t copied = copy_by_kernel(fd, lines->fd, -1, false, "a temporary file");
+    if (copied == -1) {
+        copied = copy_by_kernel(fd, lines->fd, -1, true, "a temporary file");
+    }
+    if (copied != -1) {
+        return;
+    }
+    const size_t COPY_BUFFER_SIZE = 1 << 16;
+    char *buffer = check_malloc(COPY_BUFFER_SIZE);
+    on_failure(free, buffer);
+    while (true) {
+        ssize_t read_bytes = read(fd, buffer, COPY_BUFFER_SIZE);
+        if (read_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        checkerr((int)read_bytes, EX_IOERR, "reading from a temporary file");
+        if (read_bytes == 0) {
+            break;
+        }
+        struct iovec chunk = { .iov_base = buffer, .iov_len = read_bytes };
+        lines_add(lines, chunk);
+        lines_flush(lines);
+    }
+    forget_on_failure(buffer);
+    free(buffer);
+}
+
+int compare_samples_by_line(const void *a, const void *b) {
+    return bisect_compare(SLICE_MIN, a, b);
+}
+
+int compare_samples_by_timestamp(const void *a, const void *b) {
+    return bisect_compare(TIME_MIN, a, b);
+}
+
+int compare_samples_by_number(const void *a, const void *b) {
+    return bisect_compare(NUMBER_MIN, a, b);
+}
+
+int compare_samples_by_version(const void *a, const void *b) {
+    return bisect_compare(VERSION_MIN, a, b);
+}
+
+/// --split=ranges: sample up to count lines from the entries of an index that start between begin and
+/// the end of search, instead of reading them. The keys are copied into samples.
+int sample_index(const struct index *index, const struct bisect *search, off_t begin, int count,
+                 struct bisect_key *samples) {
+    long first = 0, last = (long)index->header->entries_length;
+    while (first < last && (off_t)index->entries[first].offset < begin) {
+        first++;
+    }
+    while (last > first && (off_t)index->entries[last-1].offset >= search->size) {
+        last--;
+    }
+    int sampled = 0;
+    for (int n=0; n<count && first < last; n++) {
+        long entry = first + (long)((n + 0.5) * (last - first) / count);
+        // entries are sparser than samples can be, so don't take any twice
+        if ((n != 0 && entry == first + (long)((n - 0.5) * (last - first) / count))
+                || !index_key(index, entry, search, &samples[sampled])) {
+            continue;
+        }
+        char *copy = check_malloc(samples[sampled].line.iov_len);
+        memcpy(copy, samples[sampled].line.iov_base, samples[sampled].line.iov_len);
+        samples[sampled].line.iov_base = copy;
+        sampled++;
+    }
+    return sampled;
+}
+
+/// libtailmerge: what find_ranges() has allocated, for releasing it if it fails
+struct finding_ranges {
+    const struct source *sources;
+    struct bisect *searches;
+    int searches_length; //< how many have been created
+    struct bisect_key *samples; //< NULL until allocated
+    int *samples_length;
+};
+
+void abandon_finding_ranges(void *arg) {
+    struct finding_ranges *finding = arg;
+    for (int i=0; i<finding->searches_length; i++) {
+        if (finding->searches[i].fd != -1) {
+            source_return_fd(&finding->sources[i], &finding->searches[i].fd);
+        }
+        bisect_destroy(&finding->searches[i]);
+    }
+    for (int s=0; s<*finding->samples_length; s++) {
+        free(finding->samples[s].line.iov_base);
+    }
+    free(finding->samples);
+    free(finding->searches);
+}
+
+/// --split=ranges: find where each range starts in each file, by sampling lines at evenly spaced
+/// offsets across all files (or at the entries of their indexes), choosing keys to split at among those, and binary searching for them.
+/// only the part of each file between map_offset and limit (if set) is split,
+/// so that the ranges are balanced after --since and --until.
+/// bounds has ranges_length+1 offsets per file, of which the last is the limit.
+void find_ranges(struct source *sources, int sources_length, int ranges_length, const struct options *options,
+                 off_t *bounds) {
+    struct bisect *searches = check_malloc(sources_length * sizeof(struct bisect));
+    int samples_length = 0;
+    struct finding_ranges finding = {
+        .sources = sources,
+        .searches = searches,
+        .searches_length = 0,
+        .samples = NULL,
+        .samples_length = &samples_length
+    };
+    on_failure(abandon_finding_ranges, &finding);
+    off_t total_size = 0;
+    for (int i=0; i<sources_length; i++) {
+        int fd = source_borrow_fd(&sources[i]);
+        struct stat info;
+        checkerr(fstat(fd, &info), EX_IOERR, "getting size of %s", sources[i].path);
+        off_t end = sources[i].limit != -1 && sources[i].limit < info.st_size ? sources[i].limit : info.st_size;
+        searches[i] = bisect_create(fd, end, &options->key, options->order, options->timestamp_format);
+        finding.searches_length++;
+        total_size += end - sources[i].map_offset;
+        source_return_fd(&sources[i], &searches[i].fd);
+    }
+
+    // sample more of bigger files, so that ranges contain about the same number of bytes
+    int samples_capacity = ranges_length * SAMPLES_PER_RANGE + sources_length;
+    struct bisect_key *samples = finding.samples = check_malloc(samples_capacity * sizeof(struct bisect_key));
+    for (int i=0; i<sources_length && total_size > 0; i++) {
+        off_t begin = sources[i].map_offset, size = searches[i].size - begin;
+        int count = (int)((double)size / total_size * ranges_length * SAMPLES_PER_RANGE);
+        if (sources[i].index != NULL) {
+            samples_length += sample_index(sources[i].index, &searches[i], begin, count, &samples[samples_length]);
+            continue;
+        }
+        searches[i].fd = source_borrow_fd(&sources[i]);
+        for (int n=0; n<count; n++) {
+            struct bisect_key key;
+            off_t start = bisect_line_at(&searches[i], begin + (off_t)((n + 0.5) * size / count), &key);
+            checkerr(start < 0 ? -1 : 0, EX_IOERR, "reading from %s", sources[i].path);
+            if (start == searches[i].size) {
+                continue;
+            }
+            // the line is overwritten by the next read
+            char *copy = check_malloc(key.line.iov_len);
+            memcpy(copy, key.line.iov_base, key.line.iov_len);
+            key.line.iov_base = copy;
+            samples[samples_length++] = key;
+        }
+        source_return_fd(&sources[i], &searches[i].fd);
+    }
+    qsort(samples, samples_length, sizeof(struct bisect_key),
+          options->order == TIME_MIN ? compare_samples_by_timestamp
+          : options->order == NUMBER_MIN ? compare_samples_by_number
+          : options->order == VERSION_MIN ? compare_samples_by_version
+          : compare_samples_by_line);
+
+    for (int i=0; i<sources_length; i++) {
+        off_t *file_bounds = &bounds[i * (ranges_length + 1)];
+        file_bounds[0] = sources[i].map_offset;
+        searches[i].fd = source_borrow_fd(&sources[i]);
+        for (int r=1; r<ranges_length; r++) {
+            if (samples_length == 0) {
+                // too little to split, so the first range gets everything
+                file_bounds[r] = searches[i].size;
+                continue;
+            }
+            // every range ends after the lines equal to the key it's split at
+            const struct bisect_key *split = &samples[(long long)r * samples_length / ranges_length];
+            file_bounds[r] = source_find(&sources[i], &searches[i], split, false);
+            checkerr(file_bounds[r] < 0 ? -1 : 0, EX_IOERR, "reading from %s", sources[i].path);
+            if (file_bounds[r] < file_bounds[0]) {
+                // not sorted
+                file_bounds[r] = file_bounds[0];
+            }
+        }
+        file_bounds[ranges_length] = sources[i].limit;
+        source_return_fd(&sources[i], &searches[i].fd);
+        bisect_destroy(&searches[i]);
+    }
+    forget_on_failure(&finding);
+    for (int s=0; s<samples_length; s++) {
+        free(samples[s].line.iov_base);
+    }
+    free(samples);
+    free(searches);
+}
+/// close the temporary file of a range after the first, and destroy its files.
+void range_destroy(struct range *range) {
+    if (range->lines.fd != -1) {
+        close(range->lines.fd);
+        range->lines.fd = -1;
+    }
+    lines_destroy(&range->lines);
+    for (int i=0; i<range->sources_length; i++) {
+        source_destroy(&range->sources[i]);
+    }
+    single_free((void**)&range->sources);
+    range->sources_length = 0;
+}
+
+/// libtailmerge: what merge_ranges() has set up, for stopping the ranges and releasing it if the merge fails
+struct merging_ranges {
+    struct range *ranges;
+    int length; //< how many are set up, or being set up
+    int started; //< how many of the ranges after the first one have had their thread started
+    int joined; //< how many of those have been joined
+    off_t *bounds;
+    struct lines *lines; //< the output, until the first range has given back its copy of it
+};
+
+void stop_ranges(void *arg) {
+    struct merging_ranges *merging = arg;
+    // each range fails when writing the next time, as the merge has failed
+    for (int r=merging->joined+1; r<=merging->started; r++) {
+        pthread_join(merging->ranges[r].thread, NULL);
+    }
+    if (merging->lines != NULL && merging->length != 0) {
+        *merging->lines = merging->ranges[0].lines;
+    }
+    for (int r=1; r<merging->length; r++) {
+        range_destroy(&merging->ranges[r]);
+    }
+    free(merging->ranges);
+    free(merging->bounds);
+}
+
+/// --split=ranges: merge each range of keys on a separate thread, and then write their output in order.
+/// Only works for regular uncompressed files, which also need to be sorted for the output to be.
+/// each range keeps at most max_open files open.
+void merge_ranges(struct source *sources, int sources_length, int ranges_length,
+                  struct lines *lines, const struct options *options, int max_open) {
+    for (int i=0; i<sources_length; i++) {
+        if (!sources[i].is_regular || sources[i].decompressor != NULL) {
+            fail(EX_USAGE, "--split=ranges can't be used with %s, which isn't an uncompressed regular file",
+                 sources[i].path);
+        }
+    }
+    struct merging_ranges merging = {
+        .ranges = NULL,
+        .length = 0,
+        .started = 0,
+        .joined = 0,
+        .bounds = NULL,
+        .lines = lines
+    };
+    on_failure(stop_ranges, &merging);
+    off_t *bounds = merging.bounds = check_malloc(sources_length * (ranges_length + 1) * sizeof(off_t));
+    find_ranges(sources, sources_length, ranges_length, options, bounds);
+
+    struct range *ranges = merging.ranges = check_malloc(ranges_length * sizeof(struct range));
+    for (int r=0; r<ranges_length; r++) {
+        struct range *range = &ranges[r];
+        // the files are already open for the first range
+        range->sources = r == 0 ? sources : NULL;
+        range->sources_length = r == 0 ? sources_length : 0;
+        range->options = options;
+        range->max_open = max_open;
+        range->lines = r == 0 ? *lines : lines_create(-1, 1024, options->batch_bytes, NULL);
+        merging.length++;
+        if (r != 0) {
+            range->sources = check_malloc(sources_length * sizeof(struct source));
+            range->lines.fd = create_temporary();
+        }
+        // the files of the other ranges are parked right away if there are too many
+        struct source_pool opening = pool_create(NULL, 0, max_open);
+        for (int i=0; i<sources_length; i++) {
+            if (r != 0) {
+                range->sources[i] = source_create(sources[i].path, options->buffer_size, false, NULL);
+                range->sources_length++;
+                range->sources[i].before_since = sources[i].before_since;
+                range->sources[i].map_window = sources[i].map_window;
+            }
+            // source_map() starts at the offset of the first line, unless the file was empty when opened
+            off_t *file_bounds = &bounds[i * (ranges_length + 1)];
+            range->sources[i].map_offset = range->sources[i].resume_offset = file_bounds[r];
+            range->sources[i].limit = file_bounds[r+1];
+            if (!range->sources[i].is_mapped && r != ranges_length - 1) {
+                // empty when opened, so anything written since is after the last key
+                range->sources[i].at_eof = true;
+            }
+            opening.open += range->sources[i].is_mapped && !range->sources[i].is_parked;
+            pool_release(&opening, &range->sources[i], &range->lines, false);
+        }
+        if (r != 0) {
+            errno = pthread_create(&range->thread, NULL, range_merge, range);
+            checkerr(errno != 0 ? -1 : 0, EX_OSERR, "start merging thread");
+            merging.started++;
+        }
+    }
+    free(bounds);
+    merging.bounds = NULL;
+
+    range_merge(&ranges[0]);
+    *lines = ranges[0].lines;
+    merging.lines = NULL;
+    int last = ranges[0].written.last;
+    for (int r=1; r<ranges_length; r++) {
+        pthread_join(ranges[r].thread, NULL);
+        merging.joined++;
+        // libtailmerge: the range might have stopped early because it failed
+        stop_if_failed();
+        struct written_files written = ranges[r].written;
+        if (written.first != -1) {
+            // with headers it starts with one without the newline before it, as if it's the start of the output
+            off_t skip = 0;
+            if (options->format != FORMAT_HEADERS) {
+                // the other formats don't depend on what was written before
+            } else if (written.first == last) {
+                skip = sources[last].header_length - 1;
+            } else if (last != -1) {
+                lines_add(lines, NEWLINE);
+            }
+            copy_temporary(ranges[r].lines.fd, skip, lines);
+            last = written.last;
+        }
+        range_destroy(&ranges[r]);
+    }
+    forget_on_failure(&merging);
+    free(ranges);
+}
+
+
+/// file descriptors to leave for other things than the files, such as reading ahead and --follow,
+/// in addition to one temporary file per job
+const int RESERVED_FDS = 32;
+/// the least of a regular file --memory can result in mapping at a time
+const size_t MIN_MAP_WINDOW = 64 << 10;
+
+/// the default for --max-open: raise the limit on file descriptors as far as allowed,
+/// and use what isn't reserved for other things.
+int default_max_open(const struct options *options) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        return INT_MAX;
+    }
+    if (limit.rlim_cur < limit.rlim_max) {
+        struct rlimit raised = {.rlim_cur = limit.rlim_max, .rlim_max = limit.rlim_max};
+        if (setrlimit(RLIMIT_NOFILE, &raised) == 0) {
+            limit = raised;
+        }
+    }
+    if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > INT_MAX) {
+        return INT_MAX;
+    }
+    int available = (int)limit.rlim_cur - RESERVED_FDS - options->jobs;
+    return available > 1 ? available : 1;
+}
+
+/// --memory: divide it between the files that can be open at a time.
+void sizes_for_memory(const struct options *options, int open_files, int *buffer_size, size_t *map_window) {
+    if (options->memory == 0) {
+        return;
+    }
+    size_t per_file = options->memory / open_files;
+    if (per_file / MAX_SOURCE_BUFFERS < (size_t)*buffer_size) {
+        *buffer_size = per_file / MAX_SOURCE_BUFFERS > (size_t)MIN_BUFFER_SIZE
+            ? (int)(per_file / MAX_SOURCE_BUFFERS)
+            : MIN_BUFFER_SIZE;
+    }
+    per_file -= per_file % sysconf(_SC_PAGESIZE);
+    if (per_file < *map_window) {
+        *map_window = per_file > MIN_MAP_WINDOW ? per_file : MIN_MAP_WINDOW;
+    }
+}
+
+/// what the merge is set up with, for releasing it afterwards or if the merge fails
+struct setup {
+    struct options *options;
+    struct arena *arena; //< NULL until created
+    struct source *sources; //< NULL until allocated
+    int sources_created;
+    struct index *indexes; //< for the sources that have one
+    struct follow *follower;
+    unsigned int *events;
+    struct lines *lines; //< NULL until created
+    struct saved_state *saved;
+    struct file_state *merged;
+    int merged_length;
+};
+
+void release_setup(void *arg) {
+    struct setup *setup = arg;
+    for (int i=0; i<setup->merged_length; i++) {
+        file_state_destroy(&setup->merged[i]);
+    }
+    free(setup->merged);
+    if (setup->saved != NULL) {
+        state_destroy(setup->saved);
+    }
+    if (setup->lines != NULL) {
+        lines_destroy(setup->lines);
+    }
+    if (setup->follower != NULL) {
+        follow_destroy(setup->follower);
+    }
+    if (setup->events != NULL) {
+        arena_free(setup->arena, setup->events);
+    }
+    for (int i=0; i<setup->sources_created; i++) {
+        if (setup->sources[i].index != NULL) {
+            index_close(&setup->indexes[i]);
+        }
+        source_destroy(&setup->sources[i]);
+    }
+    free(setup->indexes);
+    if (setup->sources != NULL) {
+        arena_free(setup->arena, setup->sources);
+    }
+    if (setup->arena != NULL) {
+        arena_destroy(setup->arena);
+    }
+    key_spec_destroy(&setup->options->key);
+}
+
+/// merge like the program, but with the output passed to output unless that is NULL,
+/// and with failure set for libtailmerge.
+int merge_main(int argc, char **argv, tailmerge_output output, void *opaque, struct failure *failure) {
+    int files;
+    struct options options = parse_args(argc, argv, &files);
+    options.failure = failure;
+    struct setup setup = {
+        .options = &options,
+        .arena = NULL,
+        .sources = NULL,
+        .sources_created = 0,
+        .indexes = NULL,
+        .follower = NULL,
+        .events = NULL,
+        .lines = NULL,
+        .saved = NULL,
+        .merged = NULL,
+        .merged_length = 0
+    };
+    on_failure(release_setup, &setup);
+    char **paths = &argv[files];
+    int sources_length = argc - files;
+    if (options.index_every != 0) {
+        for (int i=0; i<sources_length; i++) {
+            checkerr(index_build(paths[i], options.index_every), EX_IOERR, "index %s", paths[i]);
+        }
+        forget_on_failure(&setup);
+        release_setup(&setup);
+        return EX_OK;
+    }
+    if (options.stats) {
+        stats_init(sources_length, paths);
+#ifndef TAILMERGE_LIBRARY
+        // a library shouldn't take over signals from the program using it
+        stats_print_on_signal(SIGUSR1);
+#endif
+    }
+    int groups_length = sources_length / MIN_GROUP_SOURCES;
+    if (groups_length > options.jobs) {
+        groups_length = options.jobs;
+    }
+    // each merging thread gets the same share of the files that can be open
+    int merges = options.split_ranges && options.jobs > 1 ? options.jobs : groups_length > 1 ? groups_length : 1;
+    int max_open = options.max_open != 0 ? options.max_open : default_max_open(&options);
+    int buffer_size = options.buffer_size;
+    size_t map_window = MAP_WINDOW;
+    sizes_for_memory(&options, sources_length < max_open ? sources_length : max_open, &buffer_size, &map_window);
+
+    // what is allocated for every file is allocated together, which only uses memory for
+    // the buffers of files that turn out to not be mapped
+    size_t arena_size = arena_needed(sources_length * sizeof(struct source))
+        + arena_needed(sources_length * sizeof(unsigned int))
+        + arena_needed(1024 * sizeof(struct iovec));
+    struct heap sizing = heap_create_loser_tree(options.order, sources_length);
+    arena_size += arena_needed(heap_get_needed_memory(&sizing));
+    for (int i=0; i<sources_length; i++) {
+        arena_size += arena_needed(strlen(MARKER) + strlen(paths[i]) + 2)
+            + 2 * arena_needed_for_buffer(buffer_size);
+    }
+    struct arena arena = arena_create(arena_size);
+    setup.arena = &arena;
+
+    struct source *sources = setup.sources = check_allocate(&arena, sources_length * sizeof(struct source), false);
+
+    struct follow *follower = NULL;
+    unsigned int *events = NULL;
+    if (options.follow) {
+        follower = setup.follower = follow_create(sources_length);
+        if (follower == NULL) {
+            checkerr(-1, EX_UNAVAILABLE, "set up following files");
+        }
+        events = setup.events = check_allocate(&arena, sources_length * sizeof(unsigned int), false);
+    }
+    struct lines lines = lines_create(output != NULL ? -1 : STDOUT_FILENO, 1024, options.batch_bytes, &arena);
+    lines.output = output;
+    lines.output_opaque = opaque;
+    setup.lines = &lines;
+    struct saved_state saved = {.files = NULL, .length = 0};
+    struct file_state *merged = NULL;
+    if (options.state_path != NULL) {
+        setup.saved = &saved;
+        checkerr(state_load(options.state_path, &saved), EX_DATAERR, "reading state from %s", options.state_path);
+        merged = setup.merged = check_malloc(sources_length * sizeof(struct file_state));
+        // so that those of files not reached yet can be destroyed if failing
+        memset(merged, 0, sources_length * sizeof(struct file_state));
+        setup.merged_length = sources_length;
+    }
+    // only opened when they would be used
+    struct index *indexes = NULL;
+    if (options.has_since || options.has_until || (options.split_ranges && options.jobs > 1)) {
+        indexes = setup.indexes = check_malloc(sources_length * sizeof(struct index));
+    }
+    // files that can't be parked take from what the others can use
+    struct source_pool opening = pool_create(NULL, 0, max_open / merges > 1 ? max_open / merges : 1);
+    int unparkable = 0;
+    for (int i=0; i<sources_length; i++) {
+        sources[i] = source_create(paths[i], buffer_size, options.follow, &arena);
+        setup.sources_created++;
+        sources[i].map_window = map_window;
+        sources[i].before_since = options.has_since;
+        if (indexes != NULL && sources[i].is_regular
+                && index_open(&indexes[i], paths[i], sources[i].fd, sources[i].decompressor != NULL)) {
+            sources[i].index = &indexes[i];
+        }
+        source_bisect(&sources[i], &options);
+        if (merged != NULL) {
+            source_continue_from_state(&sources[i], &saved, &options, &merged[i]);
+        }
+        // start watching before reading, so that nothing written in between is missed
+        if (follower != NULL && !(sources[i].is_regular
+                ? follow_file(follower, i, paths[i])
+                : follow_fd(follower, i, sources[i].fd))) {
+            checkerr(-1, EX_UNAVAILABLE, "watching %s", paths[i]);
+        }
+        if (!sources[i].is_mapped) {
+            unparkable++;
+            opening.max_open = (max_open - unparkable) / merges > 1 ? (max_open - unparkable) / merges : 1;
+        }
+        opening.open += sources[i].is_mapped;
+        pool_release(&opening, &sources[i], &lines, false);
+    }
+    // --memory also limits how much buffers can grow, after what they start with
+    size_t initial_buffers = (size_t)unparkable * MAX_SOURCE_BUFFERS * buffer_size;
+    struct buffer_budget budget = {
+        .limit = options.memory == 0 ? DEFAULT_GROWTH_BUDGET
+            : options.memory > initial_buffers ? options.memory - initial_buffers
+            : 0,
+        .initial = buffer_size
+    };
+    atomic_init(&budget.grown, 0);
+    for (int i=0; i<sources_length; i++) {
+        if (!sources[i].is_mapped) {
+            sources[i].budget = &budget;
+        }
+    }
+    if (options.split_ranges && options.jobs > 1) {
+        merge_ranges(sources, sources_length, options.jobs, &lines, &options, opening.max_open);
+    } else if (groups_length > 1) {
+        merge_groups(sources, sources_length, groups_length, &lines, &options, opening.max_open);
+    } else {
+        merge_sources(sources, sources_length, follower, events, &lines, &options, opening.max_open, &arena);
+    }
+
+    if (merged != NULL) {
+        // everything has been written, so the next run can start after it
+        lines_flush(&lines);
+        // files that weren't given this time continue from where they were when they are again
+        for (int i=0; i<sources_length; i++) {
+            state_forget(&saved, paths[i]);
+        }
+        checkerr(state_save(options.state_path, merged, sources_length, &saved), EX_CANTCREAT,
+                 "saving state to %s", options.state_path);
+    }
+
+    forget_on_failure(&setup);
+    release_setup(&setup);
+    if (options.stats) {
+        stats_print(STDERR_FILENO);
+    }
+#if defined(HEAP_COUNT_COMPARISONS) && !defined(TAILMERGE_STATS)
+    // for `make bench`
+    fprintf(stderr, "comparisons: %llu\n", heap_comparisons());
+#endif
+
+    return EX_OK;
+}
+
+/// set where this thread continues if the merge fails, and let everything else know to fail there.
+void merge_catching(int argc, char **argv, tailmerge_output output, void *opaque, struct failure *failure) {
+    struct catcher catching;
+    catch_failures(&catching, failure);
+    if (setjmp(catching.jump) == 0) {
+        merge_main(argc, argv, output, opaque, failure);
+    }
+    catcher = NULL;
+}
+
+int tailmerge_run(int argc, char **argv, tailmerge_output output, tailmerge_error error, void *opaque) {
+    struct failure failure = {.error = error, .opaque = opaque};
+    atomic_init(&failure.status, -1);
+    merge_catching(argc, argv, output, opaque, &failure);
+    int status = atomic_load(&failure.status);
+    return status != -1 ? status : EX_OK;
+}
+
+#ifndef TAILMERGE_LIBRARY
+int main(int argc, char **argv) {
+    return merge_main(argc, argv, NULL, NULL, NULL);
 }
+#endif
@@ -3,51 +3,67 @@ set -e
 
 # This script can be ran from `make test`
 
+# test ordering with both layouts, which only differ in the order of equal entries
+assert_both() {
+    ./test_heap assert "$@"
+    ./test_heap --loser-tree assert "$@"
+}
+
+# the benchmark must at least run, with every backend and workload
+./test_heap bench 1000 1,2,3,64 > /dev/null
+
 # empty or no values
-./test_heap assert '' '' '' 0
-./test_heap assert , '' 1 1
+assert_both '' '' '' 0
+assert_both , '' 1 1
 
 # 1-4
-./test_heap assert = = 1 1
-./test_heap assert x,y, x,y 1,2 2
-./test_heap assert y,x, x,y 2,1 2
-./test_heap assert x,y,z x,y,z 1,2,3 3
-./test_heap assert x,z,y x,y,z 1,3,2 3
-./test_heap assert y,x,z x,y,z 2,1,3 3
-./test_heap assert y,z,x x,y,z 3,1,2 3
-./test_heap assert z,x,y x,y,z 2,3,1 3
-./test_heap assert z,y,x x,y,z 3,2,1 3
-./test_heap assert a,b,c,d a,b,c,d 1,2,3,4 4
-./test_heap assert d,c,b,a a,b,c,d 4,3,2,1 4
-./test_heap assert a,b,c,d,e a,b,c,d,e 1,2,3,4,5 5
-./test_heap assert a,b,c,d,e,f a,b,c,d,e,f 1,2,3,4,5,6 6
-./test_heap assert a,b,c,d,e,f,g a,b,c,d,e,f,g 1,2,3,4,5,6,7 7
-./test_heap assert a,b,c,d,e,f,g,h a,b,c,d,e,f,g,h 1,2,3,4,5,6,7,8 8
-./test_heap assert a,b,c,d,e,f,g,h,i a,b,c,d,e,f,g,h,i 1,2,3,4,5,6,7,8,9 9
-./test_heap assert "$(seq 0 9 )" "$(seq 0 9)" "$(seq 1 10)"
-./test_heap assert "$(seq 0 9 | tac)" "$(seq 0 9)"
+assert_both = = 1 1
+assert_both x,y, x,y 1,2 2
+assert_both y,x, x,y 2,1 2
+assert_both x,y,z x,y,z 1,2,3 3
+assert_both x,z,y x,y,z 1,3,2 3
+assert_both y,x,z x,y,z 2,1,3 3
+assert_both y,z,x x,y,z 3,1,2 3
+assert_both z,x,y x,y,z 2,3,1 3
+assert_both z,y,x x,y,z 3,2,1 3
+assert_both a,b,c,d a,b,c,d 1,2,3,4 4
+assert_both d,c,b,a a,b,c,d 4,3,2,1 4
+assert_both a,b,c,d,e a,b,c,d,e 1,2,3,4,5 5
+assert_both a,b,c,d,e,f a,b,c,d,e,f 1,2,3,4,5,6 6
+assert_both a,b,c,d,e,f,g a,b,c,d,e,f,g 1,2,3,4,5,6,7 7
+assert_both a,b,c,d,e,f,g,h a,b,c,d,e,f,g,h 1,2,3,4,5,6,7,8 8
+assert_both a,b,c,d,e,f,g,h,i a,b,c,d,e,f,g,h,i 1,2,3,4,5,6,7,8,9 9
+assert_both "$(seq 0 9 )" "$(seq 0 9)" "$(seq 1 10)"
+assert_both "$(seq 0 9 | tac)" "$(seq 0 9)"
 
 # different length
-./test_heap assert app,apple,applejuice app,apple,applejuice 1,2,3
-./test_heap assert app,applejuice,apple app,apple,applejuice 1,3,2
-./test_heap assert applejuice,apple,app app,apple,applejuice 3,2,1
-./test_heap assert applejuice,app,apple app,apple,applejuice 2,3,1
-./test_heap assert e,ef,eff,effe,effer,efferv,efferve,efferves,effervesc,effervesce,effervescen,effervescent \
+assert_both app,apple,applejuice app,apple,applejuice 1,2,3
+assert_both app,applejuice,apple app,apple,applejuice 1,3,2
+assert_both applejuice,apple,app app,apple,applejuice 3,2,1
+assert_both applejuice,app,apple app,apple,applejuice 2,3,1
+assert_both e,ef,eff,effe,effer,efferv,efferve,efferves,effervesc,effervesce,effervescen,effervescent \
                    e,ef,eff,effe,effer,efferv,efferve,efferves,effervesc,effervesce,effervescen,effervescent
-./test_heap assert effervescent,effervescen,effervesce,effervesc,efferves,efferve,efferv,effer,effe,eff,ef,e \
+assert_both effervescent,effervescen,effervesce,effervesc,efferves,efferve,efferv,effer,effe,eff,ef,e \
                    e,ef,eff,effe,effer,efferv,efferve,efferves,effervesc,effervesce,effervescen,effervescent
-./test_heap assert efferv,effer,effe,eff,ef,e,effervescent,effervescen,effervesce,effervesc,efferves,efferve \
+assert_both efferv,effer,effe,eff,ef,e,effervescent,effervescen,effervesce,effervesc,efferves,efferve \
                    e,ef,eff,effe,effer,efferv,efferve,efferves,effervesc,effervesce,effervescen,effervescent
 
+# equal or shorter than the cached prefix
+assert_both abcdefgh,abcdefg,abcdefghi abcdefg,abcdefgh,abcdefghi 2,1,3
+assert_both 2022/06/01T10:00:01,2022/06/01T09:59:59,2022/06/01T10:00:00 \
+            2022/06/01T09:59:59,2022/06/01T10:00:00,2022/06/01T10:00:01 2,3,1
+# bytes are compared as unsigned
+assert_both "$(printf '\xe6'),z,$(printf 'abcdefgh\xe6'),abcdefghz" "abcdefghz,abcdefgh$(printf '\xe6'),z,$(printf '\xe6')" 4,3,2,1
+
 # long
 if [ -f /usr/share/dict/words ]; then
-    ./test_heap assert "$(tail +50 /usr/share/dict/words | head -30)" \
+    assert_both "$(tail +50 /usr/share/dict/words | head -30)" \
                        "$(tail +50 /usr/share/dict/words | head -30)"
-    ./test_heap assert "$(tail +50 /usr/share/dict/words | head -30 | tac)" \
+    assert_both "$(tail +50 /usr/share/dict/words | head -30 | tac)" \
                        "$(tail +50 /usr/share/dict/words | head -30)"
-    ./test_heap assert "$(tail +50 /usr/share/dict/words | head -30 | shuf)" \
+    assert_both "$(tail +50 /usr/share/dict/words | head -30 | shuf)" \
                        "$(tail +50 /usr/share/dict/words | head -30)"
-    ./test_heap assert "$(tail +50 /usr/share/dict/words | head -30 | shuf)" \
+    assert_both "$(tail +50 /usr/share/dict/words | head -30 | shuf)" \
                        "$(tail +50 /usr/share/dict/words | head -30)"
 fi
 
@@ -62,8 +78,420 @@ fi
 ./test_heap assert bar,bar,foo bar,bar,foo 2,1,3 3
 
 # pop then push
-./test_heap assert d-c-b-a d,c,b,a 1,2,3,4 4
-./test_heap assert u,x-y,w--a,b u,w,x,a,b,y 1,4,2,5,6,3 6
+assert_both d-c-b-a d,c,b,a 1,2,3,4 4
+assert_both u,x-y,w--a,b u,w,x,a,b,y 1,4,2,5,6,3 6
+
+# replace top
+assert_both a,c+b a,b,c 1,3,2 3
+assert_both x,y,z+ x,y,z 1,2,3 3
+assert_both a,b+c+d+e+f a,b,c,d,e,f 1,2,3,4,5,6 6
+assert_both z,y,x,w+v+u+t+s x,w,v,u,s,t,y,z 3,4,5,6,8,7,2,1 8
+assert_both b,d,f,h,j,l,n,p,r,t+c+e+g+i+k+a b,d,c,e,f,g,a,h,i,j,k,l,n,p,r,t \
+            1,2,11,12,3,13,16,4,14,5,15,6,7,8,9,10 16
+# replacing with equal entries, which must agree with finding the runner-up
+assert_both b,b+b+a+a+c b,b,b,a,a,c 1,2,3,4,5,6 6
+./test_heap --loser-tree assert b,a,c,a+a+a+b+ a,a,a,a,b,b,c 2,4,5,6,1,7,3 7
+./test_heap --loser-tree assert a,b,c,d,e,f,g,h,a+a+a+b+b+c+ a,a,a,a,b,b,b,c,c,d,e,f,g,h \
+                                1,9,10,11,12,13,2,14,3,4,5,6,7,8 14
 
 # pop-then-push stability
 ./test_heap assert d,b-d,e--b-a b,d,d,b,a,e 2,3,1,5,6,4 6
+
+# loser tree stability: equal entries are popped in the order of the leaves they were put in,
+# which is the order they were pushed unless entries have been popped in between
+./test_heap --loser-tree assert ,, ,, 1,2 2
+./test_heap --loser-tree assert foo,foo foo,foo 1,2 2
+./test_heap --loser-tree assert foo,foo,bar bar,foo,foo 3,1,2 3
+./test_heap --loser-tree assert foo,bar,foo bar,foo,foo 2,1,3 3
+./test_heap --loser-tree assert bar,foo,foo bar,foo,foo 1,2,3 3
+./test_heap --loser-tree assert foo,bar,bar bar,bar,foo 2,3,1 3
+./test_heap --loser-tree assert bar,foo,bar bar,bar,foo 1,3,2 3
+./test_heap --loser-tree assert bar,bar,foo bar,bar,foo 1,2,3 3
+./test_heap --loser-tree assert d,b-d,e--b-a b,d,d,b,a,e 2,1,3,5,6,4 6
+
+# tailmerge
+dir="$(mktemp -d)"
+trap 'rm -r "$dir"' EXIT
+# compare the output of tailmerge with the given arguments to stdin
+assert_merge() {
+    diff -u - <(./tailmerge "$@")
+    echo "Merging $* PASSED"
+}
+
+seq 1 6 > "$dir/foo.lst"
+seq 4 9 > "$dir/bar.lst"
+printf '>>> %s\n1\n2\n3\n4\n\n>>> %s\n4\n5\n\n>>> %s\n5\n6\n\n>>> %s\n6\n7\n8\n9\n' \
+       "$dir/foo.lst" "$dir/bar.lst" "$dir/foo.lst" "$dir/bar.lst" \
+       | assert_merge "$dir/foo.lst" "$dir/bar.lst"
+
+# dropping repeated lines, also when they are from different files
+printf '1\n2\n2\n4\n' > "$dir/a.lst"
+printf '2\n3\n4\n' > "$dir/b.lst"
+printf '2\n5\n' > "$dir/c.lst"
+printf '5\n6\n' > "$dir/d.lst"
+for args in '-u' '-u -j 2'; do
+    printf '>>> %s\n1\n2\n\n>>> %s\n3\n4\n\n>>> %s\n5\n\n>>> %s\n6\n' \
+           "$dir/a.lst" "$dir/b.lst" "$dir/c.lst" "$dir/d.lst" \
+        | assert_merge $args "$dir/a.lst" "$dir/b.lst" "$dir/c.lst" "$dir/d.lst"
+done
+printf 'a\nb\na\nc\n' > "$dir/a.lst"
+printf '>>> %s\na\nb\nc\n' "$dir/a.lst" | assert_merge --unique=2 "$dir/a.lst" /dev/null
+# a missing newline at the end of a file doesn't make the line differ
+printf '1\n2' > "$dir/a.lst"
+printf '2\n3' > "$dir/b.lst"
+printf '2\n' > "$dir/c.lst"
+printf '3\n4\n' > "$dir/d.lst"
+for args in '-u' '-u -j 2'; do
+    ./tailmerge $args "$dir/a.lst" <(cat "$dir/b.lst") "$dir/c.lst" "$dir/d.lst" | grep -v -e '^>>> ' -e '^$' \
+        | diff -u <(printf '1\n2\n3\n4\n') -
+    echo "Dropping repeated lines without a newline with $args PASSED"
+done
+
+# output formats without headers, also from the last file and when it doesn't end with a newline
+printf '1\n3 "q"\\\n' > "$dir/a.lst"
+printf '2\t\n4' > "$dir/b.lst"
+for args in '' '-j 2' '-j 2 --split=ranges'; do
+    printf '1\n2\t\n3 "q"\\\n4\n' | assert_merge --format=plain $args "$dir/a.lst" "$dir/b.lst"
+    printf '0\t1\n1\t2\t\n0\t3 "q"\\\n1\t4\n' | assert_merge --format=tagged $args "$dir/a.lst" "$dir/b.lst"
+    printf '{"source":0,"line":"1"}\n{"source":1,"line":"2\\t"}\n{"source":0,"line":"3 \\"q\\"\\\\"}\n{"source":1,"line":"4"}\n' \
+        | assert_merge --format=ndjson $args "$dir/a.lst" "$dir/b.lst"
+    printf '\x01\0\0\0\0\0\0\x001\x02\0\0\0\x01\0\0\x002\t\x06\0\0\0\0\0\0\x003 "q"\\\x01\0\0\0\x01\0\0\x004' \
+        | assert_merge --format=binary $args "$dir/a.lst" "$dir/b.lst"
+done
+if ./tailmerge --format=xml "$dir/a.lst" 2> /dev/null; then
+    echo "--format=xml was accepted"
+    exit 1
+fi
+
+# the counters are only in their own build, which `make test` creates.
+# tagged output prevents the kernel from copying the end of the last file, which isn't counted as lines
+if [[ -x ./tailmerge_stats ]]; then
+    ./tailmerge_stats --stats --format=tagged "$dir/a.lst" "$dir/b.lst" 2>&1 > /dev/null \
+        | grep -E '^(lines from|truncated)' \
+        | diff -u <(printf 'truncated lines: 0\nlines from %s: 2\nlines from %s: 2\n' "$dir/a.lst" "$dir/b.lst") -
+    echo "Counting with --stats PASSED"
+fi
+
+# continuing where the last run stopped, but not in a different file or after a line that might be unfinished
+rm -f "$dir/state"
+printf '1\n3\n' > "$dir/a.lst"
+printf '2\n4\npart' > "$dir/b.lst"
+printf '1\n2\n3\n4\n' | assert_merge --format=plain --state="$dir/state" "$dir/a.lst" "$dir/b.lst"
+printf '5\n' >> "$dir/a.lst"
+printf 'ial\n6\n' >> "$dir/b.lst"
+printf '5\npartial\n6\n' | assert_merge --format=plain --state="$dir/state" "$dir/a.lst" "$dir/b.lst"
+assert_merge --format=plain --state="$dir/state" -j 2 --split=ranges "$dir/a.lst" "$dir/b.lst" < /dev/null
+printf '0\n7\n' > "$dir/new.lst"
+mv "$dir/new.lst" "$dir/a.lst"
+printf '0\n7\n' | assert_merge --format=plain --state="$dir/state" "$dir/a.lst" "$dir/b.lst"
+# files that aren't given to a run are continued from where the run before it stopped
+printf '8\n' >> "$dir/a.lst"
+printf '9\n' >> "$dir/b.lst"
+printf '8\n' | assert_merge --format=plain --state="$dir/state" "$dir/a.lst"
+printf '9\n' | assert_merge --format=plain --state="$dir/state" "$dir/a.lst" "$dir/b.lst"
+echo garbage > "$dir/state"
+if ./tailmerge --state="$dir/state" "$dir/a.lst" > /dev/null 2>&1; then
+    echo "An invalid --state was accepted"
+    exit 1
+fi
+
+# timestamps
+printf '2022-06-01T10:00:00+02:00 a\n  continued\n2022-06-01T10:00:02.5+02:00 a\n' > "$dir/a.log"
+printf '2022-06-01T08:00:01Z b\n2022-06-01 08:00:02.25 b\n' > "$dir/b.log"
+printf '>>> %s\n%s\n%s\n\n>>> %s\n%s\n%s\n\n>>> %s\n%s\n' \
+       "$dir/a.log" '2022-06-01T10:00:00+02:00 a' '  continued' \
+       "$dir/b.log" '2022-06-01T08:00:01Z b' '2022-06-01 08:00:02.25 b' \
+       "$dir/a.log" '2022-06-01T10:00:02.5+02:00 a' \
+       | assert_merge --timestamp=iso8601 "$dir/a.log" "$dir/b.log"
+printf 'Jun  1 10:00:00 a\nJun 10 09:00:00 a\n' > "$dir/a.log"
+printf 'Jun  9 23:00:00 b\n' > "$dir/b.log"
+printf '>>> %s\n%s\n\n>>> %s\n%s\n\n>>> %s\n%s\n' \
+       "$dir/a.log" 'Jun  1 10:00:00 a' "$dir/b.log" 'Jun  9 23:00:00 b' "$dir/a.log" 'Jun 10 09:00:00 a' \
+       | assert_merge --timestamp=syslog "$dir/a.log" "$dir/b.log"
+printf '1654077600.5 a\n1654077602 a\n' > "$dir/a.log"
+printf '1654077601 b\n' > "$dir/b.log"
+printf '>>> %s\n%s\n\n>>> %s\n%s\n\n>>> %s\n%s\n' \
+       "$dir/a.log" '1654077600.5 a' "$dir/b.log" '1654077601 b' "$dir/a.log" '1654077602 a' \
+       | assert_merge --timestamp=epoch "$dir/a.log" "$dir/b.log"
+printf '[1654077600500] a\n' > "$dir/a.log"
+printf '1654077600499 b\n' > "$dir/b.log"
+printf '>>> %s\n%s\n\n>>> %s\n%s\n' "$dir/b.log" '1654077600499 b' "$dir/a.log" '[1654077600500] a' \
+       | assert_merge --timestamp=epoch-ms "$dir/a.log" "$dir/b.log"
+
+# copying the rest of the last file
+seq -w 0 300000 > "$dir/big.lst"
+printf '0000005\n' > "$dir/one.lst"
+{ printf '>>> %s\n000000\n\n>>> %s\n0000005\n\n>>> %s\n' "$dir/big.lst" "$dir/one.lst" "$dir/big.lst"
+  tail -n +2 "$dir/big.lst"; } | assert_merge "$dir/big.lst" "$dir/one.lst"
+mkfifo "$dir/pipe"
+printf 'x\ny' > "$dir/pipe" &
+printf '>>> %s\nx\ny\n' "$dir/pipe" | assert_merge "$dir/pipe"
+
+# reading pipes ahead
+seq -w 1 2 30000 > "$dir/odd.lst"
+seq -w 2 2 30000 > "$dir/even.lst"
+for method in auto threads io_uring off; do
+    # io_uring might not be allowed
+    if ./tailmerge --read-ahead=$method /dev/null > /dev/null 2>&1; then
+        ./tailmerge --read-ahead=$method <(cat "$dir/odd.lst") <(cat "$dir/even.lst") \
+            | grep -v -e '^>>> ' -e '^$' | diff -u - <(seq -w 1 30000)
+        # a line split across reads that each return only part of it
+        ./tailmerge --read-ahead=$method <(printf '1\n3'; sleep 0.1; printf '3'; sleep 0.1; printf '3\n5\n') \
+                                         <(printf '2\n4\n') \
+            | grep -v -e '^>>> ' -e '^$' | diff -u - <(printf '1\n2\n333\n4\n5\n')
+        echo "Reading ahead with $method PASSED"
+    fi
+done
+
+# compressed files, with and without reading ahead
+gzip -c "$dir/odd.lst" > "$dir/odd.gz"
+{ gzip -c "$dir/even.lst" | head -c 7; } > "$dir/truncated.gz"
+# several gzip members after each other is valid
+{ head -n 3 "$dir/even.lst" | gzip -c; tail -n +4 "$dir/even.lst" | gzip -c; } > "$dir/even.gz"
+compressed="$dir/odd.gz $dir/even.gz"
+uncompressed="$dir/odd.lst $dir/even.lst"
+if command -v zstd > /dev/null; then
+    zstd -q -c "$dir/one.lst" > "$dir/one.zst"
+    compressed="$compressed $dir/one.zst"
+    uncompressed="$uncompressed $dir/one.lst"
+fi
+if command -v lz4 > /dev/null; then
+    lz4 -q -c "$dir/one.lst" > "$dir/one.lz4"
+    compressed="$compressed $dir/one.lz4"
+    uncompressed="$uncompressed $dir/one.lst"
+fi
+for method in threads off; do
+    # skip names, since they differ
+    if ./tailmerge --read-ahead=$method $compressed > "$dir/decompressed" 2> "$dir/decompress_error"; then
+        grep -v '^>>> ' "$dir/decompressed" | diff -u <(./tailmerge $uncompressed | grep -v '^>>> ') -
+        echo "Decompressing with read-ahead $method PASSED"
+    elif grep -q 'decompress.*with' "$dir/decompress_error"; then
+        echo "Decompressing skipped because a library is missing"
+    else
+        cat "$dir/decompress_error"
+        exit 1
+    fi
+    if ./tailmerge --read-ahead=$method "$dir/truncated.gz" > /dev/null 2>&1; then
+        echo "Truncated gzip file was accepted"
+        exit 1
+    fi
+done
+
+# output batches
+for size in 1 100 4K 1M; do
+    ./tailmerge --batch-size=$size "$dir/odd.lst" <(cat "$dir/even.lst") "$dir/one.lst" \
+        | diff -u <(./tailmerge "$dir/odd.lst" <(cat "$dir/even.lst") "$dir/one.lst") -
+    echo "Writing in batches of $size PASSED"
+done
+for size in 0 -1 1T 1KB ''; do
+    if ./tailmerge --batch-size=$size /dev/null 2> /dev/null; then
+        echo "Invalid batch size $size was accepted"
+        exit 1
+    fi
+done
+
+# starting and stopping at keys, by binary searching regular files and by reading pipes
+{ printf '>>> %s\n' "$dir/big.lst"; grep -E '^010[01]' "$dir/big.lst"; } \
+    | assert_merge --since=0100 --until=0101 "$dir/big.lst"
+./tailmerge --since=0100 --until=0101 <(cat "$dir/big.lst") | grep -v '^>>> ' \
+    | diff -u <(grep -E '^010[01]' "$dir/big.lst") -
+printf '1654077600 a\nno timestamp\n1654077700 b\ncontinued\n1654077800 c\n' > "$dir/a.log"
+printf '>>> %s\n1654077700 b\ncontinued\n' "$dir/a.log" \
+    | assert_merge --timestamp=epoch --since=1654077650 --until=1654077700 "$dir/a.log"
+now=$(date +%s)
+printf '%s a\n%s b\n%s c\n' $((now - 3*60*60)) $((now - 60*60)) $((now + 60*60)) > "$dir/a.log"
+printf '>>> %s\n%s b\n' "$dir/a.log" $((now - 60*60)) | assert_merge --timestamp=epoch --since=2h --until=0s "$dir/a.log"
+for bound in --since=x --until=h; do
+    if ./tailmerge --timestamp=epoch $bound /dev/null 2> /dev/null; then
+        echo "Invalid $bound was accepted"
+        exit 1
+    fi
+done
+
+# merging groups of files on separate threads
+for i in 1 2 3 4 5 6 7; do
+    seq -w $i 7 3000 > "$dir/shard$i.lst"
+done
+printf '0005\n0005\n0006' > "$dir/shard8.lst"
+shards=$(printf "$dir/shard%s.lst " 1 2 3 4 5 6 7 8)
+for jobs in 2 3 4 64; do
+    # the input is sorted, so ties only change which file equal lines are attributed to
+    ./tailmerge --jobs=$jobs $shards <(cat "$dir/odd.lst") "$dir/big.lst" | grep -v -e '^>>> ' -e '^$' \
+        | diff -u <(./tailmerge $shards <(cat "$dir/odd.lst") "$dir/big.lst" | grep -v -e '^>>> ' -e '^$') -
+    ./tailmerge -j $jobs "$dir/shard1.lst" "$dir/shard2.lst" "$dir/shard3.lst" "$dir/shard4.lst" \
+        | diff -u <(./tailmerge "$dir/shard1.lst" "$dir/shard2.lst" "$dir/shard3.lst" "$dir/shard4.lst") -
+    echo "Merging with $jobs jobs PASSED"
+done
+# splitting sorted files into ranges of keys, which are merged in parallel
+: > "$dir/empty.lst"
+for jobs in 2 3 16; do
+    # the boundaries are likely to be in the middle of a run from big.lst
+    ./tailmerge -j $jobs --split=ranges "$dir/big.lst" "$dir/one.lst" "$dir/shard8.lst" "$dir/empty.lst" \
+        | diff -u <(./tailmerge "$dir/big.lst" "$dir/one.lst" "$dir/shard8.lst" "$dir/empty.lst") -
+    ./tailmerge -j $jobs --split=ranges --timestamp=epoch $shards | grep -v -e '^>>> ' -e '^$' \
+        | diff -u <(./tailmerge --timestamp=epoch $shards | grep -v -e '^>>> ' -e '^$') -
+    echo "Merging ranges with $jobs jobs PASSED"
+done
+if ./tailmerge -j 2 --split=ranges "$dir/big.lst" <(cat "$dir/one.lst") > /dev/null 2>&1; then
+    echo "--split=ranges was accepted for a pipe"
+    exit 1
+fi
+for jobs in 0 -1 x ''; do
+    if ./tailmerge --jobs=$jobs /dev/null 2> /dev/null; then
+        echo "Invalid number of jobs $jobs was accepted"
+        exit 1
+    fi
+done
+if ./tailmerge -j 2 -f /dev/null /dev/null 2> /dev/null; then
+    echo "--jobs was accepted together with --follow"
+    exit 1
+fi
+
+# comparing only a key, after prefixes of different lengths
+printf 'web1 12 2022-06-01T10:00:05 a\nweb1 13 2022-06-01T10:00:09 b\n' > "$dir/web.log"
+printf 'database7 1 2022-06-01T10:00:01 c\nno timestamp\ndatabase7 2 2022-06-01T10:00:07 d\n' > "$dir/db.log"
+for key in -k3 "-t ' ' -k3,3" "'--key-regex=[0-9]{4}-[^ ]*'" "'--key-regex= ([0-9-]+T[^ ]*)'"; do
+    eval "key=($key)"
+    printf '>>> %s\n%s\n%s\n\n>>> %s\n%s\n\n>>> %s\n%s\n\n>>> %s\n%s\n' \
+        "$dir/db.log" 'database7 1 2022-06-01T10:00:01 c' 'no timestamp' \
+        "$dir/web.log" 'web1 12 2022-06-01T10:00:05 a' \
+        "$dir/db.log" 'database7 2 2022-06-01T10:00:07 d' \
+        "$dir/web.log" 'web1 13 2022-06-01T10:00:09 b' \
+        | assert_merge --timestamp=iso8601 "${key[@]}" "$dir/web.log" "$dir/db.log"
+done
+printf 'bbb 1\naaa 3\n' > "$dir/x.lst"
+printf 'ccc 2\n' > "$dir/y.lst"
+printf '>>> %s\nbbb 1\n\n>>> %s\nccc 2\n\n>>> %s\naaa 3\n' "$dir/x.lst" "$dir/y.lst" "$dir/x.lst" \
+    | assert_merge --key-bytes=5- "$dir/x.lst" "$dir/y.lst"
+printf '>>> %s\nweb1 13 2022-06-01T10:00:09 b\n' "$dir/web.log" \
+    | assert_merge -k3 --since=' 2022-06-01T10:00:08' "$dir/web.log" "$dir/db.log"
+for i in 1 2 3 4 5 6 7; do
+    sed "s/^/host$(printf "%${i}s" | tr ' ' x) $i /" "$dir/shard$i.lst" > "$dir/prefixed$i.lst"
+done
+prefixed=$(printf "$dir/prefixed%s.lst " 1 2 3 4 5 6 7)
+for how in files ranges; do
+    ./tailmerge -k3 -j 3 --split=$how $prefixed | grep -v -e '^>>> ' -e '^$' | cut -d ' ' -f 3 \
+        | diff -u <(./tailmerge $(printf "$dir/shard%s.lst " 1 2 3 4 5 6 7) | grep -v -e '^>>> ' -e '^$') -
+    echo "Merging by key with --split=$how PASSED"
+done
+
+# comparing numbers and versions
+printf '5\n10\n200\n' > "$dir/a.lst"
+printf '7\n30\nnot a number\n1000\n' > "$dir/b.lst"
+printf '>>> %s\n5\n\n>>> %s\n7\n\n>>> %s\n10\n\n>>> %s\n30\nnot a number\n\n>>> %s\n200\n\n>>> %s\n1000\n' \
+       "$dir/a.lst" "$dir/b.lst" "$dir/a.lst" "$dir/b.lst" "$dir/a.lst" "$dir/b.lst" \
+    | assert_merge -n "$dir/a.lst" "$dir/b.lst"
+printf 'size 1K\nsize 3K\nsize 1M\n' > "$dir/a.lst"
+printf 'size 900\nsize 2K\nsize 1.5G\n' > "$dir/b.lst"
+printf '>>> %s\n%s\n\n>>> %s\n%s\n\n>>> %s\n%s\n\n>>> %s\n%s\n%s\n\n>>> %s\n%s\n' \
+       "$dir/b.lst" 'size 900' "$dir/a.lst" 'size 1K' "$dir/b.lst" 'size 2K' "$dir/a.lst" 'size 3K' 'size 1M' \
+       "$dir/b.lst" 'size 1.5G' \
+    | assert_merge --human-numeric-sort -k2 "$dir/a.lst" "$dir/b.lst"
+# like sort -h the suffix is compared first, even when the number makes the size smaller
+printf -- '-1K\n-5\n0\n5\n991M\n2G\n' > "$dir/a.lst"
+printf -- '-3\n0.5K\n0.9G\n1.5E\n' > "$dir/b.lst"
+./tailmerge --human-numeric-sort "$dir/a.lst" "$dir/b.lst" | grep -v -e '^>>> ' -e '^$' \
+    | diff -u <(printf -- '-1K\n-5\n-3\n0\n5\n0.5K\n991M\n0.9G\n2G\n1.5E\n') -
+echo "Comparing mixed suffixes like sort -h PASSED"
+printf 'nan\n1e2\n' > "$dir/a.lst"
+printf '5e1\n1e3\n' > "$dir/b.lst"
+printf '>>> %s\nnan\n\n>>> %s\n5e1\n\n>>> %s\n1e2\n\n>>> %s\n1e3\n' \
+       "$dir/a.lst" "$dir/b.lst" "$dir/a.lst" "$dir/b.lst" \
+    | assert_merge -g "$dir/a.lst" "$dir/b.lst"
+printf 'v1.2\nv1.10\n' > "$dir/a.lst"
+printf 'v1.9\nv1.010.1\n' > "$dir/b.lst"
+printf '>>> %s\nv1.2\n\n>>> %s\nv1.9\n\n>>> %s\nv1.10\n\n>>> %s\nv1.010.1\n' \
+       "$dir/a.lst" "$dir/b.lst" "$dir/a.lst" "$dir/b.lst" \
+    | assert_merge -V "$dir/a.lst" "$dir/b.lst"
+# letters are before other bytes and ~ before the end, like with sort -V
+printf '0.12a\n1.0~rc1\n1.0\n' > "$dir/a.lst"
+printf '0.12.21\n1.0a\n' > "$dir/b.lst"
+./tailmerge -V "$dir/a.lst" "$dir/b.lst" | grep -v -e '^>>> ' -e '^$' \
+    | diff -u <(printf '0.12a\n0.12.21\n1.0~rc1\n1.0\n1.0a\n') -
+echo "Comparing versions like sort -V PASSED"
+for i in 1 2 3 4 5 6 7 8; do
+    seq $i 8 1000 > "$dir/numbers$i.lst"
+done
+numbers=$(printf "$dir/numbers%s.lst " 1 2 3 4 5 6 7 8)
+for args in '' '-j 3' '-j 3 --split=ranges'; do
+    # numbers sort differently as strings, and eight files are merged with a loser tree
+    ./tailmerge -n $args $numbers | grep -v -e '^>>> ' -e '^$' | diff -u <(seq 1 1000) -
+    echo "Merging numbers with ${args:-no other options} PASSED"
+done
+./tailmerge -n --since=99 --until=200 $numbers | grep -v -e '^>>> ' -e '^$' | diff -u <(seq 99 200) -
+
+# parking files when too many are open
+for i in $(seq 1 40); do
+    seq -f '%05g' $i 40 4000 > "$dir/many$i.lst"
+done
+many=$(printf "$dir/many%s.lst " $(seq 1 40))
+./tailmerge $many > "$dir/unparked"
+for args in '--max-open=1' '--max-open=7 --memory=16K --batch-size=1K' '--max-open=7 -j 3' \
+            '--max-open=7 -j 3 --split=ranges'; do
+    ./tailmerge $args $many | diff -u "$dir/unparked" -
+    echo "Merging with $args PASSED"
+done
+(ulimit -n 30 && ./tailmerge $many) | diff -u "$dir/unparked" -
+./tailmerge --max-open=3 --since=01000 --until=02000 $many | grep -v -e '^>>> ' -e '^$' \
+    | diff -u <(seq -f '%05g' 1000 2000) -
+echo "Merging more files than can be open PASSED"
+
+# sidecar indexes, which must find the same lines as searching the files
+./tailmerge --build-index=7 $many
+./tailmerge --since=01000 --until=02000 $many | grep -v -e '^>>> ' -e '^$' | diff -u <(seq -f '%05g' 1000 2000) -
+./tailmerge --max-open=7 -j 3 --split=ranges $many | diff -u "$dir/unparked" -
+# a rewritten file isn't searched with its old index
+seq -f '%05g' 2 40 4000 > "$dir/many1.lst"
+./tailmerge --since=03001 "$dir/many1.lst" | grep -v -e '^>>> ' -e '^$' | diff -u <(seq -f '%05g' 3002 40 4000) -
+# compressed files can be started at any gzip member
+for n in 0 1 2 3; do
+    seq -f '%05g' $((n * 100 + 1)) $((n * 100 + 100)) | gzip -c
+done > "$dir/members.gz"
+./tailmerge --build-index=10 "$dir/members.gz"
+./tailmerge --since=00250 "$dir/members.gz" | grep -v -e '^>>> ' -e '^$' | diff -u <(seq -f '%05g' 250 400) -
+rm "$dir"/*.tmidx
+echo "Merging with indexes PASSED"
+
+# lines longer than the buffers, which grow to compare all of them
+long=$(head -c 100000 /dev/zero | tr '\0' x)
+printf '%s1\n%s3\n' "$long" "$long" > "$dir/a.lst"
+printf '%s2\n%s4\n' "$long" "$long" > "$dir/b.lst"
+for args in '--read-ahead=off' '--read-ahead=threads' '--buffer-size=8K'; do
+    ./tailmerge $args <(cat "$dir/a.lst") <(cat "$dir/b.lst") | grep -v -e '^>>> ' -e '^$' | tr -d x \
+        | diff -u <(seq 1 4) -
+    echo "Merging long lines with $args PASSED"
+done
+# a long line skipped by --since leaves a grown buffer that nothing refers to, which is shrunk
+# while keeping the start of the next line
+printf '%s1\n%s2\n%s3\ny1\ny2\n' "$long" "$long" "$long" > "$dir/a.lst"
+for args in '--read-ahead=off' '--read-ahead=threads'; do
+    ./tailmerge_asan $args --since=y <(cat "$dir/a.lst") | grep -v -e '^>>> ' -e '^$' | diff -u <(printf 'y1\ny2\n') -
+done
+echo "Shrinking buffers after skipping long lines PASSED"
+if ./tailmerge --buffer-size=1K /dev/null 2> /dev/null; then
+    echo "Too small --buffer-size was accepted"
+    exit 1
+fi
+for key in -k0 -k2,1 -k1. --key-bytes=- --key-bytes=0-1 '--key-regex=(' '-k1 --key-bytes=1-' '-t ab -k1' '-n -g' '-V --timestamp=epoch'; do
+    if ./tailmerge $key /dev/null 2> /dev/null; then
+        echo "Invalid key $key was accepted"
+        exit 1
+    fi
+done
+
+# following files as they grow, waiting a while for earlier lines
+: > "$dir/a.log"
+printf '1\n' > "$dir/b.log"
+{ timeout 2.5 ./tailmerge -f --latency=300 "$dir/a.log" "$dir/b.log" > "$dir/followed" || true; } &
+sleep 0.7
+printf '3\n' >> "$dir/a.log"
+sleep 0.1
+printf '2\n' >> "$dir/b.log"
+sleep 0.1
+# rotation: the rest of the old file is read before switching to the new one
+mv "$dir/a.log" "$dir/a.log.1"
+printf '4\n' >> "$dir/a.log.1"
+printf '5\n' > "$dir/a.log"
+wait
+printf '>>> %s\n1\n2\n\n>>> %s\n3\n4\n5\n' "$dir/b.log" "$dir/a.log" | diff -u - "$dir/followed"
+echo "Following PASSED"
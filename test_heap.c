@@ -14,11 +14,14 @@
  * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _POSIX_C_SOURCE 200809L // clock_gettime()
 #include "heap.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <stdint.h>
+#include <time.h>
 
 typedef void(*pop_callback)(struct iovec str, int inserted);
 
@@ -49,6 +52,23 @@ static int perform_sequence(struct heap *heap, const char* input, pop_callback p
             int value = heap_pop_slice_value(heap, &string);
             pop_callback(string, value);
             input = pos + 1;
+        } else if (*pos == '+') {
+            // pop one and push preceeding in one step, also if empty
+            struct iovec key = {.iov_base = (void*)input, .iov_len = pos - input};
+            insert_number++;
+            // the runner-up must predict whether the new entry becomes the minimum
+            int runner_up = heap_find_runner_up(heap);
+            bool stays = runner_up == -1 || heap_top_stays_slice(heap, runner_up, key);
+            struct iovec string;
+            int value = heap_replace_top_slice(heap, &string, key, insert_number);
+            if (stays != (heap_peek_value(heap) == insert_number)) {
+                printf("FAILED\nReplacing with %.*s %s the minimum, but heap_top_stays_slice() said %s\n",
+                       (int)key.iov_len, (char*)key.iov_base,
+                       stays ? "didn't keep it" : "kept it", stays ? "it would" : "it wouldn't");
+                exit(EXIT_FAILURE);
+            }
+            pop_callback(string, value);
+            input = pos + 1;
         }
         pos++;
     }
@@ -165,10 +185,15 @@ static void pop_verbose(struct iovec string, int insert_number) {
 }
 
 static void usage(const char* argv0) {
-    fprintf(stderr, "Usage: %s <heap value> string1,string2-,string3,... ...\n", argv0);
-    fprintf(stderr, "       %s assert input expected_output [expected values [expected_max_value]]\n", argv0);
-    fprintf(stderr, "',' pushes the preceeding characters, '-' pops one,");
+    fprintf(stderr, "Usage: %s [--loser-tree] <heap value> string1,string2-,string3,... ...\n", argv0);
+    fprintf(stderr, "       %s [--loser-tree] assert input expected_output [expected values [expected_max_value]]\n", argv0);
+    fprintf(stderr, "       %s bench [operations [fan-ins [workloads [backends]]]]\n", argv0);
+    fprintf(stderr, "',' pushes the preceeding characters, '-' pops one, '+' does both but pops first,\n");
     fprintf(stderr, "at the end of each argument, all entries are popped.\n");
+    fprintf(stderr, "bench measures ns and comparisons per line merged with comma-separated fan-ins (2 to 65536),\n");
+    fprintf(stderr, "workloads (random, merge, prefix, equal, runs, round-robin) and backends (heap-pop-push,\n");
+    fprintf(stderr, "heap-replace, tree-replace, heap-runner-up, tree-runner-up), all by default.\n");
+    fprintf(stderr, "Comparisons are only counted when compiled with -DHEAP_COUNT_COMPARISONS.\n");
     exit(EX_USAGE);
 }
 
@@ -194,9 +219,269 @@ static unsigned int parse_unsigned(const char* arg, const char* desc, unsigned i
     return value;
 }
 
+/// keys for the benchmark: each value (source) owns a slot that its next key is written into,
+/// like a line in the buffer of a file.
+#define BENCH_KEY_LENGTH 48
+/// shared bytes before the counter in the prefix workload, which defeats the cached key prefix
+#define BENCH_SHARED_PREFIX 32
+#define BENCH_RANDOM_KEYS 4096
+
+enum bench_workload {
+    BENCH_RANDOM, //< unordered random keys
+    BENCH_MERGE, //< each source's keys increase by a random step, like merging randomly interleaved files
+    BENCH_PREFIX, //< like merge, but all keys share a long prefix
+    BENCH_EQUAL, //< all keys are equal, so ties decide everything
+    BENCH_RUNS, //< the source on top keeps winning for long runs
+    BENCH_ROUND_ROBIN, //< the replaced key always becomes the greatest, so it sinks all the way down
+    BENCH_WORKLOADS
+};
+static const char *BENCH_WORKLOAD_NAMES[BENCH_WORKLOADS] = {
+    "random", "merge", "prefix", "equal", "runs", "round-robin"
+};
+
+enum bench_backend {
+    BENCH_HEAP_POP_PUSH,
+    BENCH_HEAP_REPLACE,
+    BENCH_TREE_REPLACE,
+    BENCH_HEAP_RUNNER_UP, //< like tailmerge: compare with the runner-up and replace only when a run ends
+    BENCH_TREE_RUNNER_UP,
+    BENCH_BACKENDS
+};
+static const char *BENCH_BACKEND_NAMES[BENCH_BACKENDS] = {
+    "heap-pop-push", "heap-replace", "tree-replace", "heap-runner-up", "tree-runner-up"
+};
+
+struct bench_state {
+    enum bench_workload workload;
+    unsigned int fan_in;
+    char *slots; //< fan_in * BENCH_KEY_LENGTH
+    uint64_t *counters; //< the numeric key of each source
+    char *random_keys; //< BENCH_RANDOM_KEYS * BENCH_KEY_LENGTH
+    uint64_t random;
+    uint64_t greatest; //< round-robin: the greatest key given out
+};
+
+static uint64_t bench_random(struct bench_state *state) {
+    state->random ^= state->random >> 12;
+    state->random ^= state->random << 25;
+    state->random ^= state->random >> 27;
+    return state->random * 0x2545F4914F6CDD1DULL;
+}
+
+/// write the counter as a big-endian integer after the shared prefix if any
+static struct iovec bench_counter_key(struct bench_state *state, int source) {
+    char *slot = &state->slots[source * BENCH_KEY_LENGTH];
+    size_t offset = state->workload == BENCH_PREFIX ? BENCH_SHARED_PREFIX : 0;
+    uint64_t counter = state->counters[source];
+    for (int i=7; i>=0; i--) {
+        slot[offset + i] = (char)(counter & 0xff);
+        counter >>= 8;
+    }
+    struct iovec key = {.iov_base = slot, .iov_len = offset + 8};
+    return key;
+}
+
+/// the first key of a source
+static struct iovec bench_first_key(struct bench_state *state, int source) {
+    switch (state->workload) {
+        case BENCH_RANDOM: {
+            struct iovec key = {
+                .iov_base = &state->random_keys[(bench_random(state) % BENCH_RANDOM_KEYS) * BENCH_KEY_LENGTH],
+                .iov_len = 16
+            };
+            return key;
+        }
+        case BENCH_EQUAL: {
+            struct iovec key = {.iov_base = state->slots, .iov_len = 16};
+            return key;
+        }
+        case BENCH_RUNS:
+            // far enough apart that a source stays on top for a long time
+            state->counters[source] = (uint64_t)source << 20;
+            break;
+        case BENCH_ROUND_ROBIN:
+            state->counters[source] = source;
+            state->greatest = source;
+            break;
+        default:
+            state->counters[source] = bench_random(state) % (2 * state->fan_in);
+    }
+    return bench_counter_key(state, source);
+}
+
+/// the key that follows the current one of a source
+static struct iovec bench_next_key(struct bench_state *state, int source) {
+    switch (state->workload) {
+        case BENCH_RANDOM:
+        case BENCH_EQUAL:
+            return bench_first_key(state, source);
+        case BENCH_RUNS:
+            state->counters[source]++;
+            break;
+        case BENCH_ROUND_ROBIN:
+            state->counters[source] = ++state->greatest;
+            break;
+        default:
+            state->counters[source] += 1 + bench_random(state) % (2 * state->fan_in);
+    }
+    return bench_counter_key(state, source);
+}
+
+static double bench_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/// fill a heap with fan_in keys, and then merge `operations` more lines through it.
+static void bench_one(enum bench_workload workload, enum bench_backend backend, unsigned int fan_in,
+                      unsigned long operations) {
+    struct bench_state state = {
+        .workload = workload,
+        .fan_in = fan_in,
+        .slots = calloc(fan_in, BENCH_KEY_LENGTH),
+        .counters = calloc(fan_in, sizeof(uint64_t)),
+        .random_keys = malloc(BENCH_RANDOM_KEYS * BENCH_KEY_LENGTH),
+        .random = 0x9E3779B97F4A7C15ULL,
+        .greatest = 0
+    };
+    bool loser_tree = backend == BENCH_TREE_REPLACE || backend == BENCH_TREE_RUNNER_UP;
+    struct heap heap = loser_tree ? heap_create_loser_tree(SLICE_MIN, fan_in) : heap_create(SLICE_MIN, fan_in);
+    void *memory = malloc(heap_get_needed_memory(&heap));
+    if (state.slots == NULL || state.counters == NULL || state.random_keys == NULL || memory == NULL) {
+        fputs("Not enough memory.\n", stderr);
+        exit(EX_UNAVAILABLE);
+    }
+    heap_set_memory(&heap, memory);
+    for (int i=0; i<BENCH_RANDOM_KEYS * BENCH_KEY_LENGTH; i++) {
+        state.random_keys[i] = 'a' + bench_random(&state) % 26;
+    }
+    memset(state.slots, 'x', fan_in * BENCH_KEY_LENGTH);
+    for (unsigned int source=0; source<fan_in; source++) {
+        heap_push_slice(&heap, bench_first_key(&state, source), source);
+    }
+    // the first replacement of a loser tree builds it, which shouldn't count
+    heap_find_runner_up(&heap);
+
+    unsigned long long comparisons_before = heap_comparisons();
+    double start = bench_seconds();
+    unsigned long done = 0;
+    while (done < operations) {
+        int source = heap_peek_value(&heap);
+        if (backend == BENCH_HEAP_POP_PUSH) {
+            heap_pop_slice_value(&heap, NULL);
+            heap_push_slice(&heap, bench_next_key(&state, source), source);
+            done++;
+        } else if (backend == BENCH_HEAP_REPLACE || backend == BENCH_TREE_REPLACE) {
+            heap_replace_top_slice(&heap, NULL, bench_next_key(&state, source), source);
+            done++;
+        } else {
+            int runner_up = heap_find_runner_up(&heap);
+            struct iovec key;
+            do {
+                key = bench_next_key(&state, source);
+                done++;
+            } while (done < operations && (runner_up == -1 || heap_top_stays_slice(&heap, runner_up, key)));
+            heap_replace_top_slice(&heap, NULL, key, source);
+        }
+    }
+    double seconds = bench_seconds() - start;
+    unsigned long long comparisons = heap_comparisons() - comparisons_before;
+
+    printf("%-12s %-15s %6u %10.1f ", BENCH_WORKLOAD_NAMES[workload], BENCH_BACKEND_NAMES[backend], fan_in,
+           seconds * 1e9 / operations);
+#ifdef HEAP_COUNT_COMPARISONS
+    printf("%10.2f\n", (double)comparisons / operations);
+#else
+    (void)comparisons;
+    printf("%10s\n", "-");
+#endif
+    fflush(stdout);
+    free(heap_get_memory(&heap));
+    free(state.slots);
+    free(state.counters);
+    free(state.random_keys);
+}
+
+/// parse a comma-separated list of names into a bitmask, or all of them if arg is NULL
+static unsigned int bench_names(const char *arg, const char **names, int count, const char *desc) {
+    if (arg == NULL) {
+        return (1u << count) - 1;
+    }
+    unsigned int chosen = 0;
+    while (*arg != '\0') {
+        size_t length = strcspn(arg, ",");
+        int i = 0;
+        while (i < count && (strlen(names[i]) != length || strncmp(names[i], arg, length) != 0)) {
+            i++;
+        }
+        if (i == count) {
+            fprintf(stderr, "Unknown %s %.*s\n", desc, (int)length, arg);
+            exit(EX_USAGE);
+        }
+        chosen |= 1u << i;
+        arg += length + (arg[length] == ',');
+    }
+    return chosen;
+}
+
+static int bench(int argc, char **argv) {
+    unsigned long operations = argc > 1 ? parse_unsigned(argv[1], "number of operations", ~0u) : 1000000;
+    static const unsigned int DEFAULT_FAN_INS[] = {2, 4, 16, 64, 256, 1024, 4096, 16384, 65536};
+    unsigned int fan_ins[32];
+    int fan_ins_length = 0;
+    if (argc > 2) {
+        char *list = argv[2];
+        while (*list != '\0' && fan_ins_length < 32) {
+            size_t length = strcspn(list, ",");
+            char number[16];
+            snprintf(number, sizeof(number), "%.*s", (int)length, list);
+            fan_ins[fan_ins_length] = parse_unsigned(number, "fan-in", 65536);
+            if (fan_ins[fan_ins_length] < 1) {
+                fputs("fan-in must be at least 1\n", stderr);
+                exit(EX_USAGE);
+            }
+            fan_ins_length++;
+            list += length + (list[length] == ',');
+        }
+    } else {
+        fan_ins_length = sizeof(DEFAULT_FAN_INS) / sizeof(*DEFAULT_FAN_INS);
+        memcpy(fan_ins, DEFAULT_FAN_INS, sizeof(DEFAULT_FAN_INS));
+    }
+    unsigned int workloads = bench_names(argc > 3 ? argv[3] : NULL, BENCH_WORKLOAD_NAMES, BENCH_WORKLOADS,
+                                         "workload");
+    unsigned int backends = bench_names(argc > 4 ? argv[4] : NULL, BENCH_BACKEND_NAMES, BENCH_BACKENDS,
+                                        "backend");
+
+    printf("%-12s %-15s %6s %10s %10s\n", "workload", "backend", "fan-in", "ns/op", "cmp/op");
+    for (int w=0; w<BENCH_WORKLOADS; w++) {
+        for (int f=0; f<fan_ins_length; f++) {
+            for (int b=0; b<BENCH_BACKENDS; b++) {
+                if ((workloads & (1u << w)) != 0 && (backends & (1u << b)) != 0) {
+                    bench_one(w, b, fan_ins[f], operations);
+                }
+            }
+        }
+    }
+    return EX_OK;
+}
+
 int main(int argc, char** argv) {
+    const char* argv0 = argv[0];
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        if (argc > 6) {
+            usage(argv0);
+        }
+        return bench(argc - 1, argv + 1);
+    }
+    struct heap (*create)(enum heap_type, unsigned int) = heap_create;
+    if (argc > 1 && strcmp(argv[1], "--loser-tree") == 0) {
+        create = heap_create_loser_tree;
+        argv++;
+        argc--;
+    }
     if (argc < 2) {
-        usage(argv[0]);
+        usage(argv0);
     }
 
     // normalize input generated from commands such as `seq`
@@ -210,7 +495,7 @@ int main(int argc, char** argv) {
 
     if (strcmp(argv[1], "assert") == 0) {
         if (argc < 3 || argc > 6) {
-            usage(argv[0]);
+            usage(argv0);
         }
         const char* input = argv[2];
         const char* expected_output = argc<4 ? NULL : (*argv[3] == '\0' ? NULL : argv[3]);
@@ -218,13 +503,13 @@ int main(int argc, char** argv) {
         int expected_max_value = argc<6 ? -1 : (int)parse_unsigned(argv[5], "max value", ~0>>1);
 
         int max_size = strlen(input);
-        struct heap heap = heap_create(SLICE_MIN, max_size);
+        struct heap heap = create(SLICE_MIN, max_size);
         heap_set_memory(&heap, malloc(heap_get_needed_memory(&heap)));
         assert_sequence(&heap, input, expected_output, expected_values, expected_max_value);
         return EX_OK;
     }
 
-    struct heap heap = heap_create(SLICE_MIN, parse_unsigned(argv[1], "heap value", ~0));
+    struct heap heap = create(SLICE_MIN, parse_unsigned(argv[1], "heap value", ~0));
     heap_set_memory(&heap, malloc(heap_get_needed_memory(&heap)));
     for (int arg=2; arg<argc; arg++) {
         perform_sequence(&heap, argv[arg], pop_verbose);
@@ -0,0 +1,230 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "timestamp.h"
+#include <string.h>
+#include <stdint.h>
+
+bool timestamp_format_from_name(const char *name, enum timestamp_format *format) {
+    if (strcmp(name, "iso8601") == 0 || strcmp(name, "iso") == 0) {
+        *format = TIMESTAMP_ISO8601;
+    } else if (strcmp(name, "syslog") == 0) {
+        *format = TIMESTAMP_SYSLOG;
+    } else if (strcmp(name, "epoch") == 0) {
+        *format = TIMESTAMP_EPOCH;
+    } else if (strcmp(name, "epoch-ms") == 0) {
+        *format = TIMESTAMP_EPOCH_MILLIS;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/// parse exactly `count` digits
+static bool parse_digits(const char **pos, const char *end, int count, int *value) {
+    if (end - *pos < count) {
+        return false;
+    }
+    int parsed = 0;
+    for (int i=0; i<count; i++) {
+        char c = (*pos)[i];
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        parsed = parsed*10 + (c - '0');
+    }
+    *pos += count;
+    *value = parsed;
+    return true;
+}
+
+/// parse the digits after a decimal separator as microseconds, ignoring any beyond that
+static long parse_fraction(const char **pos, const char *end) {
+    long micros = 0;
+    int digits = 0;
+    while (*pos < end && **pos >= '0' && **pos <= '9') {
+        if (digits < 6) {
+            micros = micros*10 + (**pos - '0');
+            digits++;
+        }
+        (*pos)++;
+    }
+    for (; digits < 6; digits++) {
+        micros *= 10;
+    }
+    return micros;
+}
+
+static bool skip_char(const char **pos, const char *end, char c) {
+    if (*pos < end && **pos == c) {
+        (*pos)++;
+        return true;
+    }
+    return false;
+}
+
+/// days since 1970-01-01 in the proleptic Gregorian calendar,
+/// from http://howardhinnant.github.io/date_algorithms.html#days_from_civil
+static int64_t days_from_civil(int64_t year, int month, int day) {
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year-399) / 400;
+    int64_t year_of_era = year - era * 400;
+    int64_t day_of_year = (153*(month > 2 ? month-3 : month+9) + 2)/5 + day-1;
+    int64_t day_of_era = year_of_era * 365 + year_of_era/4 - year_of_era/100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+}
+
+/// parse HH:MM:SS
+static bool parse_time_of_day(const char **pos, const char *end, bool seconds_optional, int64_t *seconds) {
+    int hour, minute, second = 0;
+    if (!parse_digits(pos, end, 2, &hour) || !skip_char(pos, end, ':')
+        || !parse_digits(pos, end, 2, &minute)) {
+        return false;
+    }
+    if (skip_char(pos, end, ':')) {
+        if (!parse_digits(pos, end, 2, &second)) {
+            return false;
+        }
+    } else if (!seconds_optional) {
+        return false;
+    }
+    if (hour > 24 || minute > 59 || second > 60) {
+        return false;
+    }
+    *seconds = hour*3600 + minute*60 + second;
+    return true;
+}
+
+static bool parse_iso8601(const char *pos, const char *end, struct timeval *parsed) {
+    int year, month, day;
+    if (!parse_digits(&pos, end, 4, &year) || !skip_char(&pos, end, '-')
+        || !parse_digits(&pos, end, 2, &month) || !skip_char(&pos, end, '-')
+        || !parse_digits(&pos, end, 2, &day)
+        || month < 1 || month > 12 || day < 1 || day > 31) {
+        return false;
+    }
+    int64_t seconds = days_from_civil(year, month, day) * 86400;
+    long micros = 0;
+    if (skip_char(&pos, end, 'T') || skip_char(&pos, end, ' ')) {
+        int64_t time_of_day;
+        if (!parse_time_of_day(&pos, end, true, &time_of_day)) {
+            return false;
+        }
+        seconds += time_of_day;
+        if (skip_char(&pos, end, '.') || skip_char(&pos, end, ',')) {
+            micros = parse_fraction(&pos, end);
+        }
+        // offset
+        if (!skip_char(&pos, end, 'Z') && pos < end && (*pos == '+' || *pos == '-')) {
+            int sign = *pos == '+' ? 1 : -1;
+            pos++;
+            int offset_hours, offset_minutes = 0;
+            if (!parse_digits(&pos, end, 2, &offset_hours)) {
+                return false;
+            }
+            skip_char(&pos, end, ':');
+            parse_digits(&pos, end, 2, &offset_minutes);
+            seconds -= sign * (offset_hours*3600 + offset_minutes*60);
+        }
+    }
+    parsed->tv_sec = seconds;
+    parsed->tv_usec = micros;
+    return true;
+}
+
+static bool parse_syslog(const char *pos, const char *end, struct timeval *parsed) {
+    static const char MONTHS[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    if (end - pos < 3) {
+        return false;
+    }
+    int month = 0;
+    while (month < 12 && memcmp(&MONTHS[month*3], pos, 3) != 0) {
+        month++;
+    }
+    if (month == 12) {
+        return false;
+    }
+    pos += 3;
+    if (!skip_char(&pos, end, ' ')) {
+        return false;
+    }
+    // the day is padded with a space
+    int day;
+    if (skip_char(&pos, end, ' ')) {
+        if (!parse_digits(&pos, end, 1, &day)) {
+            return false;
+        }
+    } else if (!parse_digits(&pos, end, 2, &day)) {
+        return false;
+    }
+    int64_t time_of_day;
+    if (day < 1 || day > 31 || !skip_char(&pos, end, ' ')
+        || !parse_time_of_day(&pos, end, false, &time_of_day)) {
+        return false;
+    }
+    // without a year, use one where February 29th exists
+    parsed->tv_sec = days_from_civil(1972, month+1, day) * 86400 + time_of_day;
+    parsed->tv_usec = 0;
+    return true;
+}
+
+static bool parse_epoch(const char *pos, const char *end, bool millis, struct timeval *parsed) {
+    bool negative = skip_char(&pos, end, '-');
+    int64_t integer = 0;
+    const char *digits_start = pos;
+    while (pos < end && *pos >= '0' && *pos <= '9' && pos - digits_start < 18) {
+        integer = integer*10 + (*pos - '0');
+        pos++;
+    }
+    if (pos == digits_start) {
+        return false;
+    }
+    long micros = 0;
+    if (skip_char(&pos, end, '.')) {
+        micros = parse_fraction(&pos, end);
+    }
+    if (millis) {
+        micros = (integer % 1000) * 1000 + micros / 1000;
+        integer /= 1000;
+    }
+    if (negative) {
+        // keep microseconds positive like struct timeval does
+        integer = -integer;
+        if (micros != 0) {
+            integer--;
+            micros = 1000000 - micros;
+        }
+    }
+    parsed->tv_sec = integer;
+    parsed->tv_usec = micros;
+    return true;
+}
+
+bool timestamp_parse(enum timestamp_format format, const char *line, size_t length, struct timeval *parsed) {
+    const char *pos = line;
+    const char *end = line + length;
+    while (pos < end && (*pos == ' ' || *pos == '\t')) {
+        pos++;
+    }
+    skip_char(&pos, end, '[');
+    switch (format) {
+        case TIMESTAMP_ISO8601: return parse_iso8601(pos, end, parsed);
+        case TIMESTAMP_SYSLOG: return parse_syslog(pos, end, parsed);
+        case TIMESTAMP_EPOCH: return parse_epoch(pos, end, false, parsed);
+        case TIMESTAMP_EPOCH_MILLIS: return parse_epoch(pos, end, true, parsed);
+    }
+    return false;
+}
@@ -0,0 +1,41 @@
+/* This file is part of tailmerge.
+ * Copyright (C) 2022 Torbjørn Birch Moltu
+ *
+ * Licenced under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later version.
+ *
+ * tailmerge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with tailmerge. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+//! Parsing of timestamps at the start of lines.
+
+#ifndef _TIMESTAMP_H_
+#define _TIMESTAMP_H_
+#include <sys/time.h> // struct timeval
+#include <stddef.h> // size_t
+#include <stdbool.h>
+
+enum timestamp_format {
+    TIMESTAMP_ISO8601, //< 2022-06-01T10:00:00.123+02:00, with optional seconds, fraction and offset
+    TIMESTAMP_SYSLOG, //< Jun  1 10:00:00, which doesn't have a year
+    TIMESTAMP_EPOCH, //< seconds since 1970 with an optional fraction
+    TIMESTAMP_EPOCH_MILLIS //< milliseconds since 1970
+};
+
+/// Returns false if the name isn't one of iso8601, syslog, epoch or epoch-ms.
+bool timestamp_format_from_name(const char *name, enum timestamp_format *format);
+
+/// Parses the timestamp at the start of a line, after any spaces or an opening bracket.
+/// Times without an offset are treated as UTC.
+/// Returns false if the line doesn't start with a timestamp in the format.
+bool timestamp_parse(enum timestamp_format format, const char *line, size_t length, struct timeval *parsed);
+
+#endif // !defined(_TIMESTAMP_H_)